@@ -0,0 +1,360 @@
+#!/usr/bin/env python
+"""
+Benchmark harness for d2q9-bgk.
+
+Sweeps input grids, OpenMP thread counts and kernel variants, times
+several runs of each configuration, checks the results with
+check/check.py, and writes the median MLUPS and the parallel
+efficiency of every configuration to CSV and JSON files.  Runs under
+Python 2.7 and 3, e.g.:
+
+  python bench.py
+  python bench.py --inputs 1024x1024,2048x2048 --variants fused,halo --iters 2000
+  make bench BENCH_ARGS="--threads 1,14,28"
+
+MLUPS come from the timestep loop alone, as reported by --profile,
+after --warmup timesteps that every run takes and throws away first.
+Full-length runs of the shipped inputs are checked against the
+reference results in check/; shortened (--iters) and synthetic runs
+against a run of the reference variant with the same grid and
+timesteps.  The checks use the native checker check/check once 'make
+checker' has built it, and check/check.py otherwise.
+"""
+
+from __future__ import division, print_function
+
+import argparse
+import csv
+import json
+import multiprocessing
+import os
+import re
+import shlex
+import subprocess
+import sys
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+# the inputs shipped with the code, and their reference results in check/
+INPUTS = ["128x128", "128x256", "256x256", "1024x1024"]
+
+# the geometry synthetic grids are scaled up from
+SYNTHETIC_BASE = "1024x1024"
+SYNTHETIC_ITERS = 1000
+
+# selectable kernel variants, by name
+VARIANTS = {
+    "fused":   [],
+    "halo":    ["--layout=halo"],
+    "aosoa":   ["--layout=aosoa"],
+    "scalar":  ["--simd=off"],
+    "weighted": ["--simd=off", "--schedule=weighted"],
+    "tblock":  ["--engine=tblock"],
+    "aa":      ["--engine=aa"],
+    "sparse":  ["--engine=sparse"],
+    "offload": ["--engine=offload"],
+    "delta16": ["--storage=delta16"],
+}
+DEFAULT_VARIANTS = "fused,halo,aosoa,scalar,tblock,aa,sparse"
+
+# the variant results without shipped references are checked against
+REFERENCE = "--simd=off"
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description="Benchmark sweep for d2q9-bgk")
+    parser.add_argument("--exe", default=os.path.join(HERE, "d2q9-bgk"), help="executable to run")
+    parser.add_argument("--launcher", default="", help="command to run it under, e.g. 'mpirun -np 2'")
+    parser.add_argument("--inputs", default=",".join(INPUTS),
+                        help="grids to run: the shipped NXxNY inputs, or any other size for a synthetic grid")
+    parser.add_argument("--threads", default=None,
+                        help="comma separated thread counts (default: powers of two up to OMP_NUM_THREADS)")
+    parser.add_argument("--variants", default=DEFAULT_VARIANTS,
+                        help="comma separated kernel variants, from: " + ", ".join(sorted(VARIANTS))
+                        + ", or NAME=OPTIONS for any other options")
+    parser.add_argument("--repeats", type=int, default=3, help="timed runs per configuration")
+    parser.add_argument("--warmup-iters", type=int, default=100,
+                        help="timesteps each run takes and throws away before it is timed")
+    parser.add_argument("--iters", type=int, default=None,
+                        help="timesteps per timed run instead of the input's maxIters; results are then checked "
+                        "against the reference variant")
+    parser.add_argument("--reference", default=REFERENCE,
+                        help="options of the variant that runs without shipped references are checked against "
+                        "(default: %s)" % REFERENCE)
+    parser.add_argument("--calibrate", action="store_true",
+                        help="also report each run's bandwidth as a percentage of a STREAM triad's")
+    parser.add_argument("--checker", default="auto", choices=["auto", "native", "python"],
+                        help="check results with check/check, built by 'make checker', or check/check.py "
+                        "(default: check/check if it has been built)")
+    parser.add_argument("--check-python", default="python", help="Python 2.7 interpreter to run check/check.py with")
+    parser.add_argument("--output", default="bench", help="directory for the results and the run directories")
+    return parser.parse_args()
+
+
+def median(values):
+    values = sorted(values)
+    n = len(values)
+
+    if n == 0:
+        return float("nan")
+
+    return values[n // 2] if n % 2 else 0.5 * (values[n // 2 - 1] + values[n // 2])
+
+
+def thread_counts(spec):
+    if spec:
+        return [int(t) for t in spec.split(",")]
+
+    most = int(os.environ.get("OMP_NUM_THREADS", multiprocessing.cpu_count()))
+    counts = []
+    t = 1
+
+    while t < most:
+        counts.append(t)
+        t *= 2
+
+    return counts + [most]
+
+
+def variant_list(spec):
+    variants = []
+
+    for name in spec.split(","):
+        if "=" in name:
+            name, options = name.split("=", 1)
+            variants.append((name, shlex.split(options)))
+        elif name in VARIANTS:
+            variants.append((name, VARIANTS[name]))
+        else:
+            sys.exit("unknown variant: " + name)
+
+    return variants
+
+
+def read_params(path):
+    with open(path) as f:
+        return [line.strip() for line in f if line.strip()]
+
+
+def write_params(path, params, iters):
+    params = list(params)
+    params[2] = str(iters)
+
+    with open(path, "w") as f:
+        f.write("\n".join(params) + "\n")
+
+
+def synthetic_input(name, directory):
+    """Scale the obstacles of SYNTHETIC_BASE up (or down) to an nx by ny grid."""
+    nx, ny = [int(n) for n in name.split("x")]
+    base_params = read_params(os.path.join(HERE, "input_%s.params" % SYNTHETIC_BASE))
+    bx, by = int(base_params[0]), int(base_params[1])
+    params_path = os.path.join(directory, "input_%s.params" % name)
+    obstacles_path = os.path.join(directory, "obstacles_%s.dat" % name)
+
+    if not os.path.exists(obstacles_path):
+        blocked = set()
+
+        with open(os.path.join(HERE, "obstacles_%s.dat" % SYNTHETIC_BASE)) as f:
+            for line in f:
+                x, y, _ = line.split()
+                blocked.add((int(x), int(y)))
+
+        with open(obstacles_path, "w") as f:
+            for y in range(ny):
+                for x in range(nx):
+                    if (x * bx // nx, y * by // ny) in blocked:
+                        f.write("%d %d 1\n" % (x, y))
+
+    params = [str(nx), str(ny), str(SYNTHETIC_ITERS), str(nx)] + base_params[4:]
+    write_params(params_path, params, SYNTHETIC_ITERS)
+
+    return params_path, obstacles_path
+
+
+def run(command, directory, threads):
+    env = dict(os.environ)
+    env["OMP_NUM_THREADS"] = str(threads)
+    proc = subprocess.Popen(command, cwd=directory, env=env, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    out = proc.communicate()[0].decode("utf-8", "replace")
+
+    return proc.returncode, out
+
+
+def check(args, directory, ref):
+    """Check the results in directory against ref.av_vels.dat and ref.final_state.dat."""
+    native = os.path.join(HERE, "check", "check")
+
+    if args.checker == "native" or (args.checker == "auto" and os.path.exists(native)):
+        checker = [native]
+    else:
+        checker = [args.check_python, os.path.join(HERE, "check", "check.py")]
+
+    command = checker + ["--ref-av-vels-file=%s.av_vels.dat" % ref,
+                         "--ref-final-state-file=%s.final_state.dat" % ref,
+                         "--av-vels-file=av_vels.dat", "--final-state-file=final_state.dat"]
+
+    # the native checker reads and compares the files on every core
+    try:
+        status, out = run(command, directory, multiprocessing.cpu_count() if checker == [native] else 1)
+    except OSError as e:
+        return "error: %s" % e
+
+    with open(os.path.join(directory, "check.txt"), "w") as f:
+        f.write(out)
+
+    return "passed" if status == 0 else "failed"
+
+
+def reference_run(args, launcher, exe, name, params, obstacles_path, threads):
+    """Run the reference variant once for the checks, returning the prefix of its results, or None."""
+    directory = os.path.abspath(os.path.join(args.output, "runs", "%s_reference_i%s" % (name, params[2])))
+    results = os.path.join(directory, "reference")
+
+    if not os.path.isdir(directory):
+        os.makedirs(directory)
+
+    run_params = os.path.join(directory, "reference.params")
+    write_params(run_params, params, int(params[2]))
+
+    print("%s reference (%s):" % (name, args.reference), end=" ")
+    sys.stdout.flush()
+    status, out = run(launcher + [exe, run_params, obstacles_path] + shlex.split(args.reference), directory, threads)
+
+    if status != 0:
+        print("failed")
+        print(out)
+        return None
+
+    for output in ("av_vels.dat", "final_state.dat"):
+        os.rename(os.path.join(directory, output), "%s.%s" % (results, output))
+
+    print("done")
+
+    return results
+
+
+def main():
+    args = parse_args()
+    launcher = shlex.split(args.launcher)
+    exe = os.path.abspath(args.exe)
+    inputs_dir = os.path.join(args.output, "inputs")
+    results = []
+
+    for directory in (args.output, inputs_dir):
+        if not os.path.isdir(directory):
+            os.makedirs(directory)
+
+    for name in args.inputs.split(","):
+        if name in INPUTS:
+            params_path = os.path.join(HERE, "input_%s.params" % name)
+            obstacles_path = os.path.join(HERE, "obstacles_%s.dat" % name)
+            shipped = args.iters is None
+        else:
+            params_path, obstacles_path = synthetic_input(name, inputs_dir)
+            shipped = False
+
+        params = read_params(params_path)
+
+        if args.iters:
+            params[2] = str(args.iters)
+
+        # full-length runs of the shipped inputs have reference results in check/
+        if shipped:
+            ref = os.path.join(HERE, "check", name)
+        else:
+            ref = reference_run(args, launcher, exe, name, params, obstacles_path, max(thread_counts(args.threads)))
+
+        for variant, options in variant_list(args.variants):
+            for threads in thread_counts(args.threads):
+                directory = os.path.abspath(os.path.join(args.output, "runs", "%s_%s_t%d" % (name, variant, threads)))
+
+                if not os.path.isdir(directory):
+                    os.makedirs(directory)
+
+                timed = os.path.join(directory, "timed.params")
+                write_params(timed, params, int(params[2]))
+
+                row = {"input": name, "variant": variant, "options": " ".join(options), "threads": threads,
+                       "repeats": args.repeats, "mlups": [], "elapsed": [], "roofline": [], "check": "not checked"}
+                timed_options = ["--calibrate" if args.calibrate else "--profile"] + options
+
+                # the warm-up faults in the lattice, starts the thread pool and
+                # brings the clocks up inside the timed process itself
+                if args.warmup_iters > 0:
+                    timed_options.append("--warmup=%d" % args.warmup_iters)
+
+                print("%s %s, %d threads:" % (name, variant, threads), end=" ")
+                sys.stdout.flush()
+
+                status = 0
+
+                for _ in range(args.repeats):
+                    status, out = run(launcher + [exe, timed, obstacles_path] + timed_options, directory, threads)
+
+                    if status != 0:
+                        break
+
+                    with open(os.path.join(directory, "output.txt"), "w") as f:
+                        f.write(out)
+
+                    row["mlups"].append(float(re.search(r"^MLUPS:\s*([0-9.eE+-]+)", out, re.M).group(1)))
+                    row["elapsed"].append(float(re.search(r"^Elapsed time:\s*([0-9.eE+-]+)", out, re.M).group(1)))
+
+                    if args.calibrate:
+                        row["roofline"].append(float(re.search(r"^bandwidth:.*, ([0-9.]+)% of", out, re.M).group(1)))
+
+                if status != 0:
+                    row["check"] = "run failed"
+                    print("failed")
+                    print(out)
+                elif ref is None:
+                    row["check"] = "reference failed"
+                else:
+                    row["check"] = check(args, directory, ref)
+
+                row["median_mlups"] = median(row["mlups"])
+                row["median_elapsed"] = median(row["elapsed"])
+                row["median_roofline"] = median(row["roofline"])
+
+                if status == 0:
+                    print("%.2f MLUPS, " % row["median_mlups"], end="")
+
+                    if args.calibrate:
+                        print("%.1f%% of the triad bandwidth, " % row["median_roofline"], end="")
+
+                    print(row["check"])
+
+                results.append(row)
+
+    # parallel efficiency against the fewest threads each input and variant ran on
+    for row in results:
+        same = [r for r in results if r["input"] == row["input"] and r["variant"] == row["variant"] and r["mlups"]]
+        row["efficiency"] = float("nan")
+
+        if row["mlups"] and same:
+            base = min(same, key=lambda r: r["threads"])
+            row["efficiency"] = (row["median_mlups"] / base["median_mlups"]) / (row["threads"] / base["threads"])
+
+    fields = ["input", "variant", "options", "threads", "repeats", "median_mlups", "median_elapsed",
+              "efficiency", "median_roofline", "check"]
+
+    with open(os.path.join(args.output, "bench.csv"), "w") as f:
+        writer = csv.DictWriter(f, fieldnames=fields, extrasaction="ignore")
+        writer.writeheader()
+        writer.writerows(dict(r, median_mlups="%.2f" % r["median_mlups"], median_elapsed="%.6f" % r["median_elapsed"],
+                              efficiency="%.3f" % r["efficiency"], median_roofline="%.1f" % r["median_roofline"])
+                         for r in results)
+
+    with open(os.path.join(args.output, "bench.json"), "w") as f:
+        json.dump(results, f, indent=2)
+
+    print("results in %s and %s" % (os.path.join(args.output, "bench.csv"), os.path.join(args.output, "bench.json")))
+
+    # a failed check or run is a regression
+    if any(r["check"] not in ("passed", "not checked") for r in results):
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
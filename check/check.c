@@ -0,0 +1,537 @@
+/*
+** Native result checker for d2q9-bgk.
+**
+** Compares the av_vels and final_state output of a run with reference
+** results as check/check.py does: the same options, the same relative
+** differences and tolerance, and the same report, down to the step and
+** the coordinates of the biggest difference.  It also reads the .npy
+** files of --output=binary, for the results and the references alike,
+** telling the formats apart by the NumPy magic string.  Build it with
+** 'make checker' and run it as check.py:
+**
+**   ./check/check --ref-av-vels-file=check/1024x1024.av_vels.dat
+**                 --ref-final-state-file=check/1024x1024.final_state.dat
+**                 --av-vels-file=av_vels.npy --final-state-file=final_state.npy
+**
+** A text file is mapped into memory and cut into one run of whole lines
+** per thread; the threads count the lines of their runs, and then parse
+** them straight into their place in the arrays.  The differences are
+** reduced in one vectorised pass over each array, and the place of the
+** biggest one found in a second.
+*/
+
+#define _GNU_SOURCE   /* madvise(), which -std=c99 hides */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <omp.h>
+
+#define NPY_MAGIC "\x93NUMPY"   /* the first bytes of a .npy file */
+
+/* the values compared from one file */
+typedef struct
+{
+  int     n;       /* number of av_vels steps, or of final_state cells */
+  double* value;   /* each step's average velocity, or each cell's pressure */
+  int*    col0;    /* final_state only: the first two columns of each */
+  int*    col1;    /* line, ii and jj, or their place in a .npy array */
+} t_values;
+
+/* the biggest difference between the reference and the results */
+typedef struct
+{
+  int    step;      /* where it is; check.py calls it a step in either file */
+  double diff;      /* reference minus result there */
+  double pcnt;      /* and as a percentage of the result */
+  double sim_val;   /* the result there */
+  double ref_val;   /* and the reference */
+  double total;     /* sum of the absolute differences */
+} t_diff;
+
+void die(const char* message, const char* path);
+void usage(const char* exe, const int status);
+
+/* map a whole file into memory, read only */
+const char* map_file(const char* path, size_t* len);
+
+/* fill values from av_vels (final_state = 0) or final_state (1) in either format */
+void read_values(const char* path, const int final_state, t_values* values);
+void read_text(const char* path, const char* data, const size_t len, const int final_state, t_values* values);
+void read_npy(const char* path, const char* data, const size_t len, const int final_state, t_values* values);
+
+/* the differences as check.py's get_diff_values() */
+void diff_values(const double* ref, const double* sim, const int n, t_diff* diff);
+
+int main(int argc, char* argv[])
+{
+  const char* names[4] = { "--ref-av-vels-file", "--ref-final-state-file", "--av-vels-file", "--final-state-file" };
+  const char* files[4] = { NULL, NULL, NULL, NULL };
+  double      tolerance = 1.;   /* percentage tolerance */
+  t_values    av_vels_ref, final_state_ref, av_vels_sim, final_state_sim;
+  t_diff      av_vels_diffs, final_state_diffs;
+
+  /* options as argparse takes them, --name=value or --name value */
+  for (int i = 1; i < argc; i++)
+  {
+    const char* arg = argv[i];
+    const char* eq = strchr(arg, '=');
+    const size_t len = eq ? (size_t)(eq - arg) : strlen(arg);
+    const char* value = NULL;
+    int         found = 0;
+
+    if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) usage(argv[0], EXIT_SUCCESS);
+
+    if (eq) value = eq + 1;
+    else if (i + 1 < argc) value = argv[++i];
+    else usage(argv[0], 2);
+
+    if (len == strlen("--tolerance") && !strncmp(arg, "--tolerance", len))
+    {
+      char* end;
+
+      tolerance = strtod(value, &end);
+
+      if (*value == '\0' || *end != '\0') usage(argv[0], 2);
+
+      found = 1;
+    }
+
+    for (int ff = 0; ff < 4; ff++)
+    {
+      if (len == strlen(names[ff]) && !strncmp(arg, names[ff], len))
+      {
+        files[ff] = value;
+        found = 1;
+      }
+    }
+
+    if (!found) usage(argv[0], 2);
+  }
+
+  for (int ff = 0; ff < 4; ff++)
+  {
+    if (files[ff] == NULL) usage(argv[0], 2);
+  }
+
+  /* open reference and input files */
+  read_values(files[0], 0, &av_vels_ref);
+  read_values(files[1], 1, &final_state_ref);
+  read_values(files[2], 0, &av_vels_sim);
+  read_values(files[3], 1, &final_state_sim);
+
+  /* make sure the coordinates are in the right order */
+  int mismatched = (final_state_ref.n != final_state_sim.n);
+
+  if (!mismatched)
+  {
+    #pragma omp parallel for simd reduction(|:mismatched)
+    for (int ii = 0; ii < final_state_ref.n; ii++)
+    {
+      mismatched |= (final_state_ref.col0[ii] != final_state_sim.col0[ii])
+                  | (final_state_ref.col1[ii] != final_state_sim.col1[ii]);
+    }
+  }
+
+  if (mismatched)
+  {
+    printf("Final state files coordinates were not the same\n");
+    return EXIT_FAILURE;
+  }
+
+  /* make sure the av_vels have the same number of steps */
+  if (av_vels_ref.n != av_vels_sim.n)
+  {
+    printf("Different number of steps in av_vels files\n");
+    return EXIT_FAILURE;
+  }
+
+  diff_values(av_vels_ref.value, av_vels_sim.value, av_vels_ref.n, &av_vels_diffs);
+
+  printf("Total difference in av_vels : %.12E\n", av_vels_diffs.total);
+  printf("Biggest difference (at step %d) : %.12E\n", av_vels_diffs.step, av_vels_diffs.diff);
+  printf("  %.12E vs. %.12E = %.2g%%\n", av_vels_diffs.sim_val, av_vels_diffs.ref_val, av_vels_diffs.pcnt);
+  printf("\n");
+
+  diff_values(final_state_ref.value, final_state_sim.value, final_state_ref.n, &final_state_diffs);
+
+  /* check.py labels the first column jj and the second ii */
+  printf("Total difference in final_state : %.12E\n", final_state_diffs.total);
+  printf("Biggest difference (at coord (%d,%d)) : %.12E\n", final_state_sim.col0[final_state_diffs.step],
+         final_state_sim.col1[final_state_diffs.step], final_state_diffs.diff);
+  printf("  %.12E vs. %.12E = %.2g%%\n", final_state_diffs.sim_val, final_state_diffs.ref_val, final_state_diffs.pcnt);
+  printf("\n");
+
+  /* find out if either of them failed */
+  const int final_state_failed = !isfinite(final_state_diffs.pcnt) || fabs(final_state_diffs.pcnt) > tolerance;
+  const int av_vels_failed = !isfinite(av_vels_diffs.pcnt) || fabs(av_vels_diffs.pcnt) > tolerance;
+
+  if (final_state_failed) printf("final state failed check\n");
+
+  if (av_vels_failed) printf("av_vels failed check\n");
+
+  if (final_state_failed || av_vels_failed) return EXIT_FAILURE;
+
+  printf("Both tests passed!\n");
+
+  return EXIT_SUCCESS;
+}
+
+void diff_values(const double* ref, const double* sim, const int n, t_diff* diff)
+{
+  double total = 0.;    /* sum of the absolute differences */
+  double biggest = 0.;  /* largest absolute percentage */
+  int    nans = 0;      /* percentages that are not a number */
+  int    step = n;      /* first place of the largest, or of the first NaN */
+
+  if (n == 0) die("no values to compare", "av_vels or final_state");
+
+  /* the percentage is of ref - diff, which is the result itself, as
+  ** in check.py, with the same order of operations */
+  #pragma omp parallel for simd reduction(+:total, nans) reduction(max:biggest)
+  for (int ii = 0; ii < n; ii++)
+  {
+    const double d = ref[ii] - sim[ii];
+    const double pcnt = fabs(100.0 * (d / (ref[ii] - d)));
+
+    total += fabs(d);
+    nans += isnan(pcnt);
+    biggest = (pcnt > biggest) ? pcnt : biggest;
+  }
+
+  /* NumPy's argmax takes the first NaN over any number, and the first
+  ** of equal values */
+  #pragma omp parallel for simd reduction(min:step)
+  for (int ii = 0; ii < n; ii++)
+  {
+    const double d = ref[ii] - sim[ii];
+    const double pcnt = fabs(100.0 * (d / (ref[ii] - d)));
+    const int    hit = nans ? isnan(pcnt) : (pcnt == biggest);
+
+    step = (hit && ii < step) ? ii : step;
+  }
+
+  diff->step = step;
+  diff->diff = ref[step] - sim[step];
+  diff->pcnt = 100.0 * (diff->diff / (ref[step] - diff->diff));
+  diff->sim_val = sim[step];
+  diff->ref_val = ref[step];
+  diff->total = total;
+}
+
+const char* map_file(const char* path, size_t* len)
+{
+  struct stat st;
+  const int   fd = open(path, O_RDONLY);
+  void*       data;
+
+  if (fd < 0 || fstat(fd, &st) != 0) die("could not open file", path);
+
+  *len = (size_t)st.st_size;
+
+  if (*len == 0) die("empty file", path);
+
+  data = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (data == MAP_FAILED) die("could not map file", path);
+
+  /* every page is read once, front to back */
+  madvise(data, *len, MADV_SEQUENTIAL);
+
+  return (const char*) data;
+}
+
+void read_values(const char* path, const int final_state, t_values* values)
+{
+  size_t      len;
+  const char* data = map_file(path, &len);
+
+  values->col0 = values->col1 = NULL;
+
+  if (len >= 6 && !memcmp(data, NPY_MAGIC, 6)) read_npy(path, data, len, final_state, values);
+  else read_text(path, data, len, final_state, values);
+
+  munmap((void*)data, len);
+}
+
+/* the start of the line after p, or end */
+static const char* next_line(const char* p, const char* end)
+{
+  const char* nl = memchr(p, '\n', end - p);
+
+  return nl ? nl + 1 : end;
+}
+
+/* the start of the first line starting at or after data + offset */
+static const char* line_from(const char* data, const char* end, const size_t offset)
+{
+  return (offset == 0) ? data : next_line(data + offset - 1, end);
+}
+
+/* whether the line starting at p holds any values: np.loadtxt skips
+** blank lines and # comments */
+static int data_line(const char* p, const char* end)
+{
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+
+  return p < end && *p != '\n' && *p != '#';
+}
+
+/* past the whitespace separated field at p */
+static const char* skip_field(const char* p, const char* end)
+{
+  while (p < end && (*p == ' ' || *p == '\t')) p++;
+
+  while (p < end && *p != ' ' && *p != '\t' && *p != '\n') p++;
+
+  return p;
+}
+
+void read_text(const char* path, const char* data, const size_t len, const int final_state, t_values* values)
+{
+  const char* end = data + len;
+  const int   nthreads = omp_get_max_threads();
+  int*        first = (int*) calloc(nthreads + 1, sizeof(int));  /* first line of each thread's run */
+  int         bad = 0;   /* lines that could not be parsed */
+
+  if (first == NULL) die("cannot allocate memory", path);
+
+  #pragma omp parallel reduction(+:bad)
+  {
+    const int   t = omp_get_thread_num();
+    const int   nt = omp_get_num_threads();
+    /* a run starts at the first line that starts in this thread's share of the bytes */
+    const char* lo = line_from(data, end, len / nt * t);
+    const char* hi = (t == nt - 1) ? end : line_from(data, end, len / nt * (t + 1));
+    int         lines = 0;
+
+    for (const char* p = lo; p < hi; p = next_line(p, hi)) lines += data_line(p, hi);
+
+    first[t + 1] = lines;
+
+    #pragma omp barrier
+    #pragma omp single
+    {
+      for (int tt = 0; tt < nt; tt++) first[tt + 1] += first[tt];
+
+      values->n = first[nt];
+      values->value = (double*) malloc(sizeof(double) * (values->n + 1));
+
+      if (final_state)
+      {
+        values->col0 = (int*) malloc(sizeof(int) * (values->n + 1));
+        values->col1 = (int*) malloc(sizeof(int) * (values->n + 1));
+      }
+
+      if (values->value == NULL || (final_state && (values->col0 == NULL || values->col1 == NULL)))
+      {
+        die("cannot allocate memory", path);
+      }
+    }
+
+    int line = first[t];
+
+    for (const char* p = lo; p < hi; p = next_line(p, hi))
+    {
+      char* next;
+
+      if (!data_line(p, hi)) continue;
+
+      /* av_vels lines are "step: value", final_state ones
+      ** "ii jj u_x u_y u pressure obstacle" */
+      if (final_state)
+      {
+        values->col0[line] = (int)strtol(p, &next, 10);
+        bad += (next == p);
+        p = next;
+        values->col1[line] = (int)strtol(p, &next, 10);
+        bad += (next == p);
+        p = next;
+
+        for (int field = 0; field < 3; field++) p = skip_field(p, hi);
+      }
+      else
+      {
+        p = skip_field(p, hi);
+      }
+
+      values->value[line] = strtod(p, &next);
+      bad += (next == p);
+      line++;
+    }
+  }
+
+  if (bad) die("could not parse file", path);
+
+  free(first);
+}
+
+/* the value of a .npy header key, e.g. 'shape' */
+static const char* npy_key(const char* header, const char* key, const char* path)
+{
+  char        quoted[32];
+  const char* p;
+
+  snprintf(quoted, sizeof(quoted), "'%s':", key);
+  p = strstr(header, quoted);
+
+  if (p == NULL) die("not a .npy file of d2q9-bgk", path);
+
+  p += strlen(quoted);
+
+  while (*p == ' ') p++;
+
+  return p;
+}
+
+/* a float field of a record, in its byte order */
+static double npy_float(const char* p, const int size, const int swap)
+{
+  char bytes[8];
+
+  for (int bb = 0; bb < size; bb++) bytes[bb] = p[swap ? size - 1 - bb : bb];
+
+  if (size == 4)
+  {
+    float f;
+
+    memcpy(&f, bytes, 4);
+
+    return f;
+  }
+  else
+  {
+    double d;
+
+    memcpy(&d, bytes, 8);
+
+    return d;
+  }
+}
+
+void read_npy(const char* path, const char* data, const size_t len, const int final_state, t_values* values)
+{
+  const uint16_t one = 1;
+  const char     host = *(const uint8_t*)&one ? '<' : '>';
+  size_t         header_len, offset = 0, record = 0;
+  char           header[4096];
+  char           order = '|';     /* byte order of the compared field */
+  int            size = 0;        /* and its width */
+  int            rows, cols = 1;
+
+  /* versions 1.0, and 2.0 and 3.0 with a longer length */
+  if (len < 10) die("not a .npy file of d2q9-bgk", path);
+
+  header_len = (data[6] == 1) ? (size_t)(uint8_t)data[8] | (size_t)(uint8_t)data[9] << 8
+                              : (size_t)(uint8_t)data[8] | (size_t)(uint8_t)data[9] << 8
+                                | (size_t)(uint8_t)data[10] << 16 | (size_t)(uint8_t)data[11] << 24;
+
+  const size_t start = ((data[6] == 1) ? 10 : 12) + header_len;
+
+  if (header_len >= sizeof(header) || start > len) die("not a .npy file of d2q9-bgk", path);
+
+  memcpy(header, data + (start - header_len), header_len);
+  header[header_len] = '\0';
+
+  if (strncmp(npy_key(header, "fortran_order", path), "False", 5) != 0) die("Fortran ordered .npy files are not read", path);
+
+  /* the floats of av_vels, or records holding a pressure field */
+  const char* descr = npy_key(header, "descr", path);
+
+  if (final_state)
+  {
+    if (sscanf(npy_key(header, "shape", path), "(%d, %d)", &rows, &cols) != 2) die("final_state is not 2-dimensional", path);
+
+    for (const char* field = strchr(descr, '('); field != NULL; field = strchr(field + 1, '('))
+    {
+      char name[64], type[16];
+
+      if (sscanf(field, "('%63[^']', '%15[^']')", name, type) != 2) break;
+
+      const int width = atoi(type + strcspn(type, "0123456789"));
+
+      if (!strcmp(name, "pressure"))
+      {
+        order = type[0];
+        size = width;
+        offset = record;
+      }
+
+      record += width;
+    }
+  }
+  else
+  {
+    char type[16];
+
+    if (sscanf(npy_key(header, "shape", path), "(%d,", &rows) != 1) die("av_vels is not 1-dimensional", path);
+
+    if (sscanf(descr, "'%15[^']'", type) != 1) die("not a .npy file of d2q9-bgk", path);
+
+    order = type[0];
+    size = atoi(type + strcspn(type, "0123456789"));
+    record = size;
+  }
+
+  if ((size != 4 && size != 8) || start + record * rows * cols > len) die("not a .npy file of d2q9-bgk", path);
+
+  const int   swap = (order == '<' || order == '>') && order != host;
+  const char* records = data + start;
+
+  values->n = rows * cols;
+  values->value = (double*) malloc(sizeof(double) * values->n);
+
+  if (final_state)
+  {
+    values->col0 = (int*) malloc(sizeof(int) * values->n);
+    values->col1 = (int*) malloc(sizeof(int) * values->n);
+  }
+
+  if (values->value == NULL || (final_state && (values->col0 == NULL || values->col1 == NULL)))
+  {
+    die("cannot allocate memory", path);
+  }
+
+  /* rows of the array are rows jj of the grid, as in the text */
+  #pragma omp parallel for schedule(static)
+  for (int cc = 0; cc < values->n; cc++)
+  {
+    values->value[cc] = npy_float(records + record * cc + offset, size, swap);
+
+    if (final_state)
+    {
+      values->col0[cc] = cc % cols;
+      values->col1[cc] = cc / cols;
+    }
+  }
+}
+
+void die(const char* message, const char* path)
+{
+  fprintf(stderr, "%s: %s\n", path, message);
+  exit(EXIT_FAILURE);
+}
+
+void usage(const char* exe, const int status)
+{
+  FILE* fp = status ? stderr : stdout;
+
+  fprintf(fp, "usage: %s [--tolerance TOLERANCE] --ref-av-vels-file REF_AV_VELS_FILE\n", exe);
+  fprintf(fp, "       --ref-final-state-file REF_FINAL_STATE_FILE --av-vels-file AV_VELS_FILE\n");
+  fprintf(fp, "       --final-state-file FINAL_STATE_FILE\n");
+  fprintf(fp, "Compares the av_vels and final_state files of a run, as text or .npy,\n");
+  fprintf(fp, "with reference results, as check.py does.\n");
+  fprintf(fp, "  --tolerance T               percentage tolerance (default: 1)\n");
+  fprintf(fp, "  --ref-av-vels-file F        reference av_vels results file\n");
+  fprintf(fp, "  --ref-final-state-file F    reference final_state results file\n");
+  fprintf(fp, "  --av-vels-file F            calculated av_vels results file\n");
+  fprintf(fp, "  --final-state-file F        calculated final_state results file\n");
+  exit(status);
+}
@@ -45,29 +45,206 @@
 **
 **   ./d2q9-bgk input.params obstacles.dat
 **
+** Optional arguments after the two file names select how the
+** lattice is stored and which engine advances it in time, e.g.:
+**
+**   ./d2q9-bgk input.params obstacles.dat --layout=halo
+**   ./d2q9-bgk input.params obstacles.dat --engine=tblock
+**   ./d2q9-bgk input.params obstacles.dat --engine=aa
+**   ./d2q9-bgk input.params obstacles.dat --engine=sparse
+**   ./d2q9-bgk input.params obstacles.dat --ensemble=sweep.txt
+**   ./d2q9-bgk input.params obstacles.dat --simd=avx2
+**
+** With the 'halo' layout every speed plane carries one ghost
+** row/column around the grid, which is refreshed from the opposite
+** edge once per timestep, so the streaming step uses constant
+** offsets instead of computing wrap-around neighbours:
+**
+**        halo  row ny
+**       --- --- --- ---
+**      | h | D | E | h |
+**       --- --- --- ---
+**      | h | A | B | h |
+**       --- --- --- ---
+**        halo  row -1
+**
+** When built with -DUSE_MPI ('make mpi') and run on several ranks,
+** the rows are split into one slab per rank, and the ghost rows at
+** the top and bottom of each slab are filled from the neighbouring
+** ranks instead of the opposite edge of the grid.
+**
+** Unless '--simd=off' is given, the collision step of the row based
+** engines uses AVX2 or AVX-512 code picked at run time from what
+** the CPU supports.
+**
 ** Be sure to adjust the grid dimensions in the parameter file
 ** if you choose a different obstacle file.
 */
 
+#define _GNU_SOURCE   /* syscall() and MADV_HUGEPAGE, which -std=c99 hides */
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <math.h>
 #include <time.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <xmmintrin.h>
 #include <omp.h>
+#ifdef USE_MPI
+#include <mpi.h>
+#endif
+#ifdef USE_PAPI
+#include <papi.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD   /* hand-vectorised kernels, selected at run time */
+#include <immintrin.h>
+#endif
+
+/*
+** Compiler hints.  The code was first tuned with the Intel classic
+** compiler; these map its alignment and vectorisation hints onto the
+** nearest thing other compilers understand, or onto nothing.
+**
+** ASSUME_ALIGNED(p, n)  pointer lvalue p is a multiple of n bytes
+** ASSUME(x)             x holds here, so the compiler may rely on it
+** IVDEP                 the next loop carries no dependencies
+** IVDEP_VECTOR_ALIGNED  ...and should be vectorised
+*/
+#define PRAGMA(x) _Pragma(#x)
+
+#if defined(__INTEL_COMPILER)
+#define ASSUME_ALIGNED(p, n) __assume_aligned((p), (n))
+#define ASSUME(x)            __assume(x)
+#define IVDEP                PRAGMA(ivdep)
+#define IVDEP_VECTOR_ALIGNED \
+    PRAGMA(ivdep) \
+    PRAGMA(vector aligned)
+#define IVDEP_VECTOR_ALIGNED_OMP_PARALLEL_FOR \
+    PRAGMA(ivdep) \
+    PRAGMA(vector aligned) \
+    PRAGMA(omp parallel for schedule(static))
+#elif defined(__GNUC__)  /* gcc, clang and icx */
+#define ASSUME_ALIGNED(p, n) ((p) = __builtin_assume_aligned((p), (n)))
+#if defined(__clang__)
+#define ASSUME(x)            __builtin_assume(x)
+#define IVDEP                PRAGMA(clang loop vectorize(assume_safety))
+#else
+#define ASSUME(x)            do { if (!(x)) __builtin_unreachable(); } while (0)
+#define IVDEP                PRAGMA(GCC ivdep)
+#endif
+/* omp simd only takes plain variables in aligned(...), so alignment of
+** the speed planes is passed on with ASSUME_ALIGNED() instead */
 #define IVDEP_VECTOR_ALIGNED \
-    _Pragma("ivdep") \
-    _Pragma("vector aligned")
+    PRAGMA(omp simd)
 #define IVDEP_VECTOR_ALIGNED_OMP_PARALLEL_FOR \
-    _Pragma("ivdep") \
-    _Pragma("vector aligned") \
-    _Pragma("omp parallel for schedule(static)")
+    PRAGMA(omp parallel for simd schedule(static))
+#else
+#define ASSUME_ALIGNED(p, n)
+#define ASSUME(x)
+#define IVDEP
+#define IVDEP_VECTOR_ALIGNED
+#define IVDEP_VECTOR_ALIGNED_OMP_PARALLEL_FOR \
+    PRAGMA(omp parallel for schedule(static))
+#endif
 
 #define NSPEEDS         9
 #define FINALSTATEFILE  "final_state.dat"
 #define AVVELSFILE      "av_vels.dat"
+#define FINALSTATENPY   "final_state.npy"
+#define AVVELSNPY       "av_vels.npy"
+#define OBSTACLE_MAGIC  "D2Q9OBST"  /* first bytes of a binary obstacle map */
+
+/* output formats */
+#define OUTPUT_ASCII    0  /* text, one line per cell, as check.py reads it */
+#define OUTPUT_BINARY   1  /* NumPy .npy arrays of float32 */
+#define OUTPUT_LINE     128        /* longest line of ASCII output, with room to spare */
+#define OUTPUT_BLOCK    (1 << 20)  /* bytes of ASCII output formatted per block */
+
+/* lattice memory layouts */
+#define LAYOUT_PLAIN    0  /* nx*ny cells per plane, periodic neighbours wrap */
+#define LAYOUT_HALO     1  /* one ghost cell around the grid in every plane */
+#define LAYOUT_AOSOA    2  /* the speeds of each block of AOSOA_LANES cells side by side */
+#define AOSOA_LANES     16 /* cells per block, one AVX-512 vector */
+#define HALO_PAD        8  /* floats before each interior row, keeps rows 32-byte aligned */
+#define HALO_STRIDE(nx) (HALO_PAD + (((nx) + 1 + 7) / 8) * 8)  /* floats from one row to the next */
+#define HUGE_PAGE       (2 << 20)  /* bytes in a transparent huge page */
+
+/* time-stepping engines */
+#define ENGINE_FUSED    0  /* one fused propagate/collide sweep per timestep */
+#define ENGINE_TBLOCK   1  /* several timesteps per sweep over bands of rows */
+#define ENGINE_AA       2  /* in-place AA-pattern streaming on a single lattice */
+#define ENGINE_SPARSE   3  /* indirect addressing over a list of fluid cells */
+#define ENGINE_OFFLOAD  4  /* the fused sweep on an OpenMP target device */
+#define TBLOCK_MAX_DEPTH 16 /* most timesteps fused into one temporal block */
+
+/* tiles of the fused sweep */
+#define TILE_OFF        0  /* whole rows */
+#define TILE_AUTO       -1 /* shape picked from the cache sizes, see tile_autotune() */
+#define TILE_L2         (1 << 20)   /* bytes of L2 assumed where the C library cannot tell */
+#define TILE_LLC        (16 << 20)  /* and of the last level cache */
+
+/* sharing out the rows of a sweep between threads, see schedule_rows() */
+#define SCHED_STATIC    0  /* equal numbers of rows, as schedule(static) */
+#define SCHED_WEIGHTED  1  /* equal work estimated from the obstacles */
+#define SCHED_SOLID_COST 0.5  /* an obstacle cell in propagate_team(), relative to a fluid one */
+
+/* instruction sets for the hand-vectorised row kernel */
+#define SIMD_AUTO       -1 /* pick the widest one the CPU supports */
+#define SIMD_OFF        0  /* compiler-vectorised code only */
+#define SIMD_AVX2       1  /* 8 cells per vector */
+#define SIMD_AVX512     2  /* 16 cells per vector */
+
+/*
+** grid sizes the fused engine has kernels of its own for, compiled
+** with nx and ny as constants; a build can list others instead, e.g.
+** -D'FIXED_GRIDS(X)=X(128, 128) X(512, 512)', and fold omega in too
+** with -DFIXED_OMEGA=1.85, see select_fixed()
+*/
+#ifndef FIXED_GRIDS
+#define FIXED_GRIDS(X) X(128, 128) X(128, 256) X(256, 256) X(1024, 1024)
+#endif
+
+/* how the distributions are stored between timesteps */
+#define STORAGE_FP32    0  /* floats */
+#define STORAGE_FP16    1  /* IEEE half precision */
+#define STORAGE_BF16    2  /* bfloat16, a float without its low 16 mantissa bits */
+#define STORAGE_DELTA16 3  /* half precision deviation from the rest state, relative to it */
+
+/* streamed diagnostics */
+#define DIAG_BATCH      1024  /* samples summed over the ranks and written out together */
+#define DIAG_SLOTS      4     /* batches in the ring buffer */
+#define DIAG_EXTRA      3     /* max |u|, total density and vorticity norm */
+
+/* profiling */
+#define PROF_BAR        40  /* characters in the longest bar of the thread histogram */
+#define PROF_EVENTS     4   /* hardware counters read with PAPI */
+#define PROF_MAX_THREADS 1024  /* threads PAPI keeps an event set for */
+#define CALIBRATE_REPEATS 10    /* triad sweeps of --calibrate, the fastest counts */
+#define CALIBRATE_SCALAR  3.f   /* the triad's a = b + s*c */
+#define ENSEMBLE_VALUES 256     /* values one parameter of an ensemble sweep may take */
+
+/* checkpoint files */
+#define CHECKPOINTFILE    "checkpoint.dat"
+#define CHECKPOINT_MAGIC  "D2Q9CKPT"
+#define CHECKPOINT_HEADER 4096  /* bytes before the speed planes, keeps them page aligned */
+
+/* snapshot frames of --frames, written as <frame file>_<timestep>.vtk or .npy */
+#define FRAMEFILE       "frame"
+#define FRAME_VTK       0  /* legacy VTK structured points, binary */
+#define FRAME_NPY       1  /* NumPy .npy arrays of records */
+#ifndef DEFAULT_STORAGE
+#define DEFAULT_STORAGE STORAGE_FP32  /* build with e.g. -DDEFAULT_STORAGE=STORAGE_DELTA16 */
+#endif
 
 /* struct to hold the parameter values */
 typedef struct
@@ -76,9 +253,52 @@ typedef struct
   int    ny;            /* no. of cells in y-direction */
   int    maxIters;      /* no. of iterations */
   int    reynolds_dim;  /* dimension for Reynolds number */
+  int    nfluid;        /* no. of cells not blocked by an obstacle */
   float density;       /* density per link */
   float accel;         /* density redistribution */
   float omega;         /* relaxation parameter */
+  int    layout;        /* lattice memory layout, one of LAYOUT_* */
+  int    stride;        /* no. of floats between vertically adjacent cells */
+  int    origin;        /* offset of cell (0,0) within a speed plane */
+  int    plane;         /* no. of floats allocated per speed plane, or per speed for LAYOUT_AOSOA */
+  int    engine;        /* time-stepping engine, one of ENGINE_* */
+  int    tblock_depth;  /* timesteps per temporal block */
+  int    tblock_rows;   /* rows per temporal block band, 0 picks one band per thread */
+  int    tile_w;        /* columns per tile of the fused sweep, TILE_OFF or TILE_AUTO */
+  int    tile_h;        /* rows per tile */
+  int    schedule;      /* sharing of rows between threads, one of SCHED_* */
+  int    simd;          /* row kernel instruction set, one of SIMD_* */
+  int    fixed;         /* use the kernels specialised for the grid size, if there are any */
+  int    fixed_grid;    /* which of them, see select_fixed(), or -1 for the generic ones */
+  int    storage;       /* distribution storage format, one of STORAGE_* */
+  int    hugepages;     /* back the speed planes with transparent huge pages */
+  int    thread_map;    /* report which core and NUMA node each thread runs on */
+  int    output;        /* format of the output files, one of OUTPUT_* */
+  int    diag_stream;   /* stream av_vels.dat out during the run instead of keeping them all */
+  int    diag_stride;   /* timesteps between streamed samples */
+  int    diag_extra;    /* add max |u|, total density and vorticity norm to each sample */
+  int    profile;       /* time the phases of the run and report them at the end */
+  float  peak_bw;       /* memory bandwidth to compare against in GB/s, 0 if unknown */
+  int    calibrate;     /* measure peak_bw with a STREAM triad before the run */
+  int    checkpoint_every;        /* timesteps between checkpoints, 0 for none */
+  float  converge_tol;            /* stop once av_vels changes by less than this over a window, 0 never */
+  int    converge_window;         /* timesteps between the checks of converge_tol */
+  int    warm_factor;             /* start from the flow of a grid this many times coarser, 0 from rest */
+  int    warm_iters;              /* timesteps of that coarse run, 0 for maxIters */
+  int    warmup_iters;            /* timesteps run and thrown away before the timed ones, 0 for none */
+  int    frame_every;             /* timesteps between snapshot frames, 0 for none */
+  int    frame_format;            /* FRAME_VTK or FRAME_NPY */
+  const char* frame_file;         /* frames are named after this */
+  const char* checkpoint_file;    /* where checkpoints are written */
+  const char* restart_file;       /* checkpoint to resume from, or NULL */
+  const char* obstacle_save;      /* where to write the obstacles as a bitmap, or NULL */
+  const char* ensemble_file;      /* list of parameter sets to run side by side, or NULL */
+  int    ensemble_threads;        /* threads per ensemble member, 0 shares them out evenly */
+  int    member;                  /* no. of this lattice in the ensemble, -1 outside one */
+  int    rank;          /* this process's MPI rank, 0 without MPI */
+  int    nranks;        /* no. of MPI ranks the rows are split between */
+  int    global_ny;     /* no. of rows in the whole grid, ny is this rank's slab */
+  int    row0;          /* global index of the first row of this rank's slab */
 } t_param;
 
 /* struct to hold the 'speed' values */
@@ -87,6 +307,106 @@ typedef struct
   float* speeds[NSPEEDS];
 } t_speed;
 
+/*
+** per-speed lattice velocities c_i, and the speed opposite to each,
+** following the numbering at the top of this file
+*/
+static const int cx[NSPEEDS]  = { 0, 1, 0, -1,  0, 1, -1, -1,  1 };  /* x component of c_i */
+static const int cy[NSPEEDS]  = { 0, 0, 1,  0, -1, 1,  1, -1, -1 };  /* y component of c_i */
+static const int opp[NSPEEDS] = { 0, 3, 4,  1,  2, 7,  8,  5,  6 };  /* speed opposite i */
+
+/*
+** Position of cell (ii,jj) within every speed's plane.  In the
+** AoSoA layout the speeds share one allocation of blocks of
+** NSPEEDS * AOSOA_LANES floats, holding the AOSOA_LANES cells of a
+** block for speed 0, then for speed 1, and so on; speeds[kk] points
+** kk * AOSOA_LANES floats into it, so the same position works for
+** every speed, and the cells of a block are a run for the row kernels.
+*/
+static inline int cell_index(const t_param params, const int ii, const int jj)
+{
+  const int idx = params.origin + ii + jj*params.stride;
+
+  if (params.layout != LAYOUT_AOSOA) return idx;
+
+  return (idx / AOSOA_LANES) * (NSPEEDS * AOSOA_LANES) + idx % AOSOA_LANES;
+}
+
+/* struct to hold the 'speed' values in one of the 16-bit storage formats */
+typedef struct
+{
+  uint16_t* speeds[NSPEEDS];
+} t_speed16;
+
+/*
+** header of a checkpoint file, padded to CHECKPOINT_HEADER bytes and
+** followed by this rank's slab of the lattice, NSPEEDS planes of
+** nx*ny floats, by the history of av_vels of the timesteps done so
+** far, if they are not being streamed, and by
+** the nx*ny obstacle flags of the slab
+*/
+typedef struct
+{
+  char    magic[8];     /* CHECKPOINT_MAGIC */
+  int     iteration;    /* no. of timesteps the lattice has been advanced */
+  int     accelerated;  /* the flow is already accelerated for the next timestep */
+  int     history;      /* no. of av_vels stored, 0 when they are streamed */
+  t_param params;       /* parameters of the run, file names cleared */
+} t_checkpoint;
+
+/* a batch of streamed diagnostics samples */
+typedef struct
+{
+  int   n;                              /* no. of samples in the batch */
+  int   tt[DIAG_BATCH];                 /* timestep of each sample */
+  float av_vel[DIAG_BATCH];             /* average velocity, summed over the ranks once complete */
+  float extra[DIAG_BATCH][DIAG_EXTRA];  /* max |u|, total density, vorticity norm */
+} t_diag_batch;
+
+/* one thread's share of the profile, padded to a cache line */
+typedef struct
+{
+  double sweep;  /* time in the propagate/collide sweeps */
+  double wait;   /* time waiting for the rest of the team at the end of each sweep */
+  double accel;  /* time in accelerate_row() */
+  char   pad[40];
+} t_prof_thread;
+
+/* struct to hold a list of cells and where each of them streams from */
+typedef struct
+{
+  int  count;           /* no. of cells in the list */
+  int* cell;            /* position of each cell within a speed plane */
+  int* src[NSPEEDS];    /* position each speed is pulled from, src[0] is cell */
+} t_cell_list;
+
+/* the profile of this rank, see profile_report() */
+static struct
+{
+  t_prof_thread* thread;      /* one per OpenMP thread */
+  int            nthreads;
+  double         halo_wait;   /* time waiting for the ghost rows from other ranks */
+  double         calibrate;   /* time measuring the triad bandwidth for --calibrate */
+  long long      counts[PROF_EVENTS];  /* PAPI counters summed over the threads, -1 if unavailable */
+  int            device;      /* the device --engine=offload ran on, or -1 for the host */
+} prof;
+
+/* each thread's share of the rows of a sweep, see schedule_rows() */
+static struct
+{
+  int     nthreads;       /* size of the team the shares are for */
+  int*    first;          /* thread t works on rows first[t] to first[t + 1] - 1 */
+  double* work;           /* estimated work of each share, in fluid cell updates */
+  double  imbalance[2];   /* largest share over the mean, for SCHED_STATIC and SCHED_WEIGHTED */
+} sched;
+
+/* the checks of --converge, see converge_check() */
+static struct
+{
+  float last;   /* average velocity at the previous check, or -1 before the first */
+  int   at;     /* timestep the run converged at, or -1 */
+} conv = { -1.f, -1 };
+
 /*
 ** function prototypes
 */
@@ -94,21 +414,196 @@ typedef struct
 /* load params, allocate memory, load obstacles & initialise fluid particle densities */
 int initialise(const char* paramfile, const char* obstaclefile,
                t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
-               int** obstacles_ptr, float** av_vels_ptr);
+               uint8_t** obstacles_ptr, float** av_vels_ptr);
+
+/* read the values of a parameter file into params */
+void read_params(const char* paramfile, t_param* params);
+
+/* set every cell of the lattice to the density at rest, and clear tmp_cells if it has planes */
+void initialise_speeds(const t_param params, t_speed* cells, t_speed* tmp_cells);
+
+/*
+** Warm start.  With --warm-start=N the same geometry is first run on
+** a grid N times coarser in each direction, and warm_start() sets
+** the fluid cells of the lattice to the equilibrium of its flow,
+** interpolated onto the fine grid.
+*/
+void warm_start(const t_param params, t_speed* cells, const uint8_t* obstacles);
+
+/*
+** Obstacle files.  The text format lists one "x y 1" line per
+** blocked cell; the binary one is OBSTACLE_MAGIC, nx and ny as
+** 32-bit integers, then a bitmap of ny rows of (nx + 7) / 8 bytes,
+** cell ii of a row in bit ii % 8 of byte ii / 8.  load_obstacles()
+** tells them apart by the magic, and sets this rank's slab of the
+** zeroed obstacle map.
+*/
+void load_obstacles(const t_param params, const char* obstaclefile, uint8_t* obstacles);
+void parse_obstacles(const t_param params, const char* text, const size_t len, uint8_t* obstacles);
+void save_obstacles(const t_param params, const char* file, const uint8_t* obstacles);
+
+/*
+** The timestep loop of the selected engine, from timestep start up
+** to maxIters, which returns the number of timesteps run: a steady
+** state may cut the run short.  cells and tmp_cells are swapped as
+** the lattices are.  warm_up() runs the first warmup_iters timesteps
+** on the same lattices and throws them away, leaving them at rest.
+*/
+int  run_timesteps(t_param params, t_speed** cells_ptr, t_speed** tmp_cells_ptr, uint8_t* obstacles, float* av_vels,
+                   const int start, const int accelerated);
+void warm_up(const t_param params, t_speed** cells_ptr, t_speed** tmp_cells_ptr, uint8_t* obstacles);
 
 /*
 ** The main calculation methods.
 ** timestep calls, in order, the functions:
 ** accelerate_flow(), propagate(), rebound() & collision()
+**
+** The acceleration is fused into the sweep of the timestep before:
+** cells must already be accelerated, and with force set the sweep
+** accelerates the new state in tmp_cells, row by row as it is
+** written, ready for the next timestep.
+*/
+float timestep(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles, const int force);
+int accelerate_flow(const t_param params, t_speed* cells, uint8_t* obstacles);
+float propagate(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles, const int force);
+float propagate_halo(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles, const int force);
+float propagate_halo_rows(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles,
+                          const int first, const int last, const int force);
+float propagate_rows(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles, const int force);
+void halo_exchange(const t_param params, t_speed* cells);
+void halo_start_ranks(const t_param params, t_speed* cells);
+void halo_finish_ranks(void);
+
+/*
+** The same steps for a team of threads that is already running:
+** every thread of the enclosing parallel region calls these, the
+** rows are shared out by orphaned omp for loops, and each thread
+** gets back its own part of the sum of velocities.  The functions
+** above are each one parallel region around one of these.
+*/
+float timestep_team(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles, const int force);
+float propagate_team(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles, const int force);
+float propagate_halo_team(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles,
+                          const int first, const int last, const int force);
+float propagate_rows_team(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles, const int force);
+float propagate_aosoa_team(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles, const int force);
+void halo_exchange_team(const t_param params, t_speed* cells);
+
+/*
+** The fused sweep in tiles of tile_w by tile_h cells instead of whole
+** rows, for either layout; tile_autotune() picks the tile shape for
+** this CPU's caches.
+*/
+float propagate_tiles_team(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles, const int force);
+void tile_autotune(t_param* params);
+
+/*
+** The rows each thread sweeps: schedule_rows() shares out the rows
+** of the lattice once, into equal numbers of rows or into equal work
+** estimated from the obstacles, and team_rows() returns the calling
+** thread's share of rows first to last - 1 in lo to hi - 1.
+*/
+void schedule_rows(const t_param params, const uint8_t* obstacles);
+void team_rows(const t_param params, const int first, const int last, int* lo, int* hi);
+
+/*
+** propagate_rows_team() or propagate_halo_team(), compiled for the
+** grid size and instruction set of the run: select_fixed() returns
+** the index of the grid in FIXED_GRIDS if its kernels can be used,
+** or -1.
+*/
+float propagate_fixed_team(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles, const int force);
+int select_fixed(const t_param params);
+
+/*
+** Building blocks working on a run of n cells along a row, whose
+** speeds are passed as a t_speed pointing at the run's first cell.
 */
-float timestep(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles);
-int accelerate_flow(const t_param params, t_speed* cells, int* obstacles);
-float propagate(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles);
-int write_values(const t_param params, t_speed* cells, int* obstacles, float* av_vels);
+void accelerate_row(const t_param params, t_speed* row, const uint8_t* obstacles, const int n);
+float collide_row(const t_param params, const t_speed* src, t_speed* dst,
+                  const uint8_t* obstacles, const int n);
+float collide_row_scalar(const t_param params, const t_speed* src, t_speed* dst,
+                         const uint8_t* obstacles, const int n);
+#ifdef HAVE_X86_SIMD
+float collide_row_avx2(const t_param params, const t_speed* src, t_speed* dst,
+                       const uint8_t* obstacles, const int n);
+float collide_row_avx512(const t_param params, const t_speed* src, t_speed* dst,
+                         const uint8_t* obstacles, const int n);
+#endif
+void stream_row(t_speed* src, const t_speed* lattice, const int south, const int centre, const int north);
+void wrap_row(const t_param params, t_speed* row);
+
+/* point view at cell (ii, jj) + dir * c_i of each plane i, or of plane opp(i) if swap */
+void lattice_view(const t_param params, t_speed* view, const t_speed* cells,
+                  const int ii, const int jj, const int dir, const int swap);
+
+/*
+** Temporal blocking: advance the lattice by 'steps' timesteps in
+** one sweep, from cells into tmp_cells, storing the steps' average
+** velocities in av_vels[0..steps-1].
+*/
+int tblock_ring(const t_param params);
+void tblock(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles,
+            float* scratch, const int steps, float* av_vels);
+
+/*
+** AA-pattern streaming: a single lattice updated in place by
+** alternating even and odd timesteps, see aa_even() and aa_odd().
+*/
+float aa_even(const t_param params, t_speed* cells, uint8_t* obstacles);
+float aa_odd(const t_param params, t_speed* cells, uint8_t* obstacles);
+void aa_swap(t_speed* cells);
+void aa_unstream(const t_param params, t_speed* cells);
+
+/*
+** Sparse streaming: only fluid cells and the obstacle cells next to
+** them are visited, through lists built once after initialise().
+*/
+void build_cell_lists(const t_param params, uint8_t* obstacles, t_cell_list* fluid, t_cell_list* wall);
+void free_cell_list(t_cell_list* list);
+float propagate_sparse(const t_param params, t_speed* cells, t_speed* tmp_cells,
+                       const t_cell_list* fluid, const t_cell_list* wall);
+
+/*
+** OpenMP target offload: every timestep runs on the default device,
+** which keeps the lattice for the whole run, see offload(), which
+** returns the number of timesteps run.
+*/
+int offload(const t_param params, t_speed* cells, const uint8_t* obstacles, float* av_vels);
+
+/*
+** Packed storage: the distributions are kept in 16 bits between
+** timesteps and unpacked into per-thread float rows for the
+** collision, see propagate_packed().  The lattice is nx*ny cells
+** per plane, whatever the layout.
+*/
+void pack_lattice(const t_param params, const t_speed* cells, t_speed16* packed, t_speed16* tmp_packed);
+void unpack_lattice(const t_param params, const t_speed16* packed, t_speed* cells);
+void pack_run(const t_param params, const int kk, const float* in, uint16_t* out, const int n);
+void unpack_run(const t_param params, const int kk, const uint16_t* in, float* out, const int n);
+float propagate_packed(const t_param params, const t_speed16* cells, t_speed16* tmp_cells, uint8_t* obstacles,
+                       float* scratch, const int force);
+void half_to_float_run(const t_param params, const uint16_t* in, float* out, const int n);
+void float_to_half_run(const t_param params, const float* in, uint16_t* out, const int n);
+
+int write_values(const t_param params, t_speed* cells, uint8_t* obstacles, float* av_vels);
+
+/* the name output file file is written under, numbered for an ensemble member */
+void output_name(const t_param params, const char* file, char* name, const size_t size);
+
+/*
+** Output, formatted in parallel.  cell_state_row() computes the
+** velocity and pressure of every cell in row jj of this rank's slab.
+*/
+void cell_state_row(const t_param params, const t_speed* cells, const uint8_t* obstacles, const int jj,
+                    float* u_x, float* u_y, float* u, float* pressure);
+void write_state_ascii(const t_param params, const t_speed* cells, const uint8_t* obstacles, FILE* fp);
+void write_state_binary(const t_param params, const t_speed* cells, const uint8_t* obstacles, FILE* fp);
+void write_npy_header(FILE* fp, const char* descr, const char* shape);
 
 /* finalise, including freeing up allocated memory */
 int finalise(const t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
-             int** obstacles_ptr, float** av_vels_ptr);
+             uint8_t** obstacles_ptr, float** av_vels_ptr);
 
 /* Sum all the densities in the grid.
 ** The total should remain constant from one timestep to the next. */
@@ -117,7 +612,111 @@ float total_density(const t_param params, t_speed* cells);
 /* calculate Reynolds number */
 float calc_reynolds(const t_param params, float av_vels);
 
+/*
+** distributed memory helpers; in a build without MPI there is
+** a single rank and these do nothing
+*/
+void  ranks_init(int* argc, char*** argv, t_param* params);
+void  ranks_finalise(void);
+void  ranks_barrier(void);
+int   ranks_sum_int(const int value);
+float ranks_sum(const float value);
+void  ranks_reduce(float* values, const int n);
+
+/* memory placement */
+float* alloc_plane(const t_param params);
+void free_plane(const t_param params, float* plane);
+void report_threads(const t_param params);
+
+/*
+** Checkpoint/restart.  A checkpoint is copied into one of two
+** snapshot buffers by the team and written out by a background
+** thread while the timesteps go on, see checkpoint_begin().
+*/
+int  checkpoint_due(const t_param params, const int iteration);
+void checkpoint_open(const t_param params, const uint8_t* obstacles);
+void checkpoint_begin(const t_param params, const int iteration, const int accelerated, const float* av_vels);
+void checkpoint_copy_team(const t_param params, const t_speed* cells);
+void checkpoint_commit(void);
+void checkpoint(const t_param params, const int iteration, const int accelerated, const t_speed* cells,
+                const float* av_vels);
+void checkpoint_close(void);
+int  restart(const t_param params, t_speed* cells, const uint8_t* obstacles, float* av_vels, int* accelerated);
+
+/*
+** Streamed diagnostics.  Samples are gathered in batches and written
+** to av_vels.dat by a background thread as the run goes on, see
+** diag_record().  record_av_vel() stores a timestep's average
+** velocity in av_vels, or streams it.
+*/
+void  record_av_vel(const t_param params, float* av_vels, const int tt, const float av_vel);
+int   diag_sampled(const t_param params, const int tt);
+void  diag_open(const t_param params, const int start);
+void  diag_record(const t_param params, const int tt, const float av_vel, const float* extra);
+void  diag_flush(const t_param params);
+void  diag_sync(const t_param params);
+float diag_close(const t_param params);
+void  diag_extras_team(const t_param params, const t_speed* cells, const uint8_t* obstacles, float* extra);
+
+/*
+** Steady state.  With --converge, every converge_window'th timestep
+** is due a check, and converge_check() compares its average velocity
+** with the previous check's and returns the number of timesteps the
+** run should now stop after.
+*/
+int converge_due(const t_param params, const int tt);
+int converge_check(const t_param params, const int tt, const float av_vel);
+
+/*
+** Snapshot frames.  Every frame_every'th timestep the team works out
+** the density and velocity of every cell into one of two buffers, and
+** a background thread writes them out as a frame for visualisation
+** while the timesteps go on, see frame_begin().
+*/
+int  frame_due(const t_param params, const int iteration);
+void frame_open(const t_param params, const uint8_t* obstacles);
+void frame_begin(const int iteration);
+void frame_copy_team(const t_param params, const t_speed* cells);
+void frame_commit(void);
+void frame_close(void);
+
+/*
+** Profiling: with --profile the phases of the run are timed, and
+** profile_report() prints them with the lattice updates per second,
+** the memory bandwidth they imply, the time each thread of the fused
+** engine spends sweeping and waiting, and optionally PAPI counters.
+** --calibrate first measures the bandwidth the loop is compared
+** against with profile_calibrate(), a STREAM triad over buffers as big
+** as the lattice and first touched by the same threads.
+*/
+void   profile_open(const t_param params);
+void   profile_counters_start(void);
+void   profile_counters_stop(void);
+double profile_bytes_per_update(const t_param params);
+float  profile_calibrate(const t_param params);
+void   profile_report(const t_param params, const double init, const double loop, const double reduce,
+                      const double output, const int steps);
+
+/*
+** Ensembles.  --ensemble=F runs every parameter set listed in F on the
+** grid and obstacles given on the command line, in a single process.
+** ensemble_members() reads the list: a line is either a parameter
+** file for the same grid, or a sweep such as "omega=1.0,1.5 accel=0.005"
+** over the density, accel, omega and maxIters of the parameters given
+** on the command line, which stands for every combination of
+** the values.  ensemble() shares the members out between groups of
+** threads, each a nested team which sweeps one member at a time with
+** the team functions above, reading the one obstacle map; every member
+** writes its own output files, numbered as in the list, and it
+** returns the no. of cell updates done.
+*/
+t_param* ensemble_members(const t_param base, const char* listfile, int* count);
+double   ensemble(const t_param base, const t_param* members, const int count, uint8_t* obstacles);
+float    ensemble_run(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles, float* av_vels);
+
 /* utility functions */
+void parse_option(const char* exe, const char* arg, t_param* params);
+int select_simd(const int requested);
 void die(const char* message, const int line, const char* file);
 void usage(const char* exe);
 
@@ -132,16 +731,20 @@ int main(int argc, char* argv[])
   t_param  params;              /* struct to hold parameter values */
   t_speed* cells     = NULL;    /* grid containing fluid densities */
   t_speed* tmp_cells = NULL;    /* scratch space */
-  int*     obstacles = NULL;    /* grid indicating which cells are blocked */
+  uint8_t* obstacles = NULL;    /* grid indicating which cells are blocked */
   float* av_vels   = NULL;     /* a record of the av. velocity computed for each timestep */
   struct timeval timstr;        /* structure to hold elapsed time */
   struct rusage ru;             /* structure to hold CPU time--system and user */
   double tic, toc;              /* floating point numbers to calculate elapsed wallclock time */
   double usrtim;                /* floating point number to record elapsed user CPU time */
   double systim;                /* floating point number to record elapsed system CPU time */
+  double t_start, t_tic, t_loop, t_toc, t_out;  /* for the profile: start of the run and of each phase */
+
+  ranks_init(&argc, &argv, &params);
+  t_start = omp_get_wtime();
 
   /* parse the command line */
-  if (argc != 3)
+  if (argc < 3)
   {
     usage(argv[0]);
   }
@@ -151,58 +754,265 @@ int main(int argc, char* argv[])
     obstaclefile = argv[2];
   }
 
+  params.layout = LAYOUT_PLAIN;
+  params.engine = ENGINE_FUSED;
+  params.tblock_depth = 4;
+  params.tblock_rows = 0;
+  params.tile_w = TILE_OFF;
+  params.tile_h = TILE_OFF;
+  params.schedule = SCHED_STATIC;
+  params.simd = SIMD_AUTO;
+  params.fixed = 1;
+  params.fixed_grid = -1;
+  params.storage = DEFAULT_STORAGE;
+  params.hugepages = 0;
+  params.thread_map = 0;
+  params.output = OUTPUT_ASCII;
+  params.diag_stream = 0;
+  params.diag_stride = 1;
+  params.diag_extra = 0;
+  params.profile = 0;
+  params.peak_bw = 0.f;
+  params.calibrate = 0;
+  params.checkpoint_every = 0;
+  params.converge_tol = 0.f;
+  params.converge_window = 1000;
+  params.warm_factor = 0;
+  params.warm_iters = 0;
+  params.warmup_iters = 0;
+  params.frame_every = 0;
+  params.frame_format = FRAME_VTK;
+  params.frame_file = FRAMEFILE;
+  params.checkpoint_file = CHECKPOINTFILE;
+  params.restart_file = NULL;
+  params.obstacle_save = NULL;
+  params.ensemble_file = NULL;
+  params.ensemble_threads = 0;
+  params.member = -1;
+
+  for (int i = 3; i < argc; i++)
+  {
+    parse_option(argv[0], argv[i], &params);
+  }
+
+  params.simd = select_simd(params.simd);
+
+  if (params.layout == LAYOUT_AOSOA
+      && (params.engine != ENGINE_FUSED || params.storage != STORAGE_FP32 || params.nranks > 1
+          || params.tile_w != TILE_OFF || params.checkpoint_every > 0 || params.restart_file != NULL
+          || params.ensemble_file != NULL))
+  {
+    die("the AoSoA layout needs the fused engine and fp32 storage on a single rank, without tiles, "
+        "checkpoints or ensembles", __LINE__, __FILE__);
+  }
+
+  /* ranks only trade the rows at the edge of their slab, which
+  ** needs the ghost rows of the halo layout and one timestep per sweep */
+  if (params.nranks > 1)
+  {
+    params.layout = LAYOUT_HALO;
+
+    if (params.engine != ENGINE_FUSED) die("only the fused engine runs on more than one MPI rank", __LINE__, __FILE__);
+  }
+
+  if (params.storage != STORAGE_FP32 && (params.engine != ENGINE_FUSED || params.nranks > 1))
+  {
+    die("16-bit storage needs the fused engine on a single rank", __LINE__, __FILE__);
+  }
+
+  if ((params.checkpoint_every > 0 || params.restart_file != NULL)
+      && (params.engine != ENGINE_FUSED || params.storage != STORAGE_FP32))
+  {
+    die("checkpoints need the fused engine and fp32 storage", __LINE__, __FILE__);
+  }
+
+  if (params.diag_extra && (params.engine != ENGINE_FUSED || params.storage != STORAGE_FP32 || params.nranks > 1))
+  {
+    die("extra diagnostics need the fused engine and fp32 storage on a single rank", __LINE__, __FILE__);
+  }
+
+  if (params.ensemble_file != NULL
+      && (params.engine != ENGINE_FUSED || params.storage != STORAGE_FP32 || params.nranks > 1
+          || params.checkpoint_every > 0 || params.restart_file != NULL || params.diag_stream || params.profile))
+  {
+    die("an ensemble needs the fused engine and fp32 storage on a single rank, without checkpoints, "
+        "streamed diagnostics or the profile", __LINE__, __FILE__);
+  }
+
+  if (params.converge_tol > 0.f
+      && (params.engine == ENGINE_TBLOCK || params.checkpoint_every > 0 || params.ensemble_file != NULL))
+  {
+    die("convergence monitoring does not work with temporal blocking, checkpoints or ensembles", __LINE__, __FILE__);
+  }
+
+  if (params.frame_every > 0
+      && (params.engine != ENGINE_FUSED || params.storage != STORAGE_FP32 || params.nranks > 1
+          || params.ensemble_file != NULL))
+  {
+    die("snapshot frames need the fused engine and fp32 storage on a single rank, without ensembles",
+        __LINE__, __FILE__);
+  }
+
+  if (params.warm_factor > 0 && (params.nranks > 1 || params.restart_file != NULL || params.ensemble_file != NULL))
+  {
+    die("a warm start needs a single rank, and does not combine with restarts or ensembles", __LINE__, __FILE__);
+  }
+
+  if (params.warmup_iters > 0 && params.ensemble_file != NULL)
+  {
+    die("a warm-up does not combine with ensembles", __LINE__, __FILE__);
+  }
+
+  if (params.tile_w != TILE_OFF && (params.engine != ENGINE_FUSED || params.storage != STORAGE_FP32 || params.nranks > 1))
+  {
+    die("tiles need the fused engine and fp32 storage on a single rank", __LINE__, __FILE__);
+  }
+
+  if (params.schedule == SCHED_WEIGHTED
+      && (params.engine != ENGINE_FUSED || params.storage != STORAGE_FP32 || params.nranks > 1
+          || params.tile_w != TILE_OFF))
+  {
+    die("weighted scheduling needs the fused engine and fp32 storage on a single rank, without tiles",
+        __LINE__, __FILE__);
+  }
+
   /* initialise our data structures and load values from file */
   initialise(paramfile, obstaclefile, &params, &cells, &tmp_cells, &obstacles, &av_vels);
 
-  for (int i = 0; i < NSPEEDS; i++)
+  if (params.tile_w == TILE_AUTO) tile_autotune(&params);
+
+  params.fixed_grid = select_fixed(params);
+
+  schedule_rows(params, obstacles);
+
+  /* the members of an ensemble each have a lattice of their own */
+  if (params.ensemble_file != NULL)
   {
-    cells->speeds[i]     = (float*) _mm_malloc(sizeof(float) * (params.ny * params.nx), 32);
-    tmp_cells->speeds[i] = (float*) _mm_malloc(sizeof(float) * (params.ny * params.nx), 32);
+    int            count;
+    t_param*       members = ensemble_members(params, params.ensemble_file, &count);
+    const double   t0 = omp_get_wtime();
+    const double   updates = ensemble(params, members, count, obstacles);
+    const double   elapsed = omp_get_wtime() - t0;
+
+    getrusage(RUSAGE_SELF, &ru);
+    timstr = ru.ru_utime;
+    usrtim = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
+    timstr = ru.ru_stime;
+    systim = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
+
+    printf("==done==\n");
+    printf("Members:\t\t\t%d\n", count);
+    printf("Elapsed time:\t\t\t%.6lf (s)\n", elapsed);
+    printf("Elapsed user CPU time:\t\t%.6lf (s)\n", usrtim);
+    printf("Elapsed system CPU time:\t%.6lf (s)\n", systim);
+    printf("MLUPS:\t\t\t\t%.2lf (all members)\n", updates / elapsed * 1e-6);
+
+    free(members);
+    finalise(&params, &cells, &tmp_cells, &obstacles, &av_vels);
+    ranks_finalise();
+
+    return EXIT_SUCCESS;
   }
 
-  /* initialise densities */
-  float w0 = params.density * 4.f / 9.f;
-  float w1 = params.density       / 9.f;
-  float w2 = params.density       / 36.f;
+  if (params.layout == LAYOUT_AOSOA)
+  {
+    /* every speed in one allocation, see cell_index() */
+    t_param whole = params;
 
-  #pragma omp parallel for schedule(static)
-  for (int jj = 0; jj < params.ny; jj++)
+    whole.plane = NSPEEDS * params.plane;
+    cells->speeds[0] = alloc_plane(whole);
+    tmp_cells->speeds[0] = alloc_plane(whole);
+
+    if (cells->speeds[0] == NULL || tmp_cells->speeds[0] == NULL)
+    {
+      die("cannot allocate memory for speed planes", __LINE__, __FILE__);
+    }
+  }
+
+  for (int i = (params.layout == LAYOUT_AOSOA) ? NSPEEDS : 0; i < NSPEEDS; i++)
   {
-    IVDEP_VECTOR_ALIGNED
-    for (int ii = 0; ii < params.nx; ii++)
+    cells->speeds[i]     = alloc_plane(params);
+    /* streaming in place needs no scratch space, and packed storage
+    ** and the offload device keep their own pair of lattices */
+    const int scratch_plane = params.engine != ENGINE_AA && params.engine != ENGINE_OFFLOAD
+                              && params.storage == STORAGE_FP32;
+
+    tmp_cells->speeds[i] = scratch_plane ? alloc_plane(params) : NULL;
+
+    if (cells->speeds[i] == NULL || (scratch_plane && tmp_cells->speeds[i] == NULL))
     {
-      /* centre */
-      cells->speeds[0][ii + jj*params.nx] = w0;
-      /* axis directions */
-      cells->speeds[1][ii + jj*params.nx] = w1;
-      cells->speeds[2][ii + jj*params.nx] = w1;
-      cells->speeds[3][ii + jj*params.nx] = w1;
-      cells->speeds[4][ii + jj*params.nx] = w1;
-      /* diagonals */
-      cells->speeds[5][ii + jj*params.nx] = w2;
-      cells->speeds[6][ii + jj*params.nx] = w2;
-      cells->speeds[7][ii + jj*params.nx] = w2;
-      cells->speeds[8][ii + jj*params.nx] = w2;
+      die("cannot allocate memory for speed planes", __LINE__, __FILE__);
     }
   }
 
+  for (int i = 1; i < NSPEEDS && params.layout == LAYOUT_AOSOA; i++)
+  {
+    cells->speeds[i]     = cells->speeds[0] + i * AOSOA_LANES;
+    tmp_cells->speeds[i] = tmp_cells->speeds[0] + i * AOSOA_LANES;
+  }
+
+  /* initialise densities */
+  initialise_speeds(params, cells, tmp_cells);
+
+  if (params.warmup_iters > 0) warm_up(params, &cells, &tmp_cells, obstacles);
+
+  if (params.warm_factor > 0) warm_start(params, cells, obstacles);
+
+  if (params.thread_map) report_threads(params);
+
+  /* carry on from a checkpoint, whose lattice is laid over the one
+  ** just initialised by the same threads */
+  int start = 0;        /* timesteps already done */
+  int accelerated = 0;  /* the lattice is already accelerated for timestep start */
+
+  if (params.restart_file != NULL) start = restart(params, cells, obstacles, av_vels, &accelerated);
+
+  if (params.checkpoint_every > 0) checkpoint_open(params, obstacles);
+
+  if (params.frame_every > 0) frame_open(params, obstacles);
+
+  if (params.diag_stream) diag_open(params, start);
+
+  if (params.profile) profile_open(params);
+
+  if (params.calibrate) params.peak_bw = profile_calibrate(params);
+
   /* iterate for maxIters timesteps */
   gettimeofday(&timstr, NULL);
   tic = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
 
-  for (int tt = 0; tt < params.maxIters; tt = tt + 2)
+  t_tic = omp_get_wtime();
+
+  if (params.profile) profile_counters_start();
+
+  params.maxIters = run_timesteps(params, &cells, &tmp_cells, obstacles, av_vels, start, accelerated);
+
+  t_loop = omp_get_wtime();
+
+  if (params.profile) profile_counters_stop();
+
+  /* wait for the last checkpoint and frame to reach the disk */
+  if (params.checkpoint_every > 0) checkpoint_close();
+
+  if (params.frame_every > 0) frame_close();
+
+  /* every rank only holds its share of each timestep's average */
+  float final_av_vel;  /* average velocity of the last timestep */
+
+  if (params.diag_stream)
   {
-    av_vels[tt] = timestep(params, cells, tmp_cells, obstacles);
-    av_vels[tt + 1] = timestep(params, tmp_cells, cells, obstacles);
-#ifdef DEBUG
-    printf("==timestep: %d==\n", tt);
-    printf("av velocity: %.12E\n", av_vels[tt]);
-    printf("tot density: %.12E\n", total_density(params, cells));
-#endif
+    final_av_vel = diag_close(params);
+  }
+  else
+  {
+    ranks_reduce(av_vels, params.maxIters);
+    final_av_vel = av_vels[params.maxIters - 1];
   }
 
+  ranks_barrier();
   gettimeofday(&timstr, NULL);
   toc = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
+  t_toc = omp_get_wtime();
   getrusage(RUSAGE_SELF, &ru);
   timstr = ru.ru_utime;
   usrtim = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
@@ -210,106 +1020,545 @@ int main(int argc, char* argv[])
   systim = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
 
   /* write final values and free memory */
-  printf("==done==\n");
-  printf("Reynolds number:\t\t%.12E\n", calc_reynolds(params, av_vels[params.maxIters - 1]));
-  printf("Elapsed time:\t\t\t%.6lf (s)\n", toc - tic);
-  printf("Elapsed user CPU time:\t\t%.6lf (s)\n", usrtim);
-  printf("Elapsed system CPU time:\t%.6lf (s)\n", systim);
+  if (params.rank == 0)
+  {
+    printf("==done==\n");
+    printf("Reynolds number:\t\t%.12E\n", calc_reynolds(params, final_av_vel));
+
+    if (params.converge_tol > 0.f && conv.at >= 0)
+    {
+      printf("Converged at timestep:\t\t%d (%d timesteps run)\n", conv.at, params.maxIters);
+    }
+    else if (params.converge_tol > 0.f)
+    {
+      printf("Converged at timestep:\t\tnone (%d timesteps run)\n", params.maxIters);
+    }
+    printf("Elapsed time:\t\t\t%.6lf (s)\n", toc - tic);
+    printf("Elapsed user CPU time:\t\t%.6lf (s)\n", usrtim);
+    printf("Elapsed system CPU time:\t%.6lf (s)\n", systim);
+  }
+  t_out = omp_get_wtime();
   write_values(params, cells, obstacles, av_vels);
+
+  if (params.profile)
+  {
+    profile_report(params, t_tic - t_start, t_loop - t_tic, t_toc - t_loop, omp_get_wtime() - t_out,
+                   params.maxIters - start);
+  }
   finalise(&params, &cells, &tmp_cells, &obstacles, &av_vels);
+  ranks_finalise();
 
   return EXIT_SUCCESS;
 }
 
-float timestep(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles)
+int run_timesteps(t_param params, t_speed** cells_ptr, t_speed** tmp_cells_ptr, uint8_t* obstacles, float* av_vels,
+                  const int start, const int accelerated)
 {
-  accelerate_flow(params, cells, obstacles);
-  float av_vel = propagate(params, cells, tmp_cells, obstacles);
-  //rebound(params, cells, tmp_cells, obstacles);
-  //collision(params, cells, tmp_cells, obstacles);
-  return av_vel;
-}
+  t_speed*    cells = *cells_ptr;
+  t_speed*    tmp_cells = *tmp_cells_ptr;
+  float*      scratch = NULL;      /* per-thread row buffers for temporal blocking */
+  float*      thread_vels = NULL;  /* per-thread shares of each timestep's av. velocity */
+  t_cell_list fluid;               /* fluid cells, for sparse streaming */
+  t_cell_list wall;                /* obstacle cells next to the fluid, for sparse streaming */
 
-int accelerate_flow(const t_param params, t_speed* cells, int* obstacles)
-{
-  /* compute weighting factors */
-  float w1 = params.density * params.accel / 9.f;
-  float w2 = params.density * params.accel / 36.f;
+  if (params.engine == ENGINE_TBLOCK)
+  {
+    scratch = (float*) _mm_malloc(sizeof(float) * tblock_ring(params) * omp_get_max_threads(), 32);
 
-  /* modify the 2nd row of the grid */
-  int jj = params.ny - 2;
+    if (scratch == NULL) die("cannot allocate memory for temporal blocking", __LINE__, __FILE__);
 
-  IVDEP_VECTOR_ALIGNED
-  for (int ii = 0; ii < params.nx; ii++)
-  {
-    /* if the cell is not occupied and
-    ** we don't send a negative density */
-    if (!obstacles[ii + jj*params.nx]
-        && (cells->speeds[3][ii + jj*params.nx] - w1) > 0.f
-        && (cells->speeds[6][ii + jj*params.nx] - w2) > 0.f
-        && (cells->speeds[7][ii + jj*params.nx] - w2) > 0.f)
+    for (int tt = 0; tt < params.maxIters; tt = tt + params.tblock_depth)
     {
-      /* increase 'east-side' densities */
-      cells->speeds[1][ii + jj*params.nx] += w1;
-      cells->speeds[5][ii + jj*params.nx] += w2;
-      cells->speeds[8][ii + jj*params.nx] += w2;
-      /* decrease 'west-side' densities */
-      cells->speeds[3][ii + jj*params.nx] -= w1;
-      cells->speeds[6][ii + jj*params.nx] -= w2;
-      cells->speeds[7][ii + jj*params.nx] -= w2;
-    }
-  }
-
-  // int num_threads = omp_get_num_threads();
-  // int parallel_loops_num = ((params.nx / num_threads) / 8) * num_threads * 8;
-  // IVDEP_VECTOR_ALIGNED_OMP_PARALLEL_FOR
-  // for (int ii = 0; ii < parallel_loops_num; ii++)
-  // {
-  //   /* if the cell is not occupied and
-  //   ** we don't send a negative density */
-  //   if (!obstacles[ii + jj*params.nx]
-  //       && (cells->speeds[3][ii + jj*params.nx] - w1) > 0.f
-  //       && (cells->speeds[6][ii + jj*params.nx] - w2) > 0.f
-  //       && (cells->speeds[7][ii + jj*params.nx] - w2) > 0.f)
-  //   {
-  //     /* increase 'east-side' densities */
-  //     cells->speeds[1][ii + jj*params.nx] += w1;
-  //     cells->speeds[5][ii + jj*params.nx] += w2;
-  //     cells->speeds[8][ii + jj*params.nx] += w2;
-  //     /* decrease 'west-side' densities */
-  //     cells->speeds[3][ii + jj*params.nx] -= w1;
-  //     cells->speeds[6][ii + jj*params.nx] -= w2;
-  //     cells->speeds[7][ii + jj*params.nx] -= w2;
-  //   }
-  // }
-
-  // IVDEP_VECTOR_ALIGNED
-  // for (int ii = parallel_loops_num; ii < params.nx; ii++)
-  // {
-  //   /* if the cell is not occupied and
-  //   ** we don't send a negative density */
-  //   if (!obstacles[ii + jj*params.nx]
-  //       && (cells->speeds[3][ii + jj*params.nx] - w1) > 0.f
-  //       && (cells->speeds[6][ii + jj*params.nx] - w2) > 0.f
-  //       && (cells->speeds[7][ii + jj*params.nx] - w2) > 0.f)
-  //   {
-  //     /* increase 'east-side' densities */
-  //     cells->speeds[1][ii + jj*params.nx] += w1;
-  //     cells->speeds[5][ii + jj*params.nx] += w2;
-  //     cells->speeds[8][ii + jj*params.nx] += w2;
-  //     /* decrease 'west-side' densities */
-  //     cells->speeds[3][ii + jj*params.nx] -= w1;
-  //     cells->speeds[6][ii + jj*params.nx] -= w2;
-  //     cells->speeds[7][ii + jj*params.nx] -= w2;
-  //   }
-  // }
+      const int steps = (params.maxIters - tt < params.tblock_depth) ? params.maxIters - tt : params.tblock_depth;
+      float     block_vels[TBLOCK_MAX_DEPTH];  /* av_vels of the timesteps in this block */
+      t_speed*  swap;
+
+      tblock(params, cells, tmp_cells, obstacles, scratch, steps, block_vels);
+
+      for (int ss = 0; ss < steps; ss++) record_av_vel(params, av_vels, tt + ss, block_vels[ss]);
+
+      swap = cells;
+      cells = tmp_cells;
+      tmp_cells = swap;
+#ifdef DEBUG
+      printf("==timestep: %d==\n", tt + steps - 1);
+      printf("av velocity: %.12E\n", block_vels[steps - 1]);
+      printf("tot density: %.12E\n", total_density(params, cells));
+#endif
+    }
+
+    _mm_free(scratch);
+  }
+  else if (params.engine == ENGINE_AA)
+  {
+    /* the initial state, read with opposite speeds swapped,
+    ** is the layout the even timesteps expect */
+    aa_swap(cells);
+
+    for (int tt = 0; tt < params.maxIters; tt++)
+    {
+      const float av_vel = (tt % 2 == 0) ? aa_even(params, cells, obstacles)
+                                         : aa_odd(params, cells, obstacles);
+
+      record_av_vel(params, av_vels, tt, av_vel);
+
+      if (converge_due(params, tt)) params.maxIters = converge_check(params, tt, av_vel);
+#ifdef DEBUG
+      printf("==timestep: %d==\n", tt);
+      printf("av velocity: %.12E\n", av_vel);
+      printf("tot density: %.12E\n", total_density(params, cells));
+#endif
+    }
+
+    /* and back to the usual layout */
+    if (params.maxIters % 2 == 0) aa_swap(cells);
+    else aa_unstream(params, cells);
+  }
+  else if (params.engine == ENGINE_SPARSE)
+  {
+    build_cell_lists(params, obstacles, &fluid, &wall);
+
+    for (int tt = 0; tt < params.maxIters; tt++)
+    {
+      t_speed* swap;
+
+      accelerate_flow(params, cells, obstacles);
+
+      const float av_vel = propagate_sparse(params, cells, tmp_cells, &fluid, &wall);
+
+      record_av_vel(params, av_vels, tt, av_vel);
+
+      if (converge_due(params, tt)) params.maxIters = converge_check(params, tt, av_vel);
+      swap = cells;
+      cells = tmp_cells;
+      tmp_cells = swap;
+#ifdef DEBUG
+      printf("==timestep: %d==\n", tt);
+      printf("av velocity: %.12E\n", av_vel);
+      printf("tot density: %.12E\n", total_density(params, cells));
+#endif
+    }
+
+    free_cell_list(&fluid);
+    free_cell_list(&wall);
+  }
+  else if (params.engine == ENGINE_OFFLOAD)
+  {
+    params.maxIters = offload(params, cells, obstacles, av_vels);
+  }
+  else if (params.storage != STORAGE_FP32)
+  {
+    const size_t bytes = sizeof(uint16_t) * params.nx * params.ny;
+    t_speed16    packed, tmp_packed;
+
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      packed.speeds[kk]     = (uint16_t*) _mm_malloc(bytes, 32);
+      tmp_packed.speeds[kk] = (uint16_t*) _mm_malloc(bytes, 32);
+
+      if (packed.speeds[kk] == NULL || tmp_packed.speeds[kk] == NULL)
+      {
+        die("cannot allocate memory for packed speeds", __LINE__, __FILE__);
+      }
+    }
+
+    scratch = (float*) _mm_malloc(sizeof(float) * 2 * NSPEEDS * ((params.nx + 7) / 8 * 8) * omp_get_max_threads(), 32);
+
+    if (scratch == NULL) die("cannot allocate memory for packed rows", __LINE__, __FILE__);
+
+    /* every later timestep is accelerated by the sweep before it; the
+    ** float lattice is only needed again for the output, so its memory
+    ** is handed back for the length of the run */
+    accelerate_flow(params, cells, obstacles);
+    pack_lattice(params, cells, &packed, &tmp_packed);
+
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      free_plane(params, cells->speeds[kk]);
+    }
+
+    for (int tt = 0; tt < params.maxIters; tt++)
+    {
+      t_speed16   swap;
+      const float av_vel = propagate_packed(params, &packed, &tmp_packed, obstacles, scratch, tt + 1 < params.maxIters);
+
+      record_av_vel(params, av_vels, tt, av_vel);
+
+      if (converge_due(params, tt)) params.maxIters = converge_check(params, tt, av_vel);
+      swap = packed;
+      packed = tmp_packed;
+      tmp_packed = swap;
+#ifdef DEBUG
+      printf("==timestep: %d==\n", tt);
+      printf("av velocity: %.12E\n", av_vel);
+#endif
+    }
+
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      cells->speeds[kk] = alloc_plane(params);
+
+      if (cells->speeds[kk] == NULL) die("cannot allocate memory for speed planes", __LINE__, __FILE__);
+    }
+
+    unpack_lattice(params, &packed, cells);
+
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      _mm_free(packed.speeds[kk]);
+      _mm_free(tmp_packed.speeds[kk]);
+    }
+
+    _mm_free(scratch);
+  }
+  else if (params.nranks == 1)
+  {
+    /* one parallel region for the whole run, rather than a fork, a
+    ** join and a reduction every timestep: each thread records its
+    ** share of every timestep's average velocity in its own row of
+    ** thread_vels, padded to a whole number of cache lines, and the
+    ** shares are only added up once the run is over; when they are
+    ** streamed, they are added up a batch at a time instead */
+    const int nthreads = omp_get_max_threads();
+    const int ld = params.diag_stream ? DIAG_BATCH : (params.maxIters + 15) / 16 * 16;
+    const float r_nfluid = 1.f / (float)params.nfluid;  /* the same in every sum of the shares */
+    float*    extras = NULL;  /* extra diagnostics of the sampled timesteps */
+    int       recorded = start;  /* first timestep not yet streamed */
+
+    thread_vels = (float*) _mm_malloc(sizeof(float) * ld * nthreads, 64);
+
+    if (thread_vels == NULL) die("cannot allocate memory for thread_vels", __LINE__, __FILE__);
+
+    memset(thread_vels, 0, sizeof(float) * ld * nthreads);
+
+    if (params.diag_extra)
+    {
+      extras = (float*) malloc(sizeof(float) * DIAG_EXTRA * ld);
+
+      if (extras == NULL) die("cannot allocate memory for diagnostics", __LINE__, __FILE__);
+    }
+
+    #pragma omp parallel
+    {
+      float*   vels = thread_vels + omp_get_thread_num() * ld;
+      t_speed* src  = cells;
+      t_speed* dst  = tmp_cells;
+
+      /* every later timestep is accelerated by the sweep before it */
+      #pragma omp single
+      if (!accelerated) accelerate_flow(params, cells, obstacles);
+
+      for (int tt = start; tt < params.maxIters; tt++)
+      {
+        t_speed* swap;
+        /* decided before the barrier, as the single below changes it */
+        const int due = converge_due(params, tt);
+
+        vels[tt % ld] = timestep_team(params, src, dst, obstacles, tt + 1 < params.maxIters);
+        swap = src;
+        src = dst;
+        dst = swap;
+
+        /* the shares are stored after the barrier in timestep_team,
+        ** so they need another before they are added up; a shorter run
+        ** is seen by every thread after the one ending the single */
+        if (due)
+        {
+          #pragma omp barrier
+          #pragma omp single
+          {
+            float tot_u = 0.f;
+
+            for (int n = 0; n < nthreads; n++) tot_u += thread_vels[n*ld + tt % ld];
+
+            params.maxIters = converge_check(params, tt, tot_u * r_nfluid);
+          }
+        }
+
+        if (params.diag_extra && diag_sampled(params, tt))
+        {
+          diag_extras_team(params, src, obstacles, extras + (tt % ld) * DIAG_EXTRA);
+        }
+
+        /* stream the batch once every slot of thread_vels is used, and
+        ** before a checkpoint, so that it never lags behind the file */
+        if (params.diag_stream
+            && ((tt + 1) % ld == 0 || tt + 1 == params.maxIters || checkpoint_due(params, tt + 1)))
+        {
+          #pragma omp barrier
+          #pragma omp single
+          {
+            for (int t = recorded; t <= tt; t++)
+            {
+              float tot_u = 0.f;
+
+              for (int n = 0; n < nthreads; n++) tot_u += thread_vels[n*ld + t % ld];
+
+              diag_record(params, t, tot_u * r_nfluid, extras ? extras + (t % ld) * DIAG_EXTRA : NULL);
+            }
+
+            recorded = tt + 1;
+          }
+        }
+
+        if (frame_due(params, tt + 1))
+        {
+          #pragma omp single
+          frame_begin(tt + 1);
+
+          frame_copy_team(params, src);
+
+          #pragma omp single nowait
+          frame_commit();
+        }
+
+        /* as above, the shares of timestep tt need a barrier before
+        ** they go into the checkpoint's average velocities */
+        if (checkpoint_due(params, tt + 1))
+        {
+          #pragma omp barrier
+          #pragma omp single
+          {
+            if (params.diag_stream)
+            {
+              diag_sync(params);
+            }
+            else
+            {
+              for (int t = start; t <= tt; t++)
+              {
+                float tot_u = 0.f;
+
+                for (int n = 0; n < nthreads; n++) tot_u += thread_vels[n*ld + t];
+
+                av_vels[t] = tot_u * r_nfluid;
+              }
+            }
+
+            checkpoint_begin(params, tt + 1, tt + 1 < params.maxIters, av_vels);
+          }
+
+          checkpoint_copy_team(params, src);
+
+          #pragma omp single nowait
+          checkpoint_commit();
+        }
+#ifdef DEBUG
+        #pragma omp master
+        {
+          printf("==timestep: %d==\n", tt);
+          printf("tot density: %.12E\n", total_density(params, src));
+        }
+        #pragma omp barrier
+#endif
+      }
+    }
+
+    /* the final state is in tmp_cells after an odd number of timesteps */
+    if ((params.maxIters - start) % 2 == 1)
+    {
+      t_speed* swap = cells;
+      cells = tmp_cells;
+      tmp_cells = swap;
+    }
+
+    if (!params.diag_stream)
+    {
+      #pragma omp parallel for schedule(static)
+      for (int tt = start; tt < params.maxIters; tt++)
+      {
+        float tot_u = 0.f;
+
+        for (int t = 0; t < nthreads; t++) tot_u += thread_vels[t*ld + tt];
+
+        av_vels[tt] = tot_u * r_nfluid;
+      }
+    }
+
+    _mm_free(thread_vels);
+    free(extras);
+  }
+  else
+  {
+    /* every later timestep is accelerated by the sweep before it */
+    if (!accelerated) accelerate_flow(params, cells, obstacles);
+
+    for (int tt = start; tt < params.maxIters; tt++)
+    {
+      const float av_vel = timestep(params, cells, tmp_cells, obstacles, tt + 1 < params.maxIters);
+      t_speed*    swap;
+
+      record_av_vel(params, av_vels, tt, av_vel);
+      swap = cells;
+      cells = tmp_cells;
+      tmp_cells = swap;
+
+      if (converge_due(params, tt)) params.maxIters = converge_check(params, tt, av_vel);
+
+      if (checkpoint_due(params, tt + 1))
+      {
+        if (params.diag_stream) diag_sync(params);
+
+        checkpoint(params, tt + 1, tt + 1 < params.maxIters, cells, av_vels);
+      }
+#ifdef DEBUG
+      printf("==timestep: %d==\n", tt);
+      printf("av velocity: %.12E\n", av_vel);
+      printf("tot density: %.12E\n", total_density(params, cells));
+#endif
+    }
+  }
+
+  *cells_ptr = cells;
+  *tmp_cells_ptr = tmp_cells;
+
+  return params.maxIters;
+}
+
+void warm_up(const t_param params, t_speed** cells_ptr, t_speed** tmp_cells_ptr, uint8_t* obstacles)
+{
+  t_param warm = params;
+  float*  warm_vels;
+
+  /* nothing but the timesteps themselves: no output, and no profile */
+  warm.maxIters = params.warmup_iters;
+  warm.converge_tol = 0.f;
+  warm.checkpoint_every = 0;
+  warm.frame_every = 0;
+  warm.diag_stream = 0;
+  warm.diag_extra = 0;
+  warm.profile = 0;
+  warm_vels = (float*) _mm_malloc(sizeof(float) * warm.maxIters, 32);
+
+  if (warm_vels == NULL) die("cannot allocate memory for the warm-up", __LINE__, __FILE__);
+
+  run_timesteps(warm, cells_ptr, tmp_cells_ptr, obstacles, warm_vels, 0, 0);
+  _mm_free(warm_vels);
+  initialise_speeds(params, *cells_ptr, *tmp_cells_ptr);
+}
+
+float timestep(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles, const int force)
+{
+  if (params.nranks > 1)
+  {
+    float tot_u;
+
+    /* the rows at the top and bottom of the slab need the ghost rows
+    ** from the neighbouring ranks, so they go last, and the rest of
+    ** the slab is computed while those are on their way */
+    halo_exchange(params, cells);
+    halo_start_ranks(params, cells);
+    tot_u = propagate_halo_rows(params, cells, tmp_cells, obstacles, 1, params.ny - 1, force);
+    halo_finish_ranks();
+    tot_u += propagate_halo_rows(params, cells, tmp_cells, obstacles, 0, 1, force);
+
+    if (params.ny > 1) tot_u += propagate_halo_rows(params, cells, tmp_cells, obstacles, params.ny - 1, params.ny, force);
+
+    return tot_u / (float)params.nfluid;
+  }
+
+  if (params.layout == LAYOUT_HALO)
+  {
+    halo_exchange(params, cells);
+    return propagate_halo(params, cells, tmp_cells, obstacles, force);
+  }
+
+  if (params.simd != SIMD_OFF) return propagate_rows(params, cells, tmp_cells, obstacles, force);
+
+  float av_vel = propagate(params, cells, tmp_cells, obstacles, force);
+  //rebound(params, cells, tmp_cells, obstacles);
+  //collision(params, cells, tmp_cells, obstacles);
+  return av_vel;
+}
+
+float timestep_team(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles, const int force)
+{
+  const double t0 = params.profile ? omp_get_wtime() : 0.;
+  float        tot_u;
+
+  if (params.layout == LAYOUT_HALO) halo_exchange_team(params, cells);
+
+  if (params.tile_w != TILE_OFF)
+  {
+    tot_u = propagate_tiles_team(params, cells, tmp_cells, obstacles, force);
+  }
+  else if (params.layout == LAYOUT_AOSOA)
+  {
+    tot_u = propagate_aosoa_team(params, cells, tmp_cells, obstacles, force);
+  }
+  else if (params.layout == LAYOUT_HALO)
+  {
+    tot_u = (params.fixed_grid >= 0) ? propagate_fixed_team(params, cells, tmp_cells, obstacles, force)
+          : propagate_halo_team(params, cells, tmp_cells, obstacles, 0, params.ny, force);
+  }
+  else if (params.fixed_grid >= 0)
+  {
+    tot_u = propagate_fixed_team(params, cells, tmp_cells, obstacles, force);
+  }
+  else if (params.simd != SIMD_OFF)
+  {
+    tot_u = propagate_rows_team(params, cells, tmp_cells, obstacles, force);
+  }
+  else
+  {
+    tot_u = propagate_team(params, cells, tmp_cells, obstacles, force);
+  }
+
+  /* the sweeps do not wait for each other at the end of their loop,
+  ** so the time each thread is left waiting can be told apart */
+  if (params.profile)
+  {
+    const double t1 = omp_get_wtime();
+
+    #pragma omp barrier
+    prof.thread[omp_get_thread_num()].sweep += t1 - t0;
+    prof.thread[omp_get_thread_num()].wait += omp_get_wtime() - t1;
+  }
+  else
+  {
+    #pragma omp barrier
+  }
+
+  return tot_u;
+}
+
+int accelerate_flow(const t_param params, t_speed* cells, uint8_t* obstacles)
+{
+  /* modify the 2nd row of the grid, if it is in this rank's slab */
+  int jj = params.global_ny - 2 - params.row0;
+
+  /* a row is one run of cells, or one per block for LAYOUT_AOSOA */
+  const int run = (params.layout == LAYOUT_AOSOA) ? AOSOA_LANES : params.nx;
+
+  if (jj < 0 || jj >= params.ny) return EXIT_SUCCESS;
+
+  for (int ii = 0; ii < params.nx; ii += run)
+  {
+    t_speed row;
+
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      row.speeds[kk] = cells->speeds[kk] + cell_index(params, ii, jj);
+    }
+
+    accelerate_row(params, &row, obstacles + ii + jj*params.nx, run);
+  }
 
   return EXIT_SUCCESS;
 }
 
-float propagate(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles)
+float propagate(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles, const int force)
+{
+  float tot_u = 0;          /* accumulated magnitudes of velocity for each cell */
+
+  #pragma omp parallel reduction(+:tot_u)
+  tot_u += propagate_team(params, cells, tmp_cells, obstacles, force);
+
+  return tot_u / (float)params.nfluid;
+}
+
+float propagate_team(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles, const int force)
 {
-  int   tot_cells = 0;  /* no. of cells used in calculation */
   float tot_u = 0;          /* accumulated magnitudes of velocity for each cell */
   
   const float c_sq = 1.f / 3.f; /* square of speed of sound */
@@ -320,34 +1569,36 @@ float propagate(const t_param params, t_speed* cells, t_speed* tmp_cells, int* o
   const float w2 = 1.f / 36.f; /* weighting factor */
   /* loop over _all_ cells */
   
-  __assume_aligned(cells, 32);
-  __assume_aligned(tmp_cells, 32);
-  __assume_aligned(obstacles, 32);
-  __assume_aligned(cells->speeds[0], 32);
-  __assume_aligned(cells->speeds[1], 32);
-  __assume_aligned(cells->speeds[2], 32);
-  __assume_aligned(cells->speeds[3], 32);
-  __assume_aligned(cells->speeds[4], 32);
-  __assume_aligned(cells->speeds[5], 32);
-  __assume_aligned(cells->speeds[6], 32);
-  __assume_aligned(cells->speeds[7], 32);
-  __assume_aligned(cells->speeds[8], 32);
-  __assume_aligned(tmp_cells->speeds[0], 32);
-  __assume_aligned(tmp_cells->speeds[1], 32);
-  __assume_aligned(tmp_cells->speeds[2], 32);
-  __assume_aligned(tmp_cells->speeds[3], 32);
-  __assume_aligned(tmp_cells->speeds[4], 32);
-  __assume_aligned(tmp_cells->speeds[5], 32);
-  __assume_aligned(tmp_cells->speeds[6], 32);
-  __assume_aligned(tmp_cells->speeds[7], 32);
-  __assume_aligned(tmp_cells->speeds[8], 32);
+  ASSUME_ALIGNED(cells, 32);
+  ASSUME_ALIGNED(tmp_cells, 32);
+  ASSUME_ALIGNED(obstacles, 32);
+  ASSUME_ALIGNED(cells->speeds[0], 32);
+  ASSUME_ALIGNED(cells->speeds[1], 32);
+  ASSUME_ALIGNED(cells->speeds[2], 32);
+  ASSUME_ALIGNED(cells->speeds[3], 32);
+  ASSUME_ALIGNED(cells->speeds[4], 32);
+  ASSUME_ALIGNED(cells->speeds[5], 32);
+  ASSUME_ALIGNED(cells->speeds[6], 32);
+  ASSUME_ALIGNED(cells->speeds[7], 32);
+  ASSUME_ALIGNED(cells->speeds[8], 32);
+  ASSUME_ALIGNED(tmp_cells->speeds[0], 32);
+  ASSUME_ALIGNED(tmp_cells->speeds[1], 32);
+  ASSUME_ALIGNED(tmp_cells->speeds[2], 32);
+  ASSUME_ALIGNED(tmp_cells->speeds[3], 32);
+  ASSUME_ALIGNED(tmp_cells->speeds[4], 32);
+  ASSUME_ALIGNED(tmp_cells->speeds[5], 32);
+  ASSUME_ALIGNED(tmp_cells->speeds[6], 32);
+  ASSUME_ALIGNED(tmp_cells->speeds[7], 32);
+  ASSUME_ALIGNED(tmp_cells->speeds[8], 32);
   
-  int idx0, idx1, idx2, idx3, idx4, idx5, idx6, idx7, idx8;
-  
-  #pragma omp parallel for reduction(+:tot_cells, tot_u) schedule(static)
-  for (int jj = 0; jj < params.ny; jj++)
+  int lo, hi;  /* this thread's rows */
+
+  team_rows(params, 0, params.ny, &lo, &hi);
+
+  /* no barrier at the end, see timestep_team() */
+  for (int jj = lo; jj < hi; jj++)
   {
-    #pragma ivdep
+    IVDEP
     for (int ii = 0; ii < params.nx; ii++)
     {
       /* determine indices of axis-direction neighbours
@@ -357,25 +1608,15 @@ float propagate(const t_param params, t_speed* cells, t_speed* tmp_cells, int* o
       int y_s = (jj == 0) ? (jj + params.ny - 1) : (jj - 1);
       int x_w = (ii == 0) ? (ii + params.nx - 1) : (ii - 1);
 
-      idx0 = ii + jj * params.nx;
-      idx1 = x_w + jj * params.nx;
-      idx2 = ii + y_s * params.nx;
-      idx3 = x_e + jj * params.nx;
-      idx4 = ii + y_n * params.nx;
-      idx5 = x_w + y_s * params.nx;
-      idx6 = x_e + y_s * params.nx;
-      idx7 = x_e + y_n * params.nx;
-      idx8 = x_w + y_n * params.nx;
-
-      __assume(idx0%16==0);
-      __assume(idx1%16==0);
-      __assume(idx2%16==0);
-      __assume(idx3%16==0);
-      __assume(idx4%16==0);
-      __assume(idx5%16==0);
-      __assume(idx6%16==0);
-      __assume(idx7%16==0);
-      __assume(idx8%16==0);
+      const int idx0 = ii + jj * params.nx;
+      const int idx1 = x_w + jj * params.nx;
+      const int idx2 = ii + y_s * params.nx;
+      const int idx3 = x_e + jj * params.nx;
+      const int idx4 = ii + y_n * params.nx;
+      const int idx5 = x_w + y_s * params.nx;
+      const int idx6 = x_e + y_s * params.nx;
+      const int idx7 = x_e + y_n * params.nx;
+      const int idx8 = x_w + y_n * params.nx;
 
       /* propagate densities from neighbouring cells, following
       ** appropriate directions of travel and writing into
@@ -455,284 +1696,4700 @@ float propagate(const t_param params, t_speed* cells, t_speed* tmp_cells, int* o
       }
 
       tot_u += (obstacles[idx0]) ? 0 : sqrtf((u_x * u_x) + (u_y * u_y));
-      tot_cells += (obstacles[idx0]) ? 0 : 1;
     }
+
+    /* accelerate the new row for the next timestep while it is in cache */
+    if (force && jj == params.global_ny - 2 - params.row0) accelerate_flow(params, tmp_cells, obstacles);
   }
 
-  return tot_u / (float)tot_cells;
+  return tot_u;
 }
 
-int initialise(const char* paramfile, const char* obstaclefile,
-               t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
-               int** obstacles_ptr, float** av_vels_ptr)
+void halo_exchange(const t_param params, t_speed* cells)
 {
-  char   message[1024];  /* message buffer */
-  FILE*   fp;            /* file pointer */
-  int    xx, yy;         /* generic array indices */
-  int    blocked;        /* indicates whether a cell is blocked by an obstacle */
-  int    retval;         /* to hold return value for checking */
+  #pragma omp parallel
+  halo_exchange_team(params, cells);
+}
 
-  /* open the parameter file */
-  fp = fopen(paramfile, "r");
+void halo_exchange_team(const t_param params, t_speed* cells)
+{
+  const int s = params.stride;
 
-  if (fp == NULL)
+  /* west/east ghost columns first, so that the row copies
+  ** below carry the corner cells along with them */
+  #pragma omp for schedule(static)
+  for (int jj = 0; jj < params.ny; jj++)
   {
-    sprintf(message, "could not open input parameter file: %s", paramfile);
-    die(message, __LINE__, __FILE__);
-  }
+    const int w = params.origin + jj*s;  /* first cell of the row */
+    const int e = w + params.nx - 1;     /* last cell of the row */
 
-  /* read in the parameter values */
-  retval = fscanf(fp, "%d\n", &(params->nx));
+    /* speeds travelling east are pulled from the west ghost */
+    cells->speeds[1][w - 1] = cells->speeds[1][e];
+    cells->speeds[5][w - 1] = cells->speeds[5][e];
+    cells->speeds[8][w - 1] = cells->speeds[8][e];
+    /* speeds travelling west are pulled from the east ghost */
+    cells->speeds[3][e + 1] = cells->speeds[3][w];
+    cells->speeds[6][e + 1] = cells->speeds[6][w];
+    cells->speeds[7][e + 1] = cells->speeds[7][w];
+  }
 
-  if (retval != 1) die("could not read param file: nx", __LINE__, __FILE__);
+  /* south ghost row <- top row, north ghost row <- bottom row,
+  ** unless those rows belong to the neighbouring ranks, in which
+  ** case halo_start_ranks() and halo_finish_ranks() fetch them */
+  if (params.nranks == 1)
+  {
+    #pragma omp for schedule(static)
+    for (int ii = -1; ii <= params.nx; ii++)
+    {
+      const int b = params.origin + ii;                      /* bottom row */
+      const int t = params.origin + ii + (params.ny - 1)*s;  /* top row */
 
-  retval = fscanf(fp, "%d\n", &(params->ny));
+      /* speeds travelling north are pulled from the south ghost */
+      cells->speeds[2][b - s] = cells->speeds[2][t];
+      cells->speeds[5][b - s] = cells->speeds[5][t];
+      cells->speeds[6][b - s] = cells->speeds[6][t];
+      /* speeds travelling south are pulled from the north ghost */
+      cells->speeds[4][t + s] = cells->speeds[4][b];
+      cells->speeds[7][t + s] = cells->speeds[7][b];
+      cells->speeds[8][t + s] = cells->speeds[8][b];
+    }
+  }
+}
 
-  if (retval != 1) die("could not read param file: ny", __LINE__, __FILE__);
+#ifdef USE_MPI
+static MPI_Request halo_req[4 * 3];  /* ghost row transfers in flight */
+#endif
 
-  retval = fscanf(fp, "%d\n", &(params->maxIters));
+void halo_start_ranks(const t_param params, t_speed* cells)
+{
+#ifdef USE_MPI
+  static const int north[3] = { 2, 5, 6 };  /* speeds travelling north */
+  static const int south[3] = { 4, 7, 8 };  /* speeds travelling south */
+  const int   s = params.stride;
+  const int   len = params.nx + 2;                 /* a row and its two ghost cells */
+  const int   b = params.origin - 1;               /* west ghost of the bottom row */
+  const int   t = b + (params.ny - 1)*s;           /* west ghost of the top row */
+  const int   rank_n = (params.rank + 1) % params.nranks;
+  const int   rank_s = (params.rank + params.nranks - 1) % params.nranks;
 
-  if (retval != 1) die("could not read param file: maxIters", __LINE__, __FILE__);
+  /* speeds travelling north leave through the top row into the
+  ** south ghost row of the rank above, and those travelling south
+  ** through the bottom row into the north ghost row of the rank below;
+  ** the rows are contiguous within each plane, so they are sent as
+  ** they are, corners included */
+  for (int kk = 0; kk < 3; kk++)
+  {
+    MPI_Irecv(cells->speeds[north[kk]] + b - s, len, MPI_FLOAT, rank_s, north[kk], MPI_COMM_WORLD, &halo_req[4*kk]);
+    MPI_Irecv(cells->speeds[south[kk]] + t + s, len, MPI_FLOAT, rank_n, south[kk], MPI_COMM_WORLD, &halo_req[4*kk + 1]);
+    MPI_Isend(cells->speeds[north[kk]] + t, len, MPI_FLOAT, rank_n, north[kk], MPI_COMM_WORLD, &halo_req[4*kk + 2]);
+    MPI_Isend(cells->speeds[south[kk]] + b, len, MPI_FLOAT, rank_s, south[kk], MPI_COMM_WORLD, &halo_req[4*kk + 3]);
+  }
+#else
+  (void) params;
+  (void) cells;
+#endif
+}
 
-  retval = fscanf(fp, "%d\n", &(params->reynolds_dim));
+/* wait for the ghost rows, and for the edge rows to have been sent */
+void halo_finish_ranks(void)
+{
+#ifdef USE_MPI
+  const double t0 = omp_get_wtime();
 
-  if (retval != 1) die("could not read param file: reynolds_dim", __LINE__, __FILE__);
+  MPI_Waitall(4 * 3, halo_req, MPI_STATUSES_IGNORE);
+  prof.halo_wait += omp_get_wtime() - t0;
+#endif
+}
 
-  retval = fscanf(fp, "%f\n", &(params->density));
+void accelerate_row(const t_param params, t_speed* row, const uint8_t* obstacles, const int n)
+{
+  const double t0 = params.profile ? omp_get_wtime() : 0.;
 
-  if (retval != 1) die("could not read param file: density", __LINE__, __FILE__);
+  /* compute weighting factors */
+  float w1 = params.density * params.accel / 9.f;
+  float w2 = params.density * params.accel / 36.f;
 
-  retval = fscanf(fp, "%f\n", &(params->accel));
+  IVDEP_VECTOR_ALIGNED
+  for (int ii = 0; ii < n; ii++)
+  {
+    /* if the cell is not occupied and
+    ** we don't send a negative density */
+    if (!obstacles[ii]
+        && (row->speeds[3][ii] - w1) > 0.f
+        && (row->speeds[6][ii] - w2) > 0.f
+        && (row->speeds[7][ii] - w2) > 0.f)
+    {
+      /* increase 'east-side' densities */
+      row->speeds[1][ii] += w1;
+      row->speeds[5][ii] += w2;
+      row->speeds[8][ii] += w2;
+      /* decrease 'west-side' densities */
+      row->speeds[3][ii] -= w1;
+      row->speeds[6][ii] -= w2;
+      row->speeds[7][ii] -= w2;
+    }
+  }
 
-  if (retval != 1) die("could not read param file: accel", __LINE__, __FILE__);
+  if (params.profile) prof.thread[omp_get_thread_num()].accel += omp_get_wtime() - t0;
+}
 
-  retval = fscanf(fp, "%f\n", &(params->omega));
+/*
+** BGK collision of one fluid cell: relaxes the streamed speeds
+** towards equilibrium into out[] and returns the norm of the velocity.
+** It is compiled for the offload device too.
+*/
+#pragma omp declare target
+static inline float relax_cell(const t_param params, const float* speeds, float* out)
+{
+  const float c_sq = 1.f / 3.f; /* square of speed of sound */
+  const float c_2sq2 = 2.f * c_sq * c_sq;
+  const float c_2sq = 2.f * c_sq;
+  const float w0 = 4.f / 9.f;  /* weighting factor */
+  const float w1 = 1.f / 9.f;  /* weighting factor */
+  const float w2 = 1.f / 36.f; /* weighting factor */
 
-  if (retval != 1) die("could not read param file: omega", __LINE__, __FILE__);
+  /* compute local density total */
+  float local_density;
+  local_density = speeds[0] + speeds[1] + speeds[2] + speeds[3] + speeds[4] + speeds[5] + speeds[6] + speeds[7] + speeds[8];
+  /* compute x velocity component */
+  float u_x = (speeds[1] + speeds[5] + speeds[8] - speeds[3] - speeds[6] - speeds[7]) / local_density;
+  /* compute y velocity component */
+  float u_y = (speeds[2] + speeds[5] + speeds[6] - speeds[4] - speeds[7] - speeds[8]) / local_density;
 
-  /* and close up the file */
-  fclose(fp);
+  /* velocity squared */
+  float u_sq = u_x * u_x + u_y * u_y;
 
-  /*
-  ** Allocate memory.
-  **
-  ** Remember C is pass-by-value, so we need to
-  ** pass pointers into the initialise function.
-  **
-  ** NB we are allocating a 1D array, so that the
-  ** memory will be contiguous.  We still want to
-  ** index this memory as if it were a (row major
-  ** ordered) 2D array, however.  We will perform
-  ** some arithmetic using the row and column
-  ** coordinates, inside the square brackets, when
-  ** we want to access elements of this array.
-  **
-  ** Note also that we are using a structure to
-  ** hold an array of 'speeds'.  We will allocate
-  ** a 1D array of these structs.
-  */
+  /* directional velocity components */
+  float u1 =   u_x;        /* east */
+  float u2 =         u_y;  /* north */
+  float u3 = - u_x;        /* west */
+  float u4 =       - u_y;  /* south */
+  float u5 =   u_x + u_y;  /* north-east */
+  float u6 = - u_x + u_y;  /* north-west */
+  float u7 = - u_x - u_y;  /* south-west */
+  float u8 =   u_x - u_y;  /* south-east */
 
-  /* main grid */
-  *cells_ptr = (t_speed*)_mm_malloc(sizeof(t_speed), 32);
+  /* equilibrium densities */
+  float d_equ[NSPEEDS] __attribute__((aligned(32)));
+  /* zero velocity density: weight w0 */
+  d_equ[0] = w0 * local_density * (1.f - u_sq / (c_2sq));
+  /* axis speeds: weight w1 */
+  d_equ[1] = w1 * local_density * (1.f + u1 / c_sq + (u1 * u1) / (c_2sq2) - u_sq / (c_2sq));
+  d_equ[2] = w1 * local_density * (1.f + u2 / c_sq + (u2 * u2) / (c_2sq2) - u_sq / (c_2sq));
+  d_equ[3] = w1 * local_density * (1.f + u3 / c_sq + (u3 * u3) / (c_2sq2) - u_sq / (c_2sq));
+  d_equ[4] = w1 * local_density * (1.f + u4 / c_sq + (u4 * u4) / (c_2sq2) - u_sq / (c_2sq));
+  /* diagonal speeds: weight w2 */
+  d_equ[5] = w2 * local_density * (1.f + u5 / c_sq + (u5 * u5) / (c_2sq2) - u_sq / (c_2sq));
+  d_equ[6] = w2 * local_density * (1.f + u6 / c_sq + (u6 * u6) / (c_2sq2) - u_sq / (c_2sq));
+  d_equ[7] = w2 * local_density * (1.f + u7 / c_sq + (u7 * u7) / (c_2sq2) - u_sq / (c_2sq));
+  d_equ[8] = w2 * local_density * (1.f + u8 / c_sq + (u8 * u8) / (c_2sq2) - u_sq / (c_2sq));
 
-  if (*cells_ptr == NULL) die("cannot allocate memory for cells", __LINE__, __FILE__);
+  /* relaxation step */
+  for (int kk = 0; kk < NSPEEDS; kk++)
+  {
+    out[kk] = speeds[kk] + params.omega * (d_equ[kk] - speeds[kk]);
+  }
 
-  /* 'helper' grid, used as scratch space */
-  *tmp_cells_ptr = (t_speed*)_mm_malloc(sizeof(t_speed), 32);
+  return sqrtf(u_sq);
+}
+#pragma omp end declare target
 
-  if (*tmp_cells_ptr == NULL) die("cannot allocate memory for tmp_cells", __LINE__, __FILE__);
+float collide_row(const t_param params, const t_speed* src, t_speed* dst,
+                  const uint8_t* obstacles, const int n)
+{
+#ifdef HAVE_X86_SIMD
+  if (params.simd == SIMD_AVX512) return collide_row_avx512(params, src, dst, obstacles, n);
 
-  /* the map of obstacles */
-  *obstacles_ptr = _mm_malloc(sizeof(int) * (params->ny * params->nx), 32);
+  if (params.simd == SIMD_AVX2) return collide_row_avx2(params, src, dst, obstacles, n);
+#endif
 
-  if (*obstacles_ptr == NULL) die("cannot allocate column memory for obstacles", __LINE__, __FILE__);
+  return collide_row_scalar(params, src, dst, obstacles, n);
+}
 
-  /* first set all cells in obstacle array to zero */
-  for (int jj = 0; jj < params->ny; jj++)
+float collide_row_scalar(const t_param params, const t_speed* src, t_speed* dst,
+                         const uint8_t* obstacles, const int n)
+{
+  float tot_u = 0;      /* accumulated magnitudes of velocity for each cell */
+
+  /* views may start anywhere in a row, so nothing is known about
+  ** their alignment */
+  IVDEP
+  for (int ii = 0; ii < n; ii++)
   {
-    for (int ii = 0; ii < params->nx; ii++)
+    const int obst = obstacles[ii];
+
+    /* propagate densities from neighbouring cells */
+    float speeds[NSPEEDS] __attribute__((aligned(32)));
+    speeds[0] = src->speeds[0][ii]; /* central cell, no movement */
+    speeds[1] = src->speeds[1][ii]; /* east */
+    speeds[2] = src->speeds[2][ii]; /* north */
+    speeds[3] = src->speeds[3][ii]; /* west */
+    speeds[4] = src->speeds[4][ii]; /* south */
+    speeds[5] = src->speeds[5][ii]; /* north-east */
+    speeds[6] = src->speeds[6][ii]; /* north-west */
+    speeds[7] = src->speeds[7][ii]; /* south-west */
+    speeds[8] = src->speeds[8][ii]; /* south-east */
+
+    float relaxed[NSPEEDS] __attribute__((aligned(32)));
+    float u = relax_cell(params, speeds, relaxed);
+
+    /* relaxation step, or mirroring if the cell contains an obstacle */
+    dst->speeds[0][ii] = obst ? speeds[0] : relaxed[0];
+    dst->speeds[1][ii] = obst ? speeds[3] : relaxed[1];
+    dst->speeds[2][ii] = obst ? speeds[4] : relaxed[2];
+    dst->speeds[3][ii] = obst ? speeds[1] : relaxed[3];
+    dst->speeds[4][ii] = obst ? speeds[2] : relaxed[4];
+    dst->speeds[5][ii] = obst ? speeds[7] : relaxed[5];
+    dst->speeds[6][ii] = obst ? speeds[8] : relaxed[6];
+    dst->speeds[7][ii] = obst ? speeds[5] : relaxed[7];
+    dst->speeds[8][ii] = obst ? speeds[6] : relaxed[8];
+
+    tot_u += obst ? 0.f : u;
+  }
+
+  return tot_u;
+}
+
+#ifdef HAVE_X86_SIMD
+/*
+** Hand-vectorised collide_row(): 8 (AVX2) or 16 (AVX-512) cells per
+** iteration, with the obstacle test turned into a lane mask that
+** blends the mirrored speeds over the relaxed ones.  Divisions by the
+** lattice constants become multiplications and opposite speeds share
+** their equilibrium terms, so results agree with collide_row_scalar()
+** to rounding rather than bit for bit.  Cells left over at the end of
+** the run are handed to the next narrower kernel.  The _n bodies take
+** omega and n as arguments and are always inlined, so that the sweeps
+** for fixed grids below compile them with constants.
+*/
+__attribute__((always_inline, target("avx2,fma")))
+static inline float collide_row_avx2_n(const t_param params, const float omega_value, const t_speed* src,
+                                       t_speed* dst, const uint8_t* obstacles, const int n)
+{
+  const __m256 one     = _mm256_set1_ps(1.f);
+  const __m256 omega   = _mm256_set1_ps(omega_value);
+  const __m256 w0      = _mm256_set1_ps(4.f / 9.f);   /* weighting factor */
+  const __m256 w1      = _mm256_set1_ps(1.f / 9.f);   /* weighting factor */
+  const __m256 w2      = _mm256_set1_ps(1.f / 36.f);  /* weighting factor */
+  const __m256 r_csq   = _mm256_set1_ps(3.f);         /* 1 / c_sq */
+  const __m256 r_c2sq  = _mm256_set1_ps(1.5f);        /* 1 / (2 c_sq) */
+  const __m256 r_c2sq2 = _mm256_set1_ps(4.5f);        /* 1 / (2 c_sq^2) */
+  __m256 tot_u = _mm256_setzero_ps();
+  int    ii;
+
+  for (ii = 0; ii + 8 <= n; ii += 8)
+  {
+    __m256 f[NSPEEDS];    /* streamed speeds */
+    __m256 out[NSPEEDS];  /* relaxed speeds */
+
+    for (int kk = 0; kk < NSPEEDS; kk++)
     {
-      (*obstacles_ptr)[ii + jj*params->nx] = 0;
+      f[kk] = _mm256_loadu_ps(src->speeds[kk] + ii);
+    }
+
+    /* all-ones lanes for cells that contain an obstacle */
+    const __m256 obst = _mm256_castsi256_ps(_mm256_cmpgt_epi32(
+        _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(obstacles + ii))), _mm256_setzero_si256()));
+
+    /* local density and velocity */
+    __m256 rho = f[0];
+    for (int kk = 1; kk < NSPEEDS; kk++) rho = _mm256_add_ps(rho, f[kk]);
+
+    const __m256 r_rho = _mm256_div_ps(one, rho);
+    const __m256 u_x = _mm256_mul_ps(_mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(f[1], f[5]), f[8]),
+                                                   _mm256_add_ps(_mm256_add_ps(f[3], f[6]), f[7])), r_rho);
+    const __m256 u_y = _mm256_mul_ps(_mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(f[2], f[5]), f[6]),
+                                                   _mm256_add_ps(_mm256_add_ps(f[4], f[7]), f[8])), r_rho);
+    const __m256 u_sq = _mm256_fmadd_ps(u_x, u_x, _mm256_mul_ps(u_y, u_y));
+
+    /* 1 - u_sq / (2 c_sq), common to every equilibrium density */
+    const __m256 base = _mm256_fnmadd_ps(u_sq, r_c2sq, one);
+
+    /* directional velocities of speeds 1, 2, 5 & 6; 3, 4, 7 & 8 are their opposites */
+    const __m256 u_dir[4] = { u_x, u_y, _mm256_add_ps(u_x, u_y), _mm256_sub_ps(u_y, u_x) };
+    const int    s_pos[4] = { 1, 2, 5, 6 };
+    const __m256 w_rho[4] = { _mm256_mul_ps(w1, rho), _mm256_mul_ps(w1, rho),
+                              _mm256_mul_ps(w2, rho), _mm256_mul_ps(w2, rho) };
+
+    out[0] = _mm256_fmadd_ps(omega, _mm256_sub_ps(_mm256_mul_ps(_mm256_mul_ps(w0, rho), base), f[0]), f[0]);
+
+    for (int pp = 0; pp < 4; pp++)
+    {
+      const int    kp = s_pos[pp];
+      const int    kn = opp[kp];
+      const __m256 t  = _mm256_fmadd_ps(_mm256_mul_ps(u_dir[pp], u_dir[pp]), r_c2sq2, base);
+      const __m256 l  = _mm256_mul_ps(u_dir[pp], r_csq);
+
+      out[kp] = _mm256_fmadd_ps(omega, _mm256_sub_ps(_mm256_mul_ps(w_rho[pp], _mm256_add_ps(t, l)), f[kp]), f[kp]);
+      out[kn] = _mm256_fmadd_ps(omega, _mm256_sub_ps(_mm256_mul_ps(w_rho[pp], _mm256_sub_ps(t, l)), f[kn]), f[kn]);
+    }
+
+    /* relaxed speeds, or mirrored ones where there is an obstacle */
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      _mm256_storeu_ps(dst->speeds[kk] + ii, _mm256_blendv_ps(out[kk], f[opp[kk]], obst));
     }
+
+    tot_u = _mm256_add_ps(tot_u, _mm256_andnot_ps(obst, _mm256_sqrt_ps(u_sq)));
   }
 
-  /* open the obstacle data file */
-  fp = fopen(obstaclefile, "r");
+  __m128 sum = _mm_add_ps(_mm256_castps256_ps128(tot_u), _mm256_extractf128_ps(tot_u, 1));
+  sum = _mm_hadd_ps(sum, sum);
+  sum = _mm_hadd_ps(sum, sum);
 
-  if (fp == NULL)
+  float total = _mm_cvtss_f32(sum);
+
+  if (ii < n)
   {
-    sprintf(message, "could not open input obstacles file: %s", obstaclefile);
-    die(message, __LINE__, __FILE__);
+    t_speed src_tail, dst_tail;
+
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      src_tail.speeds[kk] = src->speeds[kk] + ii;
+      dst_tail.speeds[kk] = dst->speeds[kk] + ii;
+    }
+
+    total += collide_row_scalar(params, &src_tail, &dst_tail, obstacles + ii, n - ii);
+  }
+
+  return total;
+}
+
+__attribute__((target("avx2,fma")))
+float collide_row_avx2(const t_param params, const t_speed* src, t_speed* dst,
+                       const uint8_t* obstacles, const int n)
+{
+  return collide_row_avx2_n(params, params.omega, src, dst, obstacles, n);
+}
+
+/*
+** Relaxes the streamed speeds f of 16 cells into out, mirroring them
+** in the cells of obst instead, and adds the norms of the velocities
+** of the other cells to tot_u.  Every AVX-512 CPU has AVX2 and FMA,
+** which the tails of the row kernel need.
+*/
+__attribute__((always_inline, target("avx512f,avx2,fma")))
+static inline __m512 relax_avx512(const float omega_value, const __m512 f[NSPEEDS], const __mmask16 obst,
+                                __m512 out[NSPEEDS], const __m512 tot_u)
+{
+  const __m512 one     = _mm512_set1_ps(1.f);
+  const __m512 omega   = _mm512_set1_ps(omega_value);
+  const __m512 w0      = _mm512_set1_ps(4.f / 9.f);   /* weighting factor */
+  const __m512 w1      = _mm512_set1_ps(1.f / 9.f);   /* weighting factor */
+  const __m512 w2      = _mm512_set1_ps(1.f / 36.f);  /* weighting factor */
+  const __m512 r_csq   = _mm512_set1_ps(3.f);         /* 1 / c_sq */
+  const __m512 r_c2sq  = _mm512_set1_ps(1.5f);        /* 1 / (2 c_sq) */
+  const __m512 r_c2sq2 = _mm512_set1_ps(4.5f);        /* 1 / (2 c_sq^2) */
+
+  /* local density and velocity */
+  __m512 rho = f[0];
+  for (int kk = 1; kk < NSPEEDS; kk++) rho = _mm512_add_ps(rho, f[kk]);
+
+  const __m512 r_rho = _mm512_div_ps(one, rho);
+  const __m512 u_x = _mm512_mul_ps(_mm512_sub_ps(_mm512_add_ps(_mm512_add_ps(f[1], f[5]), f[8]),
+                                                 _mm512_add_ps(_mm512_add_ps(f[3], f[6]), f[7])), r_rho);
+  const __m512 u_y = _mm512_mul_ps(_mm512_sub_ps(_mm512_add_ps(_mm512_add_ps(f[2], f[5]), f[6]),
+                                                 _mm512_add_ps(_mm512_add_ps(f[4], f[7]), f[8])), r_rho);
+  const __m512 u_sq = _mm512_fmadd_ps(u_x, u_x, _mm512_mul_ps(u_y, u_y));
+
+  /* 1 - u_sq / (2 c_sq), common to every equilibrium density */
+  const __m512 base = _mm512_fnmadd_ps(u_sq, r_c2sq, one);
+
+  /* directional velocities of speeds 1, 2, 5 & 6; 3, 4, 7 & 8 are their opposites */
+  const __m512 u_dir[4] = { u_x, u_y, _mm512_add_ps(u_x, u_y), _mm512_sub_ps(u_y, u_x) };
+  const int    s_pos[4] = { 1, 2, 5, 6 };
+  const __m512 w_rho[4] = { _mm512_mul_ps(w1, rho), _mm512_mul_ps(w1, rho),
+                            _mm512_mul_ps(w2, rho), _mm512_mul_ps(w2, rho) };
+
+  out[0] = _mm512_fmadd_ps(omega, _mm512_sub_ps(_mm512_mul_ps(_mm512_mul_ps(w0, rho), base), f[0]), f[0]);
+
+  for (int pp = 0; pp < 4; pp++)
+  {
+    const int    kp = s_pos[pp];
+    const int    kn = opp[kp];
+    const __m512 t  = _mm512_fmadd_ps(_mm512_mul_ps(u_dir[pp], u_dir[pp]), r_c2sq2, base);
+    const __m512 l  = _mm512_mul_ps(u_dir[pp], r_csq);
+
+    out[kp] = _mm512_fmadd_ps(omega, _mm512_sub_ps(_mm512_mul_ps(w_rho[pp], _mm512_add_ps(t, l)), f[kp]), f[kp]);
+    out[kn] = _mm512_fmadd_ps(omega, _mm512_sub_ps(_mm512_mul_ps(w_rho[pp], _mm512_sub_ps(t, l)), f[kn]), f[kn]);
   }
 
-  /* read-in the blocked cells list */
-  while ((retval = fscanf(fp, "%d %d %d\n", &xx, &yy, &blocked)) != EOF)
+  /* relaxed speeds, or mirrored ones where there is an obstacle */
+  for (int kk = 0; kk < NSPEEDS; kk++)
+  {
+    out[kk] = _mm512_mask_blend_ps(obst, out[kk], f[opp[kk]]);
+  }
+
+  return _mm512_mask_add_ps(tot_u, (__mmask16) ~obst, tot_u, _mm512_sqrt_ps(u_sq));
+}
+
+__attribute__((always_inline, target("avx512f,avx2,fma")))
+static inline float collide_row_avx512_n(const t_param params, const float omega_value, const t_speed* src,
+                                         t_speed* dst, const uint8_t* obstacles, const int n)
+{
+  __m512 tot_u = _mm512_setzero_ps();
+  int    ii;
+
+  for (ii = 0; ii + 16 <= n; ii += 16)
   {
-    /* some checks */
-    if (retval != 3) die("expected 3 values per line in obstacle file", __LINE__, __FILE__);
+    __m512 f[NSPEEDS];    /* streamed speeds */
+    __m512 out[NSPEEDS];  /* relaxed speeds */
 
-    if (xx < 0 || xx > params->nx - 1) die("obstacle x-coord out of range", __LINE__, __FILE__);
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      f[kk] = _mm512_loadu_ps(src->speeds[kk] + ii);
+    }
 
-    if (yy < 0 || yy > params->ny - 1) die("obstacle y-coord out of range", __LINE__, __FILE__);
+    /* set bits for cells that contain an obstacle */
+    const __m512i   mask = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(obstacles + ii)));
+    const __mmask16 obst = _mm512_test_epi32_mask(mask, mask);
 
-    if (blocked != 1) die("obstacle blocked value should be 1", __LINE__, __FILE__);
+    tot_u = relax_avx512(omega_value, f, obst, out, tot_u);
 
-    /* assign to array */
-    (*obstacles_ptr)[xx + yy*params->nx] = blocked;
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      _mm512_storeu_ps(dst->speeds[kk] + ii, out[kk]);
+    }
   }
 
-  /* and close the file */
-  fclose(fp);
+  float total = _mm512_reduce_add_ps(tot_u);
 
-  /*
-  ** allocate space to hold a record of the avarage velocities computed
-  ** at each timestep
-  */
-  *av_vels_ptr = (float*)_mm_malloc(sizeof(float) * params->maxIters, 32);
+  if (ii < n)
+  {
+    t_speed src_tail, dst_tail;
 
-  return EXIT_SUCCESS;
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      src_tail.speeds[kk] = src->speeds[kk] + ii;
+      dst_tail.speeds[kk] = dst->speeds[kk] + ii;
+    }
+
+    total += collide_row_avx2_n(params, omega_value, &src_tail, &dst_tail, obstacles + ii, n - ii);
+  }
+
+  return total;
 }
 
-int finalise(const t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
-             int** obstacles_ptr, float** av_vels_ptr)
+__attribute__((target("avx512f,avx2,fma")))
+float collide_row_avx512(const t_param params, const t_speed* src, t_speed* dst,
+                         const uint8_t* obstacles, const int n)
 {
-  /*
-  ** free up allocated memory
-  */
-  _mm_free(*cells_ptr);
-  *cells_ptr = NULL;
+  return collide_row_avx512_n(params, params.omega, src, dst, obstacles, n);
+}
 
-  _mm_free(*tmp_cells_ptr);
-  *tmp_cells_ptr = NULL;
+/*
+** Sweeps for fixed grids.  FIXED_BODIES() writes out
+** propagate_rows_team() and propagate_halo_team() once for each
+** instruction set, as inline bodies taking nx, ny and omega, and
+** FIXED_GRID() defines the sweeps of one grid size that call them
+** with constants in their place.  The compiler then knows the length
+** of every row and of its runs of cells, unrolls their vector loops
+** exactly, drops the tails when nx is a multiple of the vector width,
+** and turns the wrap-around neighbours and strides into constants.
+** The sweeps do the same arithmetic as the generic ones, but once
+** the trip counts are known -Ofast may group the sums differently,
+** so the results agree to rounding rather than bit for bit.
+*/
+#ifdef FIXED_OMEGA
+#define FIXED_OMEGA_OF(params) ((float)(FIXED_OMEGA))
+#else
+#define FIXED_OMEGA_OF(params) ((params).omega)
+#endif
 
-  _mm_free(*obstacles_ptr);
-  *obstacles_ptr = NULL;
+#define FIXED_BODIES(isa, target_isa)                                                                       \
+__attribute__((always_inline, target(target_isa)))                                                         \
+static inline float propagate_rows_##isa##_n(const t_param params, const float omega, t_speed* cells,       \
+                                             t_speed* tmp_cells, uint8_t* obstacles, const int force,       \
+                                             const int nx, const int ny)                                    \
+{                                                                                                           \
+  float tot_u = 0;                                                                                          \
+  int   lo, hi;                                                                                             \
+                                                                                                            \
+  team_rows(params, 0, ny, &lo, &hi);                                                                       \
+                                                                                                            \
+  /* the edge cells of each row and the run of nx - 2 between them */                                       \
+  for (int jj = lo; jj < hi; jj++)                                                                          \
+  {                                                                                                         \
+    const int start[3] = { 1, 0, nx - 1 };                                                                  \
+    const int count[3] = { nx - 2, 1, 1 };                                                                  \
+    const int y_s = (jj == 0) ? ny - 1 : jj - 1;                                                            \
+    const int y_n = (jj == ny - 1) ? 0 : jj + 1;                                                            \
+                                                                                                            \
+    for (int part = 0; part < 3; part++)                                                                    \
+    {                                                                                                       \
+      t_speed src, dst;                                                                                     \
+                                                                                                            \
+      for (int kk = 0; kk < NSPEEDS; kk++)                                                                  \
+      {                                                                                                     \
+        const int x = (start[part] - cx[kk] + nx) % nx;                                                     \
+        const int y = (cy[kk] > 0) ? y_s : (cy[kk] < 0) ? y_n : jj;                                         \
+                                                                                                            \
+        src.speeds[kk] = cells->speeds[kk] + x + y*nx;                                                      \
+        dst.speeds[kk] = tmp_cells->speeds[kk] + start[part] + jj*nx;                                       \
+      }                                                                                                     \
+                                                                                                            \
+      tot_u += collide_row_##isa##_n(params, omega, &src, &dst, obstacles + start[part] + jj*nx, count[part]); \
+    }                                                                                                       \
+                                                                                                            \
+    if (force && jj == ny - 2) accelerate_flow(params, tmp_cells, obstacles);                               \
+  }                                                                                                         \
+                                                                                                            \
+  return tot_u;                                                                                             \
+}                                                                                                           \
+                                                                                                            \
+__attribute__((always_inline, target(target_isa)))                                                         \
+static inline float propagate_halo_##isa##_n(const t_param params, const float omega, t_speed* cells,       \
+                                             t_speed* tmp_cells, uint8_t* obstacles, const int force,       \
+                                             const int nx, const int ny)                                    \
+{                                                                                                           \
+  const int stride = HALO_STRIDE(nx);                                                                       \
+  float     tot_u = 0;                                                                                      \
+  int       lo, hi;                                                                                         \
+                                                                                                            \
+  team_rows(params, 0, ny, &lo, &hi);                                                                       \
+                                                                                                            \
+  for (int jj = lo; jj < hi; jj++)                                                                          \
+  {                                                                                                         \
+    const int row = stride + HALO_PAD + jj*stride;                                                          \
+    t_speed   src, dst;                                                                                     \
+                                                                                                            \
+    stream_row(&src, cells, row - stride, row, row + stride);                                               \
+                                                                                                            \
+    for (int kk = 0; kk < NSPEEDS; kk++)                                                                    \
+    {                                                                                                       \
+      dst.speeds[kk] = tmp_cells->speeds[kk] + row;                                                         \
+    }                                                                                                       \
+                                                                                                            \
+    tot_u += collide_row_##isa##_n(params, omega, &src, &dst, obstacles + jj*nx, nx);                       \
+                                                                                                            \
+    if (force && jj == ny - 2) accelerate_flow(params, tmp_cells, obstacles);                               \
+  }                                                                                                         \
+                                                                                                            \
+  return tot_u;                                                                                             \
+}
 
-  _mm_free(*av_vels_ptr);
-  *av_vels_ptr = NULL;
+FIXED_BODIES(avx2, "avx2,fma")
+FIXED_BODIES(avx512, "avx512f,avx2,fma")
 
-  return EXIT_SUCCESS;
+#define FIXED_SWEEPS(isa, target_isa, NX, NY)                                                               \
+__attribute__((target(target_isa)))                                                                        \
+static float propagate_rows_##isa##_##NX##x##NY(const t_param params, t_speed* cells, t_speed* tmp_cells,   \
+                                                uint8_t* obstacles, const int force)                        \
+{                                                                                                           \
+  return propagate_rows_##isa##_n(params, FIXED_OMEGA_OF(params), cells, tmp_cells, obstacles, force, NX, NY); \
+}                                                                                                           \
+                                                                                                            \
+__attribute__((target(target_isa)))                                                                        \
+static float propagate_halo_##isa##_##NX##x##NY(const t_param params, t_speed* cells, t_speed* tmp_cells,   \
+                                                uint8_t* obstacles, const int force)                        \
+{                                                                                                           \
+  return propagate_halo_##isa##_n(params, FIXED_OMEGA_OF(params), cells, tmp_cells, obstacles, force, NX, NY); \
 }
 
+#define FIXED_GRID(NX, NY)                             \
+  FIXED_SWEEPS(avx2, "avx2,fma", NX, NY)               \
+  FIXED_SWEEPS(avx512, "avx512f,avx2,fma", NX, NY)
 
-float calc_reynolds(const t_param params, float av_vels)
+FIXED_GRIDS(FIXED_GRID)
+
+/* one grid's sweeps, for the plain and the halo layout, AVX2 first */
+typedef float (*t_sweep)(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles, const int force);
+
+typedef struct
 {
-  const float viscosity = 1.f / 6.f * (2.f / params.omega - 1.f);
+  int     nx, ny;
+  t_sweep rows[2];
+  t_sweep halo[2];
+} t_fixed_grid;
 
-  return av_vels * params.reynolds_dim / viscosity;
+#define FIXED_GRID_ENTRY(NX, NY)                                                 \
+  { NX, NY, { propagate_rows_avx2_##NX##x##NY, propagate_rows_avx512_##NX##x##NY }, \
+            { propagate_halo_avx2_##NX##x##NY, propagate_halo_avx512_##NX##x##NY } },
+
+static const t_fixed_grid fixed_grids[] = { FIXED_GRIDS(FIXED_GRID_ENTRY) };
+#endif
+
+float propagate_fixed_team(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles, const int force)
+{
+#ifdef HAVE_X86_SIMD
+  const t_fixed_grid* grid = &fixed_grids[params.fixed_grid];
+  const int           isa = (params.simd == SIMD_AVX512);
+
+  return (params.layout == LAYOUT_HALO) ? grid->halo[isa](params, cells, tmp_cells, obstacles, force)
+                                        : grid->rows[isa](params, cells, tmp_cells, obstacles, force);
+#else
+  (void)params; (void)cells; (void)tmp_cells; (void)obstacles; (void)force;
+  die("no kernels for fixed grids in this build", __LINE__, __FILE__);
+  return 0.f;
+#endif
 }
 
-float total_density(const t_param params, t_speed* cells)
+int select_fixed(const t_param params)
 {
-  float total = 0.f;  /* accumulator */
+#ifdef HAVE_X86_SIMD
+  /* only the fused engine's fp32 sweeps over whole rows of a whole grid are specialised */
+  if (!params.fixed || params.engine != ENGINE_FUSED || params.storage != STORAGE_FP32 || params.nranks > 1
+      || params.tile_w != TILE_OFF || params.layout == LAYOUT_AOSOA
+      || (params.simd != SIMD_AVX2 && params.simd != SIMD_AVX512))
+  {
+    return -1;
+  }
 
-  for (int jj = 0; jj < params.ny; jj++)
+#ifdef FIXED_OMEGA
+  if (params.omega != (float)(FIXED_OMEGA)) return -1;
+#endif
+
+  for (int gg = 0; gg < (int)(sizeof(fixed_grids) / sizeof(fixed_grids[0])); gg++)
   {
-    for (int ii = 0; ii < params.nx; ii++)
-    {
-      for (int kk = 0; kk < NSPEEDS; kk++)
-      {
-        total += cells->speeds[kk][ii + jj*params.nx];
-      }
-    }
+    if (fixed_grids[gg].nx == params.nx && fixed_grids[gg].ny == params.global_ny) return gg;
   }
+#endif
+  (void)params;
 
-  return total;
+  return -1;
 }
 
-int write_values(const t_param params, t_speed* cells, int* obstacles, float* av_vels)
+void stream_row(t_speed* src, const t_speed* lattice, const int south, const int centre, const int north)
 {
-  FILE* fp;                     /* file pointer */
-  const float c_sq = 1.f / 3.f; /* sq. of speed of sound */
-  float local_density;         /* per grid cell sum of densities */
-  float pressure;              /* fluid pressure in grid cell */
-  float u_x;                   /* x-component of velocity in grid cell */
-  float u_y;                   /* y-component of velocity in grid cell */
-  float u;                     /* norm--root of summed squares--of u_x and u_y */
+  src->speeds[0] = lattice->speeds[0] + centre;
+  src->speeds[1] = lattice->speeds[1] + centre - 1;
+  src->speeds[2] = lattice->speeds[2] + south;
+  src->speeds[3] = lattice->speeds[3] + centre + 1;
+  src->speeds[4] = lattice->speeds[4] + north;
+  src->speeds[5] = lattice->speeds[5] + south - 1;
+  src->speeds[6] = lattice->speeds[6] + south + 1;
+  src->speeds[7] = lattice->speeds[7] + north + 1;
+  src->speeds[8] = lattice->speeds[8] + north - 1;
+}
 
-  fp = fopen(FINALSTATEFILE, "w");
+float propagate_halo(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles, const int force)
+{
+  return propagate_halo_rows(params, cells, tmp_cells, obstacles, 0, params.ny, force) / (float)params.nfluid;
+}
 
-  if (fp == NULL)
-  {
-    die("could not open file output file", __LINE__, __FILE__);
-  }
+/* rows first to last-1 of propagate_halo(), returning their summed velocities */
+float propagate_halo_rows(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles,
+                          const int first, const int last, const int force)
+{
+  float tot_u = 0;      /* accumulated magnitudes of velocity for each cell */
 
-  for (int jj = 0; jj < params.ny; jj++)
+  #pragma omp parallel reduction(+:tot_u)
+  tot_u += propagate_halo_team(params, cells, tmp_cells, obstacles, first, last, force);
+
+  return tot_u;
+}
+
+float propagate_halo_team(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles,
+                          const int first, const int last, const int force)
+{
+  float tot_u = 0;      /* accumulated magnitudes of velocity for each cell */
+  int   lo, hi;         /* this thread's rows */
+
+  team_rows(params, first, last, &lo, &hi);
+
+  /* the ghost cells hold the wrapped-around neighbours, so every
+  ** cell pulls from constant offsets and the loop has no branches;
+  ** there is no barrier at the end, see timestep_team() */
+  for (int jj = lo; jj < hi; jj++)
   {
-    for (int ii = 0; ii < params.nx; ii++)
-    {
-      /* an occupied cell */
-      if (obstacles[ii + jj*params.nx])
-      {
-        u_x = u_y = u = 0.f;
-        pressure = params.density * c_sq;
-      }
-      /* no obstacle */
-      else
-      {
-        local_density = 0.f;
+    const int row = params.origin + jj*params.stride;
+    t_speed src, dst;
 
-        for (int kk = 0; kk < NSPEEDS; kk++)
-        {
-          local_density += cells->speeds[kk][ii + jj*params.nx];
-        }
+    stream_row(&src, cells, row - params.stride, row, row + params.stride);
 
-        /* compute x velocity component */
-        u_x = (cells->speeds[1][ii + jj*params.nx]
-               + cells->speeds[5][ii + jj*params.nx]
-               + cells->speeds[8][ii + jj*params.nx]
-               - (cells->speeds[3][ii + jj*params.nx]
-                  + cells->speeds[6][ii + jj*params.nx]
-                  + cells->speeds[7][ii + jj*params.nx]))
-              / local_density;
-        /* compute y velocity component */
-        u_y = (cells->speeds[2][ii + jj*params.nx]
-               + cells->speeds[5][ii + jj*params.nx]
-               + cells->speeds[6][ii + jj*params.nx]
-               - (cells->speeds[4][ii + jj*params.nx]
-                  + cells->speeds[7][ii + jj*params.nx]
-                  + cells->speeds[8][ii + jj*params.nx]))
-              / local_density;
-        /* compute norm of velocity */
-        u = sqrtf((u_x * u_x) + (u_y * u_y));
-        /* compute pressure */
-        pressure = local_density * c_sq;
-      }
-
-      /* write to file */
-      fprintf(fp, "%d %d %.12E %.12E %.12E %.12E %d\n", ii, jj, u_x, u_y, u, pressure, obstacles[ii * params.nx + jj]);
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      dst.speeds[kk] = tmp_cells->speeds[kk] + row;
     }
-  }
 
-  fclose(fp);
+    tot_u += collide_row(params, &src, &dst, obstacles + jj*params.nx, params.nx);
 
-  fp = fopen(AVVELSFILE, "w");
+    /* accelerate the new row for the next timestep while it is in cache */
+    if (force && jj == params.global_ny - 2 - params.row0) accelerate_flow(params, tmp_cells, obstacles);
+  }
 
-  if (fp == NULL)
+  return tot_u;
+}
+
+void lattice_view(const t_param params, t_speed* view, const t_speed* cells,
+                  const int ii, const int jj, const int dir, const int swap)
+{
+  for (int kk = 0; kk < NSPEEDS; kk++)
   {
-    die("could not open file output file", __LINE__, __FILE__);
+    const int x = (ii + dir*cx[kk] + params.nx) % params.nx;
+    const int y = (jj + dir*cy[kk] + params.ny) % params.ny;
+
+    view->speeds[kk] = cells->speeds[swap ? opp[kk] : kk] + params.origin + x + y*params.stride;
   }
+}
+
+float propagate_rows(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles, const int force)
+{
+  float tot_u = 0;      /* accumulated magnitudes of velocity for each cell */
 
-  for (int ii = 0; ii < params.maxIters; ii++)
+  #pragma omp parallel reduction(+:tot_u)
+  tot_u += propagate_rows_team(params, cells, tmp_cells, obstacles, force);
+
+  return tot_u / (float)params.nfluid;
+}
+
+float propagate_rows_team(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles, const int force)
+{
+  float tot_u = 0;      /* accumulated magnitudes of velocity for each cell */
+  int   lo, hi;         /* this thread's rows */
+
+  team_rows(params, 0, params.ny, &lo, &hi);
+
+  /* propagate() for the row kernels: away from the west and east
+  ** edges the neighbours are at constant offsets, so each row is
+  ** split into its edge cells and the run of cells in between; there
+  ** is no barrier at the end, see timestep_team() */
+  for (int jj = lo; jj < hi; jj++)
   {
-    fprintf(fp, "%d:\t%.12E\n", ii, av_vels[ii]);
+    const int start[3] = { 1, 0, params.nx - 1 };
+    const int count[3] = { params.nx - 2, 1, 1 };
+
+    for (int part = 0; part < ((params.nx > 1) ? 3 : 2); part++)
+    {
+      t_speed src, dst;
+
+      if (count[part] <= 0) continue;
+
+      lattice_view(params, &src, cells, start[part], jj, -1, 0);
+      lattice_view(params, &dst, tmp_cells, start[part], jj, 0, 0);
+      tot_u += collide_row(params, &src, &dst, obstacles + start[part] + jj*params.nx, count[part]);
+    }
+
+    /* accelerate the new row for the next timestep while it is in cache */
+    if (force && jj == params.global_ny - 2 - params.row0) accelerate_flow(params, tmp_cells, obstacles);
   }
 
-  fclose(fp);
+  return tot_u;
+}
 
-  return EXIT_SUCCESS;
+/*
+** The sweep of the AoSoA layout, a block of cells at a time.  The
+** speeds that move north or south, or not at all, are pulled from
+** the same block of the row below or above; those that also move east
+** or west are one cell out of step with the blocks, and are shifted
+** into place from the block and its neighbour: with AVX-512 in a
+** register, a block being one vector, and otherwise in a small buffer
+** for the row kernels.
+*/
+#ifdef HAVE_X86_SIMD
+/* a block's cells pulled from one cell to the west, from the last cell of the block to the west and the first 15 of this one */
+__attribute__((always_inline, target("avx512f,avx2,fma")))
+static inline __m512 pull_west_avx512(const float* here, const int west)
+{
+  return _mm512_castsi512_ps(_mm512_alignr_epi32(_mm512_castps_si512(_mm512_load_ps(here)),
+                                                 _mm512_castps_si512(_mm512_load_ps(here + west)), 15));
 }
 
-void die(const char* message, const int line, const char* file)
+/* and from one cell to the east */
+__attribute__((always_inline, target("avx512f,avx2,fma")))
+static inline __m512 pull_east_avx512(const float* here, const int east)
 {
-  fprintf(stderr, "Error at line %d of file %s:\n", line, file);
-  fprintf(stderr, "%s\n", message);
-  fflush(stderr);
-  exit(EXIT_FAILURE);
+  return _mm512_castsi512_ps(_mm512_alignr_epi32(_mm512_castps_si512(_mm512_load_ps(here + east)),
+                                                 _mm512_castps_si512(_mm512_load_ps(here)), 1));
+}
+
+__attribute__((target("avx512f,avx2,fma")))
+static float propagate_aosoa_row_avx512(const t_param params, t_speed* cells, t_speed* tmp_cells,
+                                        const uint8_t* obstacles, const int jj, const int y_s, const int y_n)
+{
+  const int blocks = params.nx / AOSOA_LANES;  /* per row */
+  const int block = NSPEEDS * AOSOA_LANES;      /* floats from one block to the next */
+  __m512    tot_u = _mm512_setzero_ps();
+
+  for (int bb = 0; bb < blocks; bb++)
+  {
+    const int west = (((bb == 0) ? blocks - 1 : bb - 1) - bb) * block;  /* floats to the neighbouring blocks */
+    const int east = (((bb == blocks - 1) ? 0 : bb + 1) - bb) * block;
+    const int s = cell_index(params, bb * AOSOA_LANES, y_s);  /* the block in the rows below, */
+    const int c = cell_index(params, bb * AOSOA_LANES, jj);   /* at and */
+    const int n = cell_index(params, bb * AOSOA_LANES, y_n);  /* above this one */
+    __m512    f[NSPEEDS];    /* streamed speeds */
+    __m512    out[NSPEEDS];  /* relaxed speeds */
+
+    f[0] = _mm512_load_ps(cells->speeds[0] + c);
+    f[1] = pull_west_avx512(cells->speeds[1] + c, west);
+    f[2] = _mm512_load_ps(cells->speeds[2] + s);
+    f[3] = pull_east_avx512(cells->speeds[3] + c, east);
+    f[4] = _mm512_load_ps(cells->speeds[4] + n);
+    f[5] = pull_west_avx512(cells->speeds[5] + s, west);
+    f[6] = pull_east_avx512(cells->speeds[6] + s, east);
+    f[7] = pull_east_avx512(cells->speeds[7] + n, east);
+    f[8] = pull_west_avx512(cells->speeds[8] + n, west);
+
+    const __m512i   mask = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(obstacles + bb * AOSOA_LANES + jj*params.nx)));
+    const __mmask16 obst = _mm512_test_epi32_mask(mask, mask);
+    float*          dst = tmp_cells->speeds[0] + c;
+
+    tot_u = relax_avx512(params.omega, f, obst, out, tot_u);
+
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      _mm512_store_ps(dst + kk * AOSOA_LANES, out[kk]);
+    }
+  }
+
+  return _mm512_reduce_add_ps(tot_u);
+}
+#endif
+
+static float propagate_aosoa_row(const t_param params, t_speed* cells, t_speed* tmp_cells,
+                                 uint8_t* obstacles, const int jj, const int y_s, const int y_n)
+{
+  const int blocks = params.nx / AOSOA_LANES;  /* per row */
+  float     tot_u = 0;
+
+#ifdef HAVE_X86_SIMD
+  if (params.simd == SIMD_AVX512) return propagate_aosoa_row_avx512(params, cells, tmp_cells, obstacles, jj, y_s, y_n);
+#endif
+
+  for (int bb = 0; bb < blocks; bb++)
+  {
+    float   shifted[NSPEEDS][AOSOA_LANES] __attribute__((aligned(64)));
+    t_speed src, dst;
+
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      const int y = (cy[kk] > 0) ? y_s : (cy[kk] < 0) ? y_n : jj;
+      float*    here = cells->speeds[kk] + cell_index(params, bb * AOSOA_LANES, y);
+
+      if (cx[kk] == 0)
+      {
+        src.speeds[kk] = here;
+      }
+      else
+      {
+        /* the block to the west of this one for speeds moving east, and the other way round */
+        const int    side_bb = (bb + blocks - cx[kk]) % blocks;
+        const float* side = cells->speeds[kk] + cell_index(params, side_bb * AOSOA_LANES, y);
+
+        if (cx[kk] > 0)
+        {
+          shifted[kk][0] = side[AOSOA_LANES - 1];
+          memcpy(shifted[kk] + 1, here, sizeof(float) * (AOSOA_LANES - 1));
+        }
+        else
+        {
+          memcpy(shifted[kk], here + 1, sizeof(float) * (AOSOA_LANES - 1));
+          shifted[kk][AOSOA_LANES - 1] = side[0];
+        }
+
+        src.speeds[kk] = shifted[kk];
+      }
+
+      dst.speeds[kk] = tmp_cells->speeds[kk] + cell_index(params, bb * AOSOA_LANES, jj);
+    }
+
+    tot_u += collide_row(params, &src, &dst, obstacles + bb * AOSOA_LANES + jj*params.nx, AOSOA_LANES);
+  }
+
+  return tot_u;
+}
+
+float propagate_aosoa_team(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles, const int force)
+{
+  float tot_u = 0;  /* accumulated magnitudes of velocity for each cell */
+  int   lo, hi;     /* this thread's rows */
+
+  team_rows(params, 0, params.ny, &lo, &hi);
+
+  /* no barrier at the end, see timestep_team() */
+  for (int jj = lo; jj < hi; jj++)
+  {
+    const int y_n = (jj + 1) % params.ny;
+    const int y_s = (jj == 0) ? params.ny - 1 : jj - 1;
+
+    tot_u += propagate_aosoa_row(params, cells, tmp_cells, obstacles, jj, y_s, y_n);
+
+    /* accelerate the new row for the next timestep while it is in cache */
+    if (force && jj == params.global_ny - 2 - params.row0) accelerate_flow(params, tmp_cells, obstacles);
+  }
+
+  return tot_u;
+}
+
+/*
+** Spatial tiles.
+**
+** A sweep over whole rows streams three rows of every speed through
+** the cache for each row it writes, and on a wide grid they no longer
+** fit.  The tiled sweep cuts the grid into tiles of tile_w columns and
+** tile_h rows, and numbers them down each column of tiles in turn, so
+** that the tiles a thread gets are stacked on top of each other: the
+** rows either side of the one being written are only tile_w cells
+** long, and the edge rows of one tile are still in cache for the next.
+** A tile's rows are split into runs of cells as propagate_rows_team()
+** splits whole ones, and the accelerated row is accelerated a tile's
+** run at a time.
+*/
+static float propagate_run(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles,
+                           const int jj, const int first, const int last)
+{
+  float tot_u = 0;
+
+  if (params.layout == LAYOUT_HALO)
+  {
+    const int row = params.origin + jj*params.stride + first;
+    t_speed   src, dst;
+
+    stream_row(&src, cells, row - params.stride, row, row + params.stride);
+
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      dst.speeds[kk] = tmp_cells->speeds[kk] + row;
+    }
+
+    return collide_row(params, &src, &dst, obstacles + first + jj*params.nx, last - first);
+  }
+
+  /* the cells away from the west and east edges, then the edges */
+  const int start[3] = { (first > 1) ? first : 1, 0, params.nx - 1 };
+  const int count[3] = { ((last < params.nx - 1) ? last : params.nx - 1) - start[0],
+                         first == 0, last == params.nx && params.nx > 1 };
+
+  for (int part = 0; part < 3; part++)
+  {
+    t_speed src, dst;
+
+    if (count[part] <= 0) continue;
+
+    lattice_view(params, &src, cells, start[part], jj, -1, 0);
+    lattice_view(params, &dst, tmp_cells, start[part], jj, 0, 0);
+    tot_u += collide_row(params, &src, &dst, obstacles + start[part] + jj*params.nx, count[part]);
+  }
+
+  return tot_u;
+}
+
+float propagate_tiles_team(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles, const int force)
+{
+  const int columns = (params.nx + params.tile_w - 1) / params.tile_w;  /* tiles across the grid */
+  const int rows    = (params.ny + params.tile_h - 1) / params.tile_h;  /* and down it */
+  const int accel   = params.global_ny - 2 - params.row0;                /* the row accelerate_flow() changes */
+  float     tot_u = 0;  /* accumulated magnitudes of velocity for each cell */
+
+  /* no barrier at the end, see timestep_team() */
+  #pragma omp for schedule(static) nowait
+  for (int tile = 0; tile < columns * rows; tile++)
+  {
+    const int x0 = (tile / rows) * params.tile_w;
+    const int y0 = (tile % rows) * params.tile_h;
+    const int x1 = (x0 + params.tile_w < params.nx) ? x0 + params.tile_w : params.nx;
+    const int y1 = (y0 + params.tile_h < params.ny) ? y0 + params.tile_h : params.ny;
+
+    for (int jj = y0; jj < y1; jj++)
+    {
+      tot_u += propagate_run(params, cells, tmp_cells, obstacles, jj, x0, x1);
+
+      if (force && jj == accel)
+      {
+        t_speed run;
+
+        for (int kk = 0; kk < NSPEEDS; kk++)
+        {
+          run.speeds[kk] = tmp_cells->speeds[kk] + params.origin + x0 + jj*params.stride;
+        }
+
+        accelerate_row(params, &run, obstacles + x0 + jj*params.nx, x1 - x0);
+      }
+    }
+  }
+
+  return tot_u;
+}
+
+void tile_autotune(t_param* params)
+{
+  long      l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+  long      llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+  const int nthreads = omp_get_max_threads();
+  const int row_bytes = 4 * NSPEEDS * sizeof(float);  /* three rows read and one written, per column */
+
+  if (l2 <= 0) l2 = TILE_L2;
+
+  if (llc <= 0) llc = TILE_LLC;
+
+  /* a tile as wide as half of L2 holds the rows of, in whole vectors */
+  params->tile_w = (int)(l2 / 2 / row_bytes) / 16 * 16;
+
+  if (params->tile_w < 16) params->tile_w = 16;
+
+  if (params->tile_w >= params->nx) params->tile_w = params->nx;
+
+  /* and as tall as every thread's tile fits in the last level cache
+  ** together, so a tile's edge rows are still there for the tiles
+  ** beside it, as long as there are a few tiles for every thread */
+  const int columns = (params->nx + params->tile_w - 1) / params->tile_w;
+  const int share = (int)(llc / 2 / ((long)nthreads * params->tile_w * 2 * NSPEEDS * sizeof(float)));
+  const int most = (params->ny * columns + 4 * nthreads - 1) / (4 * nthreads);
+
+  params->tile_h = (share < most) ? share : most;
+
+  if (params->tile_h < 1) params->tile_h = 1;
+}
+
+/*
+** Row schedules.
+**
+** schedule(static) gives every thread the same number of rows, but
+** rows are not all the same work: propagate_team() branches around
+** the collision of obstacle cells, which then cost SCHED_SOLID_COST
+** of a fluid cell (measured at 0.35 on a lattice in cache and 0.65
+** on one streamed from memory).  SCHED_WEIGHTED instead cuts the rows
+** into shares of equal estimated work, once, from the obstacle map.
+** The vector kernels blend the mirrored speeds over relaxed ones and
+** the halo and AoSoA sweeps never branch, so there every cell costs
+** the same and both schedules share the rows alike.  The shares are
+** for the sweeps over every row of the lattice by a team of
+** omp_get_max_threads() threads; any other range or team, such as
+** the slab edges of an MPI rank or the members of an ensemble, is
+** shared out as schedule(static) would.
+*/
+
+/* the rows of the lattice as schedule(static) shares them out: the
+** first n_rows % nthreads threads take one row more than the rest */
+static void static_rows(const int n_rows, const int t, const int nthreads, int* lo, int* hi)
+{
+  const int q = n_rows / nthreads;
+  const int r = n_rows % nthreads;
+
+  *lo = t * q + ((t < r) ? t : r);
+  *hi = *lo + q + ((t < r) ? 1 : 0);
+}
+
+/* the largest share of the work of rows over the mean */
+static double share_imbalance(const double* row, const int* first, const int nthreads, double* work)
+{
+  double total = 0., most = 0.;
+
+  for (int t = 0; t < nthreads; t++)
+  {
+    work[t] = 0.;
+
+    for (int jj = first[t]; jj < first[t + 1]; jj++) work[t] += row[jj];
+
+    total += work[t];
+
+    if (work[t] > most) most = work[t];
+  }
+
+  return (total > 0.) ? most / (total / nthreads) : 1.;
+}
+
+void schedule_rows(const t_param params, const uint8_t* obstacles)
+{
+  const int    nthreads = omp_get_max_threads();
+  const double solid = (params.layout == LAYOUT_PLAIN && params.simd == SIMD_OFF) ? SCHED_SOLID_COST : 1.;
+  double*      row = (double*) malloc(sizeof(double) * params.ny);  /* estimated work of each row */
+  int*         first[2];  /* the shares of either schedule */
+  double       total = 0.;
+
+  sched.nthreads = nthreads;
+  sched.work = (double*) malloc(sizeof(double) * nthreads);
+  first[SCHED_STATIC] = (int*) malloc(sizeof(int) * (nthreads + 1));
+  first[SCHED_WEIGHTED] = (int*) malloc(sizeof(int) * (nthreads + 1));
+
+  if (row == NULL || sched.work == NULL || first[SCHED_STATIC] == NULL || first[SCHED_WEIGHTED] == NULL)
+  {
+    die("cannot allocate memory for the row schedule", __LINE__, __FILE__);
+  }
+
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    row[jj] = 0.;
+
+    for (int ii = 0; ii < params.nx; ii++) row[jj] += obstacles[ii + jj*params.nx] ? solid : 1.;
+
+    total += row[jj];
+  }
+
+  /* each weighted share ends at the row boundary nearest its
+  ** fraction of the total work */
+  double sum = 0.;
+  int    jj = 0;
+
+  for (int t = 0; t < nthreads; t++)
+  {
+    int hi;
+
+    static_rows(params.ny, t, nthreads, &first[SCHED_STATIC][t], &hi);
+
+    while (jj < params.ny && sum + 0.5 * row[jj] < total * t / nthreads) sum += row[jj++];
+
+    first[SCHED_WEIGHTED][t] = jj;
+  }
+
+  first[SCHED_STATIC][nthreads] = first[SCHED_WEIGHTED][nthreads] = params.ny;
+
+  sched.imbalance[SCHED_WEIGHTED] = share_imbalance(row, first[SCHED_WEIGHTED], nthreads, sched.work);
+  sched.imbalance[SCHED_STATIC] = share_imbalance(row, first[SCHED_STATIC], nthreads, sched.work);
+
+  /* keep the schedule in use, and the work of its shares */
+  sched.first = first[params.schedule];
+  share_imbalance(row, sched.first, nthreads, sched.work);
+
+  free(first[1 - params.schedule]);
+  free(row);
+}
+
+void team_rows(const t_param params, const int first, const int last, int* lo, int* hi)
+{
+  const int t = omp_get_thread_num();
+  const int nthreads = omp_get_num_threads();
+
+  if (params.schedule == SCHED_WEIGHTED && first == 0 && last == params.ny && nthreads == sched.nthreads)
+  {
+    *lo = sched.first[t];
+    *hi = sched.first[t + 1];
+  }
+  else
+  {
+    static_rows(last - first, t, nthreads, lo, hi);
+    *lo += first;
+    *hi += first;
+  }
+}
+
+/*
+** Temporal blocking.
+**
+** The grid is cut into bands of whole rows and each band is
+** advanced by several timesteps in a single wavefront sweep: once
+** row i of the current state has been read, row i-1 can take its
+** first step, row i-2 its second, and so on.  Each intermediate
+** timestep only needs its three most recent rows, so a thread keeps
+** a small ring of rows per timestep that stays in cache, and the
+** full lattice is read and written once per block instead of once
+** per timestep.
+**
+** Bands are independent: a band of rows [r0, r1) also recomputes
+** the rows its final state depends on, steps-s rows either side of
+** it at timestep s, so no thread needs another band's intermediate
+** results.  The recomputed rows are identical to the owning band's
+** but only the owner counts them towards av_vels.
+*/
+#define RING_SLOT(v) ((((v) % 3) + 3) % 3)
+
+int tblock_ring(const t_param params)
+{
+  /* three rows of every speed, with ghost columns, per timestep */
+  return params.tblock_depth * NSPEEDS * 3 * HALO_STRIDE(params.nx);
+}
+
+void wrap_row(const t_param params, t_speed* row)
+{
+  /* speeds travelling east are pulled from the west ghost */
+  row->speeds[1][-1] = row->speeds[1][params.nx - 1];
+  row->speeds[5][-1] = row->speeds[5][params.nx - 1];
+  row->speeds[8][-1] = row->speeds[8][params.nx - 1];
+  /* speeds travelling west are pulled from the east ghost */
+  row->speeds[3][params.nx] = row->speeds[3][0];
+  row->speeds[6][params.nx] = row->speeds[6][0];
+  row->speeds[7][params.nx] = row->speeds[7][0];
+}
+
+void tblock(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles,
+            float* scratch, const int steps, float* av_vels)
+{
+  const int rl = HALO_STRIDE(params.nx);  /* length of a ring row */
+  const int rows = (params.tblock_rows > 0) ? params.tblock_rows
+                 : (params.ny + omp_get_max_threads() - 1) / omp_get_max_threads();
+  const int nbands = (params.ny + rows - 1) / rows;
+  float tot_u[TBLOCK_MAX_DEPTH + 1] = { 0.f };  /* accumulated velocity magnitudes, per timestep */
+
+  #pragma omp parallel reduction(+:tot_u)
+  {
+    float*  mine = scratch + omp_get_thread_num() * tblock_ring(params);
+    t_speed ring[TBLOCK_MAX_DEPTH];  /* ring[s] holds three rows of timestep s */
+
+    for (int ss = 0; ss < steps; ss++)
+    {
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        ring[ss].speeds[kk] = mine + (ss*NSPEEDS + kk) * 3 * rl;
+      }
+    }
+
+    #pragma omp for schedule(static)
+    for (int band = 0; band < nbands; band++)
+    {
+      const int r0 = band * rows;
+      const int r1 = (r0 + rows < params.ny) ? r0 + rows : params.ny;
+
+      for (int ii = r0 - steps; ii < r1 + steps; ii++)
+      {
+        /* read row ii of the current state into the ring */
+        const int g0 = ((ii % params.ny) + params.ny) % params.ny;
+        t_speed   row;
+
+        for (int kk = 0; kk < NSPEEDS; kk++)
+        {
+          row.speeds[kk] = ring[0].speeds[kk] + RING_SLOT(ii)*rl + HALO_PAD;
+          memcpy(row.speeds[kk], cells->speeds[kk] + params.origin + g0*params.stride, sizeof(float) * params.nx);
+        }
+
+        if (g0 == params.ny - 2) accelerate_row(params, &row, obstacles + g0*params.nx, params.nx);
+
+        wrap_row(params, &row);
+
+        /* then move the wavefront: row ii-s takes timestep s */
+        for (int ss = 1; ss <= steps && ii - ss >= r0 - steps + ss; ss++)
+        {
+          const int v = ii - ss;
+          const int g = ((v % params.ny) + params.ny) % params.ny;
+          float     row_u;
+          t_speed   src, dst;
+
+          stream_row(&src, &ring[ss - 1], RING_SLOT(v - 1)*rl + HALO_PAD,
+                     RING_SLOT(v)*rl + HALO_PAD, RING_SLOT(v + 1)*rl + HALO_PAD);
+
+          for (int kk = 0; kk < NSPEEDS; kk++)
+          {
+            dst.speeds[kk] = (ss == steps) ? tmp_cells->speeds[kk] + params.origin + g*params.stride
+                                           : ring[ss].speeds[kk] + RING_SLOT(v)*rl + HALO_PAD;
+          }
+
+          row_u = collide_row(params, &src, &dst, obstacles + g*params.nx, params.nx);
+
+          if (v >= r0 && v < r1) tot_u[ss] += row_u;
+
+          if (ss < steps)
+          {
+            if (g == params.ny - 2) accelerate_row(params, &dst, obstacles + g*params.nx, params.nx);
+
+            wrap_row(params, &dst);
+          }
+        }
+      }
+    }
+  }
+
+  for (int ss = 1; ss <= steps; ss++)
+  {
+    av_vels[ss - 1] = tot_u[ss] / (float)params.nfluid;
+  }
+}
+
+/*
+** AA-pattern streaming.
+**
+** Between timesteps the lattice holds, for every cell, the values
+** that the previous timestep's collision produced there (S below).
+** A timestep pulls S[i] from the neighbour at x - c_i, collides,
+** and produces the next S.  With one buffer this alternates between
+** two layouts, neither of which needs a second lattice:
+**
+**   swapped:  S[i](x) is stored in plane opp(i) of cell x
+**   streamed: S[i](x) is stored in plane i of cell x + c_i
+**
+** An even timestep reads the swapped layout from the neighbours
+** and writes the streamed one back to them; an odd timestep reads
+** the streamed layout (which already sits at cell x) and writes the
+** swapped one back to the same cell.  Either way every cell reads
+** and writes exactly the same nine locations, so cells can be
+** updated in any order and in parallel without a scratch copy.
+**
+** Since S starts out in the usual layout, swapping the pointers of
+** opposite planes turns it into the swapped layout for free, and
+** does the reverse after an even number of timesteps.
+*/
+void aa_swap(t_speed* cells)
+{
+  for (int kk = 1; kk < NSPEEDS; kk++)
+  {
+    if (opp[kk] > kk)
+    {
+      float* swap = cells->speeds[kk];
+      cells->speeds[kk] = cells->speeds[opp[kk]];
+      cells->speeds[opp[kk]] = swap;
+    }
+  }
+}
+
+float aa_even(const t_param params, t_speed* cells, uint8_t* obstacles)
+{
+  float tot_u = 0;      /* accumulated magnitudes of velocity for each cell */
+  t_speed row;
+
+  /* accelerate the 2nd row of the grid, in the swapped layout */
+  lattice_view(params, &row, cells, 0, params.ny - 2, 0, 1);
+  accelerate_row(params, &row, obstacles + (params.ny - 2)*params.nx, params.nx);
+
+  #pragma omp parallel for reduction(+:tot_u) schedule(static)
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    /* away from the west and east edges neighbours are at constant
+    ** offsets, so the row is split into the edge cells and the rest */
+    const int start[3] = { 1, 0, params.nx - 1 };
+    const int count[3] = { params.nx - 2, 1, 1 };
+
+    for (int part = 0; part < ((params.nx > 1) ? 3 : 2); part++)
+    {
+      t_speed src, dst;
+
+      if (count[part] <= 0) continue;
+
+      lattice_view(params, &src, cells, start[part], jj, -1, 1);
+      lattice_view(params, &dst, cells, start[part], jj, 1, 0);
+      tot_u += collide_row(params, &src, &dst, obstacles + start[part] + jj*params.nx, count[part]);
+    }
+  }
+
+  return tot_u / (float)params.nfluid;
+}
+
+float aa_odd(const t_param params, t_speed* cells, uint8_t* obstacles)
+{
+  float tot_u = 0;      /* accumulated magnitudes of velocity for each cell */
+  t_speed row;
+
+  /* accelerate the 2nd row of the grid, in the streamed layout,
+  ** where its values are spread over the neighbouring cells */
+  const int start[3] = { 1, 0, params.nx - 1 };
+  const int count[3] = { params.nx - 2, 1, 1 };
+
+  for (int part = 0; part < ((params.nx > 1) ? 3 : 2); part++)
+  {
+    if (count[part] <= 0) continue;
+
+    lattice_view(params, &row, cells, start[part], params.ny - 2, 1, 0);
+    accelerate_row(params, &row, obstacles + start[part] + (params.ny - 2)*params.nx, count[part]);
+  }
+
+  #pragma omp parallel for reduction(+:tot_u) schedule(static)
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    t_speed src, dst;
+
+    lattice_view(params, &src, cells, 0, jj, 0, 0);
+    lattice_view(params, &dst, cells, 0, jj, 0, 1);
+    tot_u += collide_row(params, &src, &dst, obstacles + jj*params.nx, params.nx);
+  }
+
+  return tot_u / (float)params.nfluid;
+}
+
+void aa_unstream(const t_param params, t_speed* cells)
+{
+  /* after an odd number of timesteps: move S[i] back from x + c_i to x */
+  float* tmp = (float*) _mm_malloc(sizeof(float) * params.plane, 32);
+
+  if (tmp == NULL) die("cannot allocate memory for unstreaming", __LINE__, __FILE__);
+
+  for (int kk = 1; kk < NSPEEDS; kk++)
+  {
+    memcpy(tmp, cells->speeds[kk], sizeof(float) * params.plane);
+
+    #pragma omp parallel for schedule(static)
+    for (int jj = 0; jj < params.ny; jj++)
+    {
+      const int y = (jj + cy[kk] + params.ny) % params.ny;
+
+      for (int ii = 0; ii < params.nx; ii++)
+      {
+        const int x = (ii + cx[kk] + params.nx) % params.nx;
+
+        cells->speeds[kk][params.origin + ii + jj*params.stride] = tmp[params.origin + x + y*params.stride];
+      }
+    }
+  }
+
+  _mm_free(tmp);
+}
+
+/*
+** Sparse streaming.
+**
+** Obstacle cells only ever hand back to each neighbour what that
+** neighbour sent them, so an obstacle cell surrounded by obstacles
+** never influences the fluid and can be skipped altogether.  The
+** remaining cells are kept in two lists: fluid cells, which collide,
+** and the (usually much shorter) list of wall cells, which bounce
+** back.  Both lists store the neighbour each speed is pulled from,
+** so the hot loops need neither the obstacle map nor any wrap-around
+** arithmetic, and do work in proportion to the fluid volume.
+*/
+void build_cell_lists(const t_param params, uint8_t* obstacles, t_cell_list* fluid, t_cell_list* wall)
+{
+  const int ncells = params.nx * params.ny;
+  int* is_wall = (int*) _mm_malloc(sizeof(int) * ncells, 32);
+
+  if (is_wall == NULL) die("cannot allocate memory for cell lists", __LINE__, __FILE__);
+
+  fluid->count = 0;
+  wall->count = 0;
+
+  /* an obstacle cell is a wall if any of its neighbours is fluid */
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      is_wall[ii + jj*params.nx] = 0;
+
+      if (!obstacles[ii + jj*params.nx])
+      {
+        fluid->count++;
+        continue;
+      }
+
+      for (int kk = 1; kk < NSPEEDS; kk++)
+      {
+        const int x = (ii + cx[kk] + params.nx) % params.nx;
+        const int y = (jj + cy[kk] + params.ny) % params.ny;
+
+        if (!obstacles[x + y*params.nx]) is_wall[ii + jj*params.nx] = 1;
+      }
+
+      wall->count += is_wall[ii + jj*params.nx];
+    }
+  }
+
+  fluid->cell = (int*) _mm_malloc(sizeof(int) * (fluid->count + 1), 32);
+  wall->cell  = (int*) _mm_malloc(sizeof(int) * (wall->count + 1), 32);
+
+  if (fluid->cell == NULL || wall->cell == NULL) die("cannot allocate memory for cell lists", __LINE__, __FILE__);
+
+  fluid->src[0] = fluid->cell;
+  wall->src[0]  = wall->cell;
+
+  for (int kk = 1; kk < NSPEEDS; kk++)
+  {
+    fluid->src[kk] = (int*) _mm_malloc(sizeof(int) * (fluid->count + 1), 32);
+    wall->src[kk]  = (int*) _mm_malloc(sizeof(int) * (wall->count + 1), 32);
+
+    if (fluid->src[kk] == NULL || wall->src[kk] == NULL) die("cannot allocate memory for cell lists", __LINE__, __FILE__);
+  }
+
+  /* fill both lists in row major order, so that memory is still
+  ** walked (mostly) contiguously */
+  int nf = 0;
+  int nw = 0;
+
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      t_cell_list* list;
+      int          pos;
+
+      if (!obstacles[ii + jj*params.nx])
+      {
+        list = fluid;
+        pos = nf++;
+      }
+      else if (is_wall[ii + jj*params.nx])
+      {
+        list = wall;
+        pos = nw++;
+      }
+      else continue;
+
+      list->cell[pos] = params.origin + ii + jj*params.stride;
+
+      /* speed kk arrives from the cell at x - c_kk */
+      for (int kk = 1; kk < NSPEEDS; kk++)
+      {
+        const int x = (ii - cx[kk] + params.nx) % params.nx;
+        const int y = (jj - cy[kk] + params.ny) % params.ny;
+
+        list->src[kk][pos] = params.origin + x + y*params.stride;
+      }
+    }
+  }
+
+  _mm_free(is_wall);
+}
+
+void free_cell_list(t_cell_list* list)
+{
+  for (int kk = 0; kk < NSPEEDS; kk++)
+  {
+    _mm_free(list->src[kk]);
+    list->src[kk] = NULL;
+  }
+
+  list->cell = NULL;
+  list->count = 0;
+}
+
+float propagate_sparse(const t_param params, t_speed* cells, t_speed* tmp_cells,
+                       const t_cell_list* fluid, const t_cell_list* wall)
+{
+  float tot_u = 0;      /* accumulated magnitudes of velocity for each cell */
+
+  #pragma omp parallel
+  {
+    /* wall cells: mirror the pulled speeds */
+    #pragma omp for schedule(static) nowait
+    for (int nn = 0; nn < wall->count; nn++)
+    {
+      const int idx = wall->cell[nn];
+
+      tmp_cells->speeds[0][idx] = cells->speeds[0][idx];
+      tmp_cells->speeds[1][idx] = cells->speeds[3][wall->src[3][nn]];
+      tmp_cells->speeds[2][idx] = cells->speeds[4][wall->src[4][nn]];
+      tmp_cells->speeds[3][idx] = cells->speeds[1][wall->src[1][nn]];
+      tmp_cells->speeds[4][idx] = cells->speeds[2][wall->src[2][nn]];
+      tmp_cells->speeds[5][idx] = cells->speeds[7][wall->src[7][nn]];
+      tmp_cells->speeds[6][idx] = cells->speeds[8][wall->src[8][nn]];
+      tmp_cells->speeds[7][idx] = cells->speeds[5][wall->src[5][nn]];
+      tmp_cells->speeds[8][idx] = cells->speeds[6][wall->src[6][nn]];
+    }
+
+    /* fluid cells: pull and collide, no obstacles to test for */
+    #pragma omp for reduction(+:tot_u) schedule(static)
+    for (int nn = 0; nn < fluid->count; nn++)
+    {
+      const int idx = fluid->cell[nn];
+
+      float speeds[NSPEEDS] __attribute__((aligned(32)));
+      speeds[0] = cells->speeds[0][idx];
+      speeds[1] = cells->speeds[1][fluid->src[1][nn]];
+      speeds[2] = cells->speeds[2][fluid->src[2][nn]];
+      speeds[3] = cells->speeds[3][fluid->src[3][nn]];
+      speeds[4] = cells->speeds[4][fluid->src[4][nn]];
+      speeds[5] = cells->speeds[5][fluid->src[5][nn]];
+      speeds[6] = cells->speeds[6][fluid->src[6][nn]];
+      speeds[7] = cells->speeds[7][fluid->src[7][nn]];
+      speeds[8] = cells->speeds[8][fluid->src[8][nn]];
+
+      float relaxed[NSPEEDS] __attribute__((aligned(32)));
+      tot_u += relax_cell(params, speeds, relaxed);
+
+      tmp_cells->speeds[0][idx] = relaxed[0];
+      tmp_cells->speeds[1][idx] = relaxed[1];
+      tmp_cells->speeds[2][idx] = relaxed[2];
+      tmp_cells->speeds[3][idx] = relaxed[3];
+      tmp_cells->speeds[4][idx] = relaxed[4];
+      tmp_cells->speeds[5][idx] = relaxed[5];
+      tmp_cells->speeds[6][idx] = relaxed[6];
+      tmp_cells->speeds[7][idx] = relaxed[7];
+      tmp_cells->speeds[8][idx] = relaxed[8];
+    }
+  }
+
+  return tot_u / (float)params.nfluid;
+}
+
+/*
+** OpenMP target offload.
+**
+** The device keeps both lattices for the whole run, packed into one
+** buffer of 2 * NSPEEDS planes of nx*ny cells, plane kk of lattice ll
+** at (ll * NSPEEDS + kk) * nx*ny, and the obstacle map beside them.
+** They are mapped to it once before the first timestep.  Each
+** timestep is two kernels, accelerate_flow()'s row and the fused
+** propagate/collide sweep, and only the sweep's sum of velocities
+** comes back; the final state is copied back once after the last.
+** The sweep pulls and collides as collide_row_scalar() does, so the
+** results agree with --simd=off to rounding.  Without a device, or in
+** a build without offloading, the kernels run on the host.
+*/
+int offload(const t_param params, t_speed* cells, const uint8_t* obstacles, float* av_vels)
+{
+  const int    nx = params.nx;
+  const int    ny = params.ny;
+  const int    ncells = nx * ny;
+  const size_t size = (size_t)2 * NSPEEDS * ncells;  /* floats in both lattices */
+  float*       lattice = (float*) _mm_malloc(sizeof(float) * size, 64);
+  const float  w1 = params.density * params.accel / 9.f;   /* accelerate_flow() weighting factors */
+  const float  w2 = params.density * params.accel / 36.f;
+  int          steps = params.maxIters;  /* timesteps to run, less if the flow converges */
+
+  if (lattice == NULL) die("cannot allocate memory for the offloaded lattice", __LINE__, __FILE__);
+
+  /* the initial state, as the device lays it out */
+  #pragma omp parallel for schedule(static)
+  for (int jj = 0; jj < ny; jj++)
+  {
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      memcpy(lattice + (size_t)kk * ncells + jj*nx, cells->speeds[kk] + cell_index(params, 0, jj), sizeof(float) * nx);
+    }
+  }
+
+  if (params.profile)
+  {
+    int on_host = 1;
+
+    #pragma omp target map(from: on_host)
+    on_host = omp_is_initial_device();
+
+    prof.device = on_host ? -1 : omp_get_default_device();
+  }
+
+  #pragma omp target data map(to: lattice[0:size], obstacles[0:ncells])
+  {
+    for (int tt = 0; tt < steps; tt++)
+    {
+      const size_t src = (size_t)(tt % 2) * NSPEEDS * ncells;        /* this timestep's lattice */
+      const size_t dst = (size_t)((tt + 1) % 2) * NSPEEDS * ncells;  /* and the next one's */
+      float        tot_u = 0.f;
+
+      /* accelerate the flow along the second row from the top */
+      #pragma omp target teams distribute parallel for
+      for (int ii = 0; ii < nx; ii++)
+      {
+        float* f = lattice + src + ii + (ny - 2) * nx;
+
+        if (!obstacles[ii + (ny - 2) * nx]
+            && (f[3 * ncells] - w1) > 0.f
+            && (f[6 * ncells] - w2) > 0.f
+            && (f[7 * ncells] - w2) > 0.f)
+        {
+          f[1 * ncells] += w1;
+          f[5 * ncells] += w2;
+          f[8 * ncells] += w2;
+          f[3 * ncells] -= w1;
+          f[6 * ncells] -= w2;
+          f[7 * ncells] -= w2;
+        }
+      }
+
+      #pragma omp target teams distribute parallel for collapse(2) reduction(+:tot_u) firstprivate(params) map(tofrom: tot_u)
+      for (int jj = 0; jj < ny; jj++)
+      {
+        for (int ii = 0; ii < nx; ii++)
+        {
+          const float* from = lattice + src;
+          float*       to = lattice + dst;
+          const int    y_n = (jj + 1) % ny;
+          const int    x_e = (ii + 1) % nx;
+          const int    y_s = (jj == 0) ? (jj + ny - 1) : (jj - 1);
+          const int    x_w = (ii == 0) ? (ii + nx - 1) : (ii - 1);
+          const int    idx = ii + jj*nx;
+          const int    obst = obstacles[idx];
+          float        speeds[NSPEEDS];
+          float        relaxed[NSPEEDS];
+
+          /* propagate densities from neighbouring cells */
+          speeds[0] = from[0 * ncells + ii  + jj*nx];   /* central cell, no movement */
+          speeds[1] = from[1 * ncells + x_w + jj*nx];   /* east */
+          speeds[2] = from[2 * ncells + ii  + y_s*nx];  /* north */
+          speeds[3] = from[3 * ncells + x_e + jj*nx];   /* west */
+          speeds[4] = from[4 * ncells + ii  + y_n*nx];  /* south */
+          speeds[5] = from[5 * ncells + x_w + y_s*nx];  /* north-east */
+          speeds[6] = from[6 * ncells + x_e + y_s*nx];  /* north-west */
+          speeds[7] = from[7 * ncells + x_e + y_n*nx];  /* south-west */
+          speeds[8] = from[8 * ncells + x_w + y_n*nx];  /* south-east */
+
+          const float u = relax_cell(params, speeds, relaxed);
+
+          /* relaxation step, or mirroring if the cell contains an obstacle */
+          to[0 * ncells + idx] = obst ? speeds[0] : relaxed[0];
+          to[1 * ncells + idx] = obst ? speeds[3] : relaxed[1];
+          to[2 * ncells + idx] = obst ? speeds[4] : relaxed[2];
+          to[3 * ncells + idx] = obst ? speeds[1] : relaxed[3];
+          to[4 * ncells + idx] = obst ? speeds[2] : relaxed[4];
+          to[5 * ncells + idx] = obst ? speeds[7] : relaxed[5];
+          to[6 * ncells + idx] = obst ? speeds[8] : relaxed[6];
+          to[7 * ncells + idx] = obst ? speeds[5] : relaxed[7];
+          to[8 * ncells + idx] = obst ? speeds[6] : relaxed[8];
+
+          tot_u += obst ? 0.f : u;
+        }
+      }
+
+      record_av_vel(params, av_vels, tt, tot_u / (float)params.nfluid);
+
+      if (converge_due(params, tt)) steps = converge_check(params, tt, tot_u / (float)params.nfluid);
+#ifdef DEBUG
+      /* the lattice is on the device, so there is no density to print */
+      printf("==timestep: %d==\n", tt);
+      printf("av velocity: %.12E\n", tot_u / (float)params.nfluid);
+#endif
+    }
+
+    /* the final state only */
+    const size_t last = (size_t)(steps % 2) * NSPEEDS * ncells;
+
+    #pragma omp target update from(lattice[last:NSPEEDS * ncells])
+
+    #pragma omp parallel for schedule(static)
+    for (int jj = 0; jj < ny; jj++)
+    {
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        memcpy(cells->speeds[kk] + cell_index(params, 0, jj), lattice + last + (size_t)kk * ncells + jj*nx, sizeof(float) * nx);
+      }
+    }
+  }
+
+  _mm_free(lattice);
+
+  return steps;
+}
+
+/*
+** Packed storage.
+**
+** Between timesteps every distribution is held in 16 bits, which
+** halves the memory traffic of the bandwidth-bound sweep.  Each row
+** is unpacked into float rows private to the thread, with streaming
+** folded into the unpacking (speed i of cell x comes from x - c_i),
+** collided there with collide_row(), and packed again into the new
+** lattice.  All arithmetic stays in single precision.
+**
+** STORAGE_DELTA16 keeps f_i / (w_i * density) - 1 instead of f_i:
+** distributions stay close to their rest state, so the deviation
+** is small and gets the full 11-bit half precision mantissa.
+*/
+static float rest_state(const t_param params, const int kk)
+{
+  return params.density * ((kk == 0) ? 4.f / 9.f : (kk < 5) ? 1.f / 9.f : 1.f / 36.f);
+}
+
+static inline float half_to_float(const uint16_t h)
+{
+  const uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+  const uint32_t expo = (h >> 10) & 0x1f;
+  const uint32_t mant = h & 0x3ff;
+  uint32_t       bits;
+  float          f;
+
+  /* zero or subnormal, mant * 2^-24 */
+  if (expo == 0)
+  {
+    f = (float)mant * 5.9604644775390625e-8f;
+    return sign ? -f : f;
+  }
+
+  if (expo == 31) bits = sign | 0x7f800000 | (mant << 13);  /* inf or nan */
+  else bits = sign | ((expo + 112) << 23) | (mant << 13);
+
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+static inline uint16_t float_to_half(const float f)
+{
+  uint32_t bits;
+
+  memcpy(&bits, &f, sizeof(bits));
+
+  const uint32_t sign = (bits >> 16) & 0x8000;
+  const uint32_t absf = bits & 0x7fffffff;
+
+  if (absf > 0x7f800000) return (uint16_t)(sign | 0x7e00);   /* nan */
+
+  if (absf >= 0x477ff000) return (uint16_t)(sign | 0x7c00);  /* rounds past 65504 */
+
+  /* below 2^-14 the half is subnormal, a multiple of 2^-24 */
+  if (absf < 0x38800000)
+  {
+    float a;
+
+    memcpy(&a, &absf, sizeof(a));
+    return (uint16_t)(sign | (uint32_t)nearbyintf(a * 16777216.f));
+  }
+
+  /* rebias the exponent and round off 13 mantissa bits, to nearest even */
+  return (uint16_t)(sign | ((absf + 0xfff + ((absf >> 13) & 1) - 0x38000000) >> 13));
+}
+
+static inline float bf16_to_float(const uint16_t b)
+{
+  const uint32_t bits = (uint32_t)b << 16;
+  float          f;
+
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+static inline uint16_t float_to_bf16(const float f)
+{
+  uint32_t bits;
+
+  memcpy(&bits, &f, sizeof(bits));
+
+  if ((bits & 0x7fffffff) > 0x7f800000) return (uint16_t)((bits >> 16) | 0x40);  /* nan */
+
+  return (uint16_t)((bits + 0x7fff + ((bits >> 16) & 1)) >> 16);
+}
+
+#ifdef HAVE_X86_SIMD
+/* every CPU with AVX2 also has the F16C conversions */
+__attribute__((target("avx,f16c")))
+static void half_to_float_f16c(const uint16_t* in, float* out, const int n)
+{
+  int ii;
+
+  for (ii = 0; ii + 8 <= n; ii += 8)
+  {
+    _mm256_storeu_ps(out + ii, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(in + ii))));
+  }
+
+  for (; ii < n; ii++) out[ii] = half_to_float(in[ii]);
+}
+
+__attribute__((target("avx,f16c")))
+static void float_to_half_f16c(const float* in, uint16_t* out, const int n)
+{
+  int ii;
+
+  for (ii = 0; ii + 8 <= n; ii += 8)
+  {
+    _mm_storeu_si128((__m128i*)(out + ii), _mm256_cvtps_ph(_mm256_loadu_ps(in + ii), _MM_FROUND_TO_NEAREST_INT));
+  }
+
+  for (; ii < n; ii++) out[ii] = float_to_half(in[ii]);
+}
+#endif
+
+void half_to_float_run(const t_param params, const uint16_t* in, float* out, const int n)
+{
+#ifdef HAVE_X86_SIMD
+  if (params.simd >= SIMD_AVX2)
+  {
+    half_to_float_f16c(in, out, n);
+    return;
+  }
+#endif
+
+  for (int ii = 0; ii < n; ii++) out[ii] = half_to_float(in[ii]);
+}
+
+void float_to_half_run(const t_param params, const float* in, uint16_t* out, const int n)
+{
+#ifdef HAVE_X86_SIMD
+  if (params.simd >= SIMD_AVX2)
+  {
+    float_to_half_f16c(in, out, n);
+    return;
+  }
+#endif
+
+  for (int ii = 0; ii < n; ii++) out[ii] = float_to_half(in[ii]);
+}
+
+void unpack_run(const t_param params, const int kk, const uint16_t* in, float* out, const int n)
+{
+  const float rest = rest_state(params, kk);
+
+  if (params.storage == STORAGE_BF16)
+  {
+    for (int ii = 0; ii < n; ii++) out[ii] = bf16_to_float(in[ii]);
+
+    return;
+  }
+
+  half_to_float_run(params, in, out, n);
+
+  if (params.storage == STORAGE_DELTA16)
+  {
+    for (int ii = 0; ii < n; ii++) out[ii] = rest + rest * out[ii];
+  }
+}
+
+void pack_run(const t_param params, const int kk, const float* in, uint16_t* out, const int n)
+{
+  const float r_rest = 1.f / rest_state(params, kk);
+  float       delta[64];  /* a block of deviations on their way to half precision */
+
+  if (params.storage == STORAGE_BF16)
+  {
+    for (int ii = 0; ii < n; ii++) out[ii] = float_to_bf16(in[ii]);
+
+    return;
+  }
+
+  if (params.storage == STORAGE_FP16)
+  {
+    float_to_half_run(params, in, out, n);
+    return;
+  }
+
+  for (int i0 = 0; i0 < n; i0 += 64)
+  {
+    const int m = (n - i0 < 64) ? n - i0 : 64;
+
+    for (int ii = 0; ii < m; ii++) delta[ii] = in[i0 + ii] * r_rest - 1.f;
+
+    float_to_half_run(params, delta, out + i0, m);
+  }
+}
+
+void pack_lattice(const t_param params, const t_speed* cells, t_speed16* packed, t_speed16* tmp_packed)
+{
+  /* first touch of both packed lattices, by the rows' own threads */
+  #pragma omp parallel for schedule(static)
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      pack_run(params, kk, cells->speeds[kk] + params.origin + jj*params.stride, packed->speeds[kk] + jj*params.nx, params.nx);
+      memset(tmp_packed->speeds[kk] + jj*params.nx, 0, sizeof(uint16_t) * params.nx);
+    }
+  }
+}
+
+void unpack_lattice(const t_param params, const t_speed16* packed, t_speed* cells)
+{
+  #pragma omp parallel for schedule(static)
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      unpack_run(params, kk, packed->speeds[kk] + jj*params.nx, cells->speeds[kk] + params.origin + jj*params.stride, params.nx);
+    }
+  }
+}
+
+float propagate_packed(const t_param params, const t_speed16* cells, t_speed16* tmp_cells, uint8_t* obstacles,
+                       float* scratch, const int force)
+{
+  const int ld = (params.nx + 7) / 8 * 8;  /* floats per unpacked row */
+  float tot_u = 0;      /* accumulated magnitudes of velocity for each cell */
+
+  #pragma omp parallel reduction(+:tot_u)
+  {
+    float*  rows = scratch + omp_get_thread_num() * 2 * NSPEEDS * ld;
+    t_speed src, dst;   /* this thread's unpacked rows, before and after collision */
+
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      src.speeds[kk] = rows + kk*ld;
+      dst.speeds[kk] = rows + (NSPEEDS + kk)*ld;
+    }
+
+    #pragma omp for schedule(static)
+    for (int jj = 0; jj < params.ny; jj++)
+    {
+      /* unpack the speeds streaming into row jj: speed kk of cell ii
+      ** comes from cell ii - cx[kk] of row jj - cy[kk], wrapping round */
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        const uint16_t* in = cells->speeds[kk] + ((jj - cy[kk] + params.ny) % params.ny) * params.nx;
+        float*          out = src.speeds[kk];
+
+        if (cx[kk] == 0)
+        {
+          unpack_run(params, kk, in, out, params.nx);
+        }
+        else if (cx[kk] > 0)
+        {
+          unpack_run(params, kk, in + params.nx - 1, out, 1);
+          unpack_run(params, kk, in, out + 1, params.nx - 1);
+        }
+        else
+        {
+          unpack_run(params, kk, in + 1, out, params.nx - 1);
+          unpack_run(params, kk, in, out + params.nx - 1, 1);
+        }
+      }
+
+      tot_u += collide_row(params, &src, &dst, obstacles + jj*params.nx, params.nx);
+
+      /* accelerate the new row for the next timestep while it is in cache */
+      if (force && jj == params.ny - 2) accelerate_row(params, &dst, obstacles + jj*params.nx, params.nx);
+
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        pack_run(params, kk, dst.speeds[kk], tmp_cells->speeds[kk] + jj*params.nx, params.nx);
+      }
+    }
+  }
+
+  return tot_u / (float)params.nfluid;
+}
+
+void read_params(const char* paramfile, t_param* params)
+{
+  char   message[1024];  /* message buffer */
+  FILE*   fp;            /* file pointer */
+  int    retval;         /* to hold return value for checking */
+
+  /* open the parameter file */
+  fp = fopen(paramfile, "r");
+
+  if (fp == NULL)
+  {
+    sprintf(message, "could not open input parameter file: %s", paramfile);
+    die(message, __LINE__, __FILE__);
+  }
+
+  /* read in the parameter values */
+  retval = fscanf(fp, "%d\n", &(params->nx));
+
+  if (retval != 1) die("could not read param file: nx", __LINE__, __FILE__);
+
+  retval = fscanf(fp, "%d\n", &(params->ny));
+
+  if (retval != 1) die("could not read param file: ny", __LINE__, __FILE__);
+
+  retval = fscanf(fp, "%d\n", &(params->maxIters));
+
+  if (retval != 1) die("could not read param file: maxIters", __LINE__, __FILE__);
+
+  retval = fscanf(fp, "%d\n", &(params->reynolds_dim));
+
+  if (retval != 1) die("could not read param file: reynolds_dim", __LINE__, __FILE__);
+
+  retval = fscanf(fp, "%f\n", &(params->density));
+
+  if (retval != 1) die("could not read param file: density", __LINE__, __FILE__);
+
+  retval = fscanf(fp, "%f\n", &(params->accel));
+
+  if (retval != 1) die("could not read param file: accel", __LINE__, __FILE__);
+
+  retval = fscanf(fp, "%f\n", &(params->omega));
+
+  if (retval != 1) die("could not read param file: omega", __LINE__, __FILE__);
+
+  /* and close up the file */
+  fclose(fp);
+}
+
+int initialise(const char* paramfile, const char* obstaclefile,
+               t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
+               uint8_t** obstacles_ptr, float** av_vels_ptr)
+{
+  read_params(paramfile, params);
+
+  /* split the rows between the ranks, the first ny % nranks taking one extra */
+  params->global_ny = params->ny;
+  params->ny   = params->global_ny / params->nranks + (params->rank < params->global_ny % params->nranks);
+  params->row0 = params->rank * (params->global_ny / params->nranks)
+               + ((params->rank < params->global_ny % params->nranks) ? params->rank : params->global_ny % params->nranks);
+
+  if (params->ny < 1) die("more MPI ranks than rows in the grid", __LINE__, __FILE__);
+
+  /* work out where each cell lives within a speed plane */
+  if (params->layout == LAYOUT_HALO)
+  {
+    /* a ghost row above and below the grid, a ghost column either
+    ** side of it, and every row padded so its first cell is aligned */
+    params->stride = HALO_STRIDE(params->nx);
+    params->origin = params->stride + HALO_PAD;
+    params->plane  = params->stride * (params->ny + 2);
+  }
+  else
+  {
+    /* the AoSoA layout numbers its cells the same way, see cell_index() */
+    if (params->layout == LAYOUT_AOSOA && params->nx % AOSOA_LANES != 0)
+    {
+      die("the AoSoA layout needs nx to be a multiple of 16", __LINE__, __FILE__);
+    }
+
+    params->stride = params->nx;
+    params->origin = 0;
+    params->plane  = params->nx * params->ny;
+  }
+
+  /*
+  ** Allocate memory.
+  **
+  ** Remember C is pass-by-value, so we need to
+  ** pass pointers into the initialise function.
+  **
+  ** NB we are allocating a 1D array, so that the
+  ** memory will be contiguous.  We still want to
+  ** index this memory as if it were a (row major
+  ** ordered) 2D array, however.  We will perform
+  ** some arithmetic using the row and column
+  ** coordinates, inside the square brackets, when
+  ** we want to access elements of this array.
+  **
+  ** Note also that we are using a structure to
+  ** hold an array of 'speeds'.  We will allocate
+  ** a 1D array of these structs.
+  */
+
+  /* main grid */
+  *cells_ptr = (t_speed*)_mm_malloc(sizeof(t_speed), 32);
+
+  if (*cells_ptr == NULL) die("cannot allocate memory for cells", __LINE__, __FILE__);
+
+  /* 'helper' grid, used as scratch space */
+  *tmp_cells_ptr = (t_speed*)_mm_malloc(sizeof(t_speed), 32);
+
+  if (*tmp_cells_ptr == NULL) die("cannot allocate memory for tmp_cells", __LINE__, __FILE__);
+
+  /* the map of obstacles */
+  *obstacles_ptr = _mm_malloc(sizeof(uint8_t) * (params->ny * params->nx), 32);
+
+  if (*obstacles_ptr == NULL) die("cannot allocate column memory for obstacles", __LINE__, __FILE__);
+
+  /* first set all cells in obstacle array to zero, each row
+  ** first touched by the thread that will be working on it */
+  #pragma omp parallel for schedule(static)
+  for (int jj = 0; jj < params->ny; jj++)
+  {
+    for (int ii = 0; ii < params->nx; ii++)
+    {
+      (*obstacles_ptr)[ii + jj*params->nx] = 0;
+    }
+  }
+
+  load_obstacles(*params, obstaclefile, *obstacles_ptr);
+
+  if (params->obstacle_save != NULL) save_obstacles(*params, params->obstacle_save, *obstacles_ptr);
+
+  /* the obstacles never move, so count the fluid cells once here
+  ** rather than in every timestep's reduction */
+  int nfluid = 0;
+
+  #pragma omp parallel for schedule(static) reduction(+:nfluid)
+  for (int jj = 0; jj < params->ny; jj++)
+  {
+    for (int ii = 0; ii < params->nx; ii++)
+    {
+      nfluid += !(*obstacles_ptr)[ii + jj*params->nx];
+    }
+  }
+
+  params->nfluid = ranks_sum_int(nfluid);
+
+  /*
+  ** allocate space to hold a record of the avarage velocities computed
+  ** at each timestep
+  */
+  *av_vels_ptr = (float*)_mm_malloc(sizeof(float) * (params->diag_stream ? 1 : params->maxIters), 32);
+
+  return EXIT_SUCCESS;
+}
+
+void load_obstacles(const t_param params, const char* obstaclefile, uint8_t* obstacles)
+{
+  char        message[1024];  /* message buffer */
+  struct stat st;
+  const char* text;
+  const int   rowbytes = (params.nx + 7) / 8;  /* bytes per row of a bitmap */
+  int         fd;
+
+  /* map the whole file rather than reading it through stdio */
+  fd = open(obstaclefile, O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &st) != 0)
+  {
+    sprintf(message, "could not open input obstacles file: %s", obstaclefile);
+    die(message, __LINE__, __FILE__);
+  }
+
+  /* no blocked cells at all */
+  if (st.st_size == 0)
+  {
+    close(fd);
+    return;
+  }
+
+  text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  if (text == MAP_FAILED) die("could not map obstacle file", __LINE__, __FILE__);
+
+  close(fd);
+
+  if ((size_t)st.st_size >= 16 && !memcmp(text, OBSTACLE_MAGIC, 8))
+  {
+    int32_t dims[2];
+
+    memcpy(dims, text + 8, sizeof(dims));
+
+    if (dims[0] != params.nx || dims[1] != params.global_ny)
+    {
+      die("obstacle bitmap does not match the grid size", __LINE__, __FILE__);
+    }
+
+    if ((size_t)st.st_size != 16 + (size_t)rowbytes * params.global_ny) die("obstacle bitmap is truncated", __LINE__, __FILE__);
+
+    /* only this rank's rows of the mapping are ever read */
+    const uint8_t* bits = (const uint8_t*)text + 16 + (size_t)rowbytes * params.row0;
+
+    #pragma omp parallel for schedule(static)
+    for (int jj = 0; jj < params.ny; jj++)
+    {
+      for (int ii = 0; ii < params.nx; ii++)
+      {
+        obstacles[ii + jj*params.nx] = (bits[jj*rowbytes + ii / 8] >> (ii % 8)) & 1;
+      }
+    }
+  }
+  else
+  {
+    parse_obstacles(params, text, st.st_size, obstacles);
+  }
+
+  munmap((void*)text, st.st_size);
+}
+
+/* read a decimal integer after any blanks, or return NULL if there is none */
+static const char* parse_int(const char* p, const char* end, int* value)
+{
+  int sign = 1;
+  int v = 0;
+
+  while (p < end && (*p == ' ' || *p == '\t')) p++;
+
+  if (p < end && (*p == '-' || *p == '+')) sign = (*p++ == '-') ? -1 : 1;
+
+  if (p == end || *p < '0' || *p > '9') return NULL;
+
+  /* saturate rather than overflow; anything this big is out of range anyway */
+  for (; p < end && *p >= '0' && *p <= '9'; p++)
+  {
+    if (v < 100000000) v = v * 10 + (*p - '0');
+  }
+
+  *value = sign * v;
+  return p;
+}
+
+void parse_obstacles(const t_param params, const char* text, const size_t len, uint8_t* obstacles)
+{
+  /* the text is cut into one piece per thread, at line ends, and the
+  ** pieces parsed side by side; every line only ever sets a cell */
+  #pragma omp parallel
+  {
+    const int nthreads = omp_get_num_threads();
+    const int t = omp_get_thread_num();
+    size_t    begin = len / nthreads * t;
+    size_t    end = (t == nthreads - 1) ? len : len / nthreads * (t + 1);
+
+    while (begin > 0 && begin < len && text[begin - 1] != '\n') begin++;
+
+    while (end > 0 && end < len && text[end - 1] != '\n') end++;
+
+    const char* p = text + begin;
+    const char* stop = text + end;
+
+    for (;;)
+    {
+      int xx, yy, blocked;
+
+      /* skip blank lines */
+      while (p < stop && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+
+      if (p == stop) break;
+
+      /* some checks */
+      if ((p = parse_int(p, stop, &xx)) == NULL || (p = parse_int(p, stop, &yy)) == NULL
+          || (p = parse_int(p, stop, &blocked)) == NULL)
+      {
+        die("expected 3 values per line in obstacle file", __LINE__, __FILE__);
+      }
+
+      while (p < stop && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+
+      if (p < stop && *p != '\n') die("expected 3 values per line in obstacle file", __LINE__, __FILE__);
+
+      if (xx < 0 || xx > params.nx - 1) die("obstacle x-coord out of range", __LINE__, __FILE__);
+
+      if (yy < 0 || yy > params.global_ny - 1) die("obstacle y-coord out of range", __LINE__, __FILE__);
+
+      if (blocked != 1) die("obstacle blocked value should be 1", __LINE__, __FILE__);
+
+      /* assign to array, if the cell is in this rank's slab */
+      yy -= params.row0;
+
+      if (yy >= 0 && yy < params.ny) obstacles[xx + yy*params.nx] = blocked;
+    }
+  }
+}
+
+void save_obstacles(const t_param params, const char* file, const uint8_t* obstacles)
+{
+  const int rowbytes = (params.nx + 7) / 8;  /* bytes per row of the bitmap */
+  uint8_t*  bits = (uint8_t*) calloc((size_t)rowbytes * params.ny, 1);
+  FILE*     fp;
+
+  if (bits == NULL) die("cannot allocate memory for the obstacle bitmap", __LINE__, __FILE__);
+
+  #pragma omp parallel for schedule(static)
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      bits[jj*rowbytes + ii / 8] |= (uint8_t)(obstacles[ii + jj*params.nx] << (ii % 8));
+    }
+  }
+
+  /* the ranks append their slabs in turn, bottom row first */
+  for (int rank = 0; rank < params.rank; rank++) ranks_barrier();
+
+  fp = fopen(file, (params.rank == 0) ? "w" : "a");
+
+  if (fp == NULL) die("could not open obstacle bitmap file", __LINE__, __FILE__);
+
+  if (params.rank == 0)
+  {
+    const int32_t dims[2] = { params.nx, params.global_ny };
+
+    fwrite(OBSTACLE_MAGIC, 1, 8, fp);
+    fwrite(dims, sizeof(int32_t), 2, fp);
+  }
+
+  if (fwrite(bits, rowbytes, params.ny, fp) != (size_t)params.ny) die("could not write obstacle bitmap file", __LINE__, __FILE__);
+
+  fclose(fp);
+
+  for (int rank = params.rank; rank < params.nranks; rank++) ranks_barrier();
+
+  free(bits);
+}
+
+void initialise_speeds(const t_param params, t_speed* cells, t_speed* tmp_cells)
+{
+  float w0 = params.density * 4.f / 9.f;
+  float w1 = params.density       / 9.f;
+  float w2 = params.density       / 36.f;
+
+  /* pages are placed on the NUMA node of the thread that first writes
+  ** them, so both lattices are first touched here with the same
+  ** partition of rows as the timestep loops use, see team_rows() */
+  #pragma omp parallel
+  {
+    int lo, hi;  /* this thread's rows */
+
+    team_rows(params, 0, params.ny, &lo, &hi);
+
+    for (int jj = lo; jj < hi; jj++)
+    {
+      IVDEP_VECTOR_ALIGNED
+      for (int ii = 0; ii < params.nx; ii++)
+      {
+        const int idx = cell_index(params, ii, jj);
+        /* centre */
+        cells->speeds[0][idx] = w0;
+        /* axis directions */
+        cells->speeds[1][idx] = w1;
+        cells->speeds[2][idx] = w1;
+        cells->speeds[3][idx] = w1;
+        cells->speeds[4][idx] = w1;
+        /* diagonals */
+        cells->speeds[5][idx] = w2;
+        cells->speeds[6][idx] = w2;
+        cells->speeds[7][idx] = w2;
+        cells->speeds[8][idx] = w2;
+      }
+
+      /* the speeds of a row of blocks are all next to each other */
+      if (tmp_cells->speeds[0] != NULL && params.layout == LAYOUT_AOSOA)
+      {
+        memset(tmp_cells->speeds[0] + cell_index(params, 0, jj), 0, sizeof(float) * NSPEEDS * params.nx);
+      }
+      else if (tmp_cells->speeds[0] != NULL)
+      {
+        for (int kk = 0; kk < NSPEEDS; kk++)
+        {
+          memset(tmp_cells->speeds[kk] + params.origin + jj*params.stride, 0, sizeof(float) * params.nx);
+        }
+      }
+    }
+  }
+}
+
+void warm_start(const t_param params, t_speed* cells, const uint8_t* obstacles)
+{
+  const int n = params.warm_factor;
+  t_param   coarse = params;
+  t_speed   coarse_cells, coarse_tmp;
+
+  if (params.nx % n != 0 || params.ny % n != 0) die("the grid is not a whole number of coarse cells", __LINE__, __FILE__);
+
+  /* the coarse grid keeps the viscosity in lattice units, so each of
+  ** its timesteps stands for n*n of the fine grid's and its velocities
+  ** are n times larger; the accelerated row lies against a wall, whose
+  ** shear over one cell balances its push, so n times the acceleration
+  ** drives those n times larger velocities */
+  coarse.nx = params.nx / n;
+  coarse.ny = coarse.global_ny = params.ny / n;
+  coarse.row0 = 0;
+  coarse.reynolds_dim = params.reynolds_dim / n;
+  coarse.accel = params.accel * n;
+  coarse.maxIters = (params.warm_iters > 0) ? params.warm_iters : params.maxIters;
+  coarse.layout = LAYOUT_PLAIN;
+  coarse.stride = coarse.nx;
+  coarse.origin = 0;
+  coarse.plane = coarse.nx * coarse.ny;
+  coarse.engine = ENGINE_FUSED;
+  coarse.storage = STORAGE_FP32;
+  coarse.tile_w = coarse.tile_h = TILE_OFF;
+  coarse.schedule = SCHED_STATIC;
+  coarse.profile = 0;
+  coarse.fixed_grid = select_fixed(coarse);
+
+  const int ncoarse = coarse.nx * coarse.ny;
+  uint8_t*  coarse_obstacles = _mm_malloc(sizeof(uint8_t) * ncoarse, 32);
+  float*    av_vels = (float*) _mm_malloc(sizeof(float) * coarse.maxIters, 32);
+  float*    macro = (float*) malloc(sizeof(float) * 3 * ncoarse);  /* density, u_x and u_y of each coarse cell */
+
+  if (coarse_obstacles == NULL || av_vels == NULL || macro == NULL)
+  {
+    die("cannot allocate memory for the warm start", __LINE__, __FILE__);
+  }
+
+  /* a coarse cell is blocked if any of its fine cells is, so that
+  ** walls a cell thick stay closed */
+  coarse.nfluid = 0;
+
+  for (int jj = 0; jj < coarse.ny; jj++)
+  {
+    for (int ii = 0; ii < coarse.nx; ii++)
+    {
+      uint8_t blocked = 0;
+
+      for (int y = jj * n; y < (jj + 1) * n; y++)
+      {
+        for (int x = ii * n; x < (ii + 1) * n; x++) blocked |= obstacles[x + y*params.nx];
+      }
+
+      coarse_obstacles[ii + jj*coarse.nx] = blocked;
+      coarse.nfluid += !blocked;
+    }
+  }
+
+  if (coarse.nfluid == 0) die("the coarse grid of the warm start has no fluid cells", __LINE__, __FILE__);
+
+  for (int kk = 0; kk < NSPEEDS; kk++)
+  {
+    coarse_cells.speeds[kk] = alloc_plane(coarse);
+    coarse_tmp.speeds[kk] = alloc_plane(coarse);
+
+    if (coarse_cells.speeds[kk] == NULL || coarse_tmp.speeds[kk] == NULL)
+    {
+      die("cannot allocate memory for speed planes", __LINE__, __FILE__);
+    }
+  }
+
+  const double t0 = omp_get_wtime();
+  const float  final_av_vel = ensemble_run(coarse, &coarse_cells, &coarse_tmp, coarse_obstacles, av_vels);
+
+  for (int cc = 0; cc < ncoarse; cc++)
+  {
+    const float* f[NSPEEDS];
+    float        density = 0.f;
+
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      f[kk] = coarse_cells.speeds[kk] + cc;
+      density += *f[kk];
+    }
+
+    macro[3*cc]     = density;
+    macro[3*cc + 1] = (*f[1] + *f[5] + *f[8] - (*f[3] + *f[6] + *f[7])) / density;
+    macro[3*cc + 2] = (*f[2] + *f[5] + *f[6] - (*f[4] + *f[7] + *f[8])) / density;
+  }
+
+  /* the fluid cells take the equilibrium of the coarse flow, bilinearly
+  ** interpolated between the centres of the coarse cells; blocked ones
+  ** add no density and a velocity of zero, so the flow slows towards
+  ** the walls, and the obstacles stay at rest */
+  #pragma omp parallel for schedule(static)
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    const float y  = (jj + 0.5f) / n - 0.5f;
+    const int   y0 = (int)floorf(y);
+    const float fy = y - y0;
+    const int   ys[2] = { (y0 + coarse.ny) % coarse.ny, (y0 + 1) % coarse.ny };
+
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      if (obstacles[ii + jj*params.nx]) continue;
+
+      const float x  = (ii + 0.5f) / n - 0.5f;
+      const int   x0 = (int)floorf(x);
+      const float fx = x - x0;
+      const int   xs[2] = { (x0 + coarse.nx) % coarse.nx, (x0 + 1) % coarse.nx };
+      float       density = 0.f, weights = 0.f, u_x = 0.f, u_y = 0.f;
+
+      for (int cy = 0; cy < 2; cy++)
+      {
+        for (int cx = 0; cx < 2; cx++)
+        {
+          const int   cc = xs[cx] + ys[cy] * coarse.nx;
+          const float w  = (cx ? fx : 1.f - fx) * (cy ? fy : 1.f - fy);
+
+          if (coarse_obstacles[cc]) continue;
+
+          density += w * macro[3*cc];
+          weights += w;
+          u_x += w * macro[3*cc + 1];
+          u_y += w * macro[3*cc + 2];
+        }
+      }
+
+      density = (weights > 0.f) ? density / weights : params.density;
+      u_x /= n;
+      u_y /= n;
+
+      /* the equilibrium of relax_cell() */
+      const float u_sq = u_x * u_x + u_y * u_y;
+      const float ws[NSPEEDS] = { 4.f / 9.f, 1.f / 9.f, 1.f / 9.f, 1.f / 9.f, 1.f / 9.f,
+                                  1.f / 36.f, 1.f / 36.f, 1.f / 36.f, 1.f / 36.f };
+      const float us[NSPEEDS] = { 0.f, u_x, u_y, -u_x, -u_y, u_x + u_y, -u_x + u_y, -u_x - u_y, u_x - u_y };
+
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        cells->speeds[kk][cell_index(params, ii, jj)]
+          = ws[kk] * density * (1.f + 3.f * us[kk] + 4.5f * us[kk] * us[kk] - 1.5f * u_sq);
+      }
+    }
+  }
+
+  printf("warm start:\t\t\t%dx%d grid, %d timesteps: Reynolds number %.12E, %.6lf (s)\n",
+         coarse.nx, coarse.ny, coarse.maxIters, calc_reynolds(coarse, final_av_vel), omp_get_wtime() - t0);
+
+  for (int kk = 0; kk < NSPEEDS; kk++)
+  {
+    free_plane(coarse, coarse_cells.speeds[kk]);
+    free_plane(coarse, coarse_tmp.speeds[kk]);
+  }
+
+  _mm_free(coarse_obstacles);
+  _mm_free(av_vels);
+  free(macro);
+}
+
+int finalise(const t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
+             uint8_t** obstacles_ptr, float** av_vels_ptr)
+{
+  /*
+  ** free up allocated memory
+  */
+  _mm_free(*cells_ptr);
+  *cells_ptr = NULL;
+
+  _mm_free(*tmp_cells_ptr);
+  *tmp_cells_ptr = NULL;
+
+  _mm_free(*obstacles_ptr);
+  *obstacles_ptr = NULL;
+
+  _mm_free(*av_vels_ptr);
+  *av_vels_ptr = NULL;
+
+  free(sched.first);
+  sched.first = NULL;
+
+  free(sched.work);
+  sched.work = NULL;
+
+  return EXIT_SUCCESS;
+}
+
+
+float calc_reynolds(const t_param params, float av_vels)
+{
+  const float viscosity = 1.f / 6.f * (2.f / params.omega - 1.f);
+
+  return av_vels * params.reynolds_dim / viscosity;
+}
+
+float total_density(const t_param params, t_speed* cells)
+{
+  float total = 0.f;  /* accumulator */
+
+  #pragma omp parallel for schedule(static) reduction(+:total)
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        total += cells->speeds[kk][cell_index(params, ii, jj)];
+      }
+    }
+  }
+
+  return ranks_sum(total);
+}
+
+int write_values(const t_param params, t_speed* cells, uint8_t* obstacles, float* av_vels)
+{
+  FILE* fp;                     /* file pointer */
+  const int binary = (params.output == OUTPUT_BINARY);
+  char  descr[128];             /* NumPy type of the cells and of av_vels */
+  char  shape[64];              /* dimensions of the NumPy arrays */
+  const uint16_t one = 1;
+  const char order = *(const uint8_t*)&one ? '<' : '>';  /* byte order of the floats */
+  char  name[1024];             /* output file name */
+
+  /* the ranks append their slabs in turn, bottom row first; ensemble
+  ** members, on one rank, write from threads other than the master */
+  if (params.nranks > 1) for (int rank = 0; rank < params.rank; rank++) ranks_barrier();
+
+  output_name(params, binary ? FINALSTATENPY : FINALSTATEFILE, name, sizeof(name));
+  fp = fopen(name, (params.rank == 0) ? "w" : "a");
+
+  if (fp == NULL)
+  {
+    die("could not open file output file", __LINE__, __FILE__);
+  }
+
+  if (binary)
+  {
+    if (params.rank == 0)
+    {
+      snprintf(descr, sizeof(descr), "[('u_x', '%cf4'), ('u_y', '%cf4'), ('u', '%cf4'), ('pressure', '%cf4'), ('obstacle', 'u1')]",
+               order, order, order, order);
+      snprintf(shape, sizeof(shape), "(%d, %d)", params.global_ny, params.nx);
+      write_npy_header(fp, descr, shape);
+    }
+
+    write_state_binary(params, cells, obstacles, fp);
+  }
+  else
+  {
+    write_state_ascii(params, cells, obstacles, fp);
+  }
+
+  fclose(fp);
+
+  if (params.nranks > 1) for (int rank = params.rank; rank < params.nranks; rank++) ranks_barrier();
+
+  /* streamed av_vels are already on their way to the file */
+  if (params.rank != 0 || params.diag_stream) return EXIT_SUCCESS;
+
+  output_name(params, binary ? AVVELSNPY : AVVELSFILE, name, sizeof(name));
+  fp = fopen(name, "w");
+
+  if (fp == NULL)
+  {
+    die("could not open file output file", __LINE__, __FILE__);
+  }
+
+  if (binary)
+  {
+    snprintf(descr, sizeof(descr), "'%cf4'", order);
+    snprintf(shape, sizeof(shape), "(%d,)", params.maxIters);
+    write_npy_header(fp, descr, shape);
+
+    if (fwrite(av_vels, sizeof(float), params.maxIters, fp) != (size_t)params.maxIters)
+    {
+      die("could not write output file", __LINE__, __FILE__);
+    }
+  }
+  else
+  {
+    for (int ii = 0; ii < params.maxIters; ii++)
+    {
+      fprintf(fp, "%d:\t%.12E\n", ii, av_vels[ii]);
+    }
+  }
+
+  fclose(fp);
+
+  return EXIT_SUCCESS;
+}
+
+void output_name(const t_param params, const char* file, char* name, const size_t size)
+{
+  const char* ext = strrchr(file, '.');
+
+  /* av_vels.dat is av_vels_3.dat for member 3 */
+  if (params.member < 0 || ext == NULL) snprintf(name, size, "%s", file);
+  else snprintf(name, size, "%.*s_%d%s", (int)(ext - file), file, params.member, ext);
+}
+
+void cell_state_row(const t_param params, const t_speed* cells, const uint8_t* obstacles, const int jj,
+                    float* u_x, float* u_y, float* u, float* pressure)
+{
+  const float c_sq = 1.f / 3.f; /* sq. of speed of sound */
+
+  for (int ii = 0; ii < params.nx; ii++)
+  {
+    const int idx = cell_index(params, ii, jj);
+
+    /* an occupied cell */
+    if (obstacles[ii + jj*params.nx])
+    {
+      u_x[ii] = u_y[ii] = u[ii] = 0.f;
+      pressure[ii] = params.density * c_sq;
+    }
+    /* no obstacle */
+    else
+    {
+      float local_density = 0.f;  /* sum of densities in the cell */
+
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        local_density += cells->speeds[kk][idx];
+      }
+
+      /* compute x velocity component */
+      u_x[ii] = (cells->speeds[1][idx]
+                 + cells->speeds[5][idx]
+                 + cells->speeds[8][idx]
+                 - (cells->speeds[3][idx]
+                    + cells->speeds[6][idx]
+                    + cells->speeds[7][idx]))
+                / local_density;
+      /* compute y velocity component */
+      u_y[ii] = (cells->speeds[2][idx]
+                 + cells->speeds[5][idx]
+                 + cells->speeds[6][idx]
+                 - (cells->speeds[4][idx]
+                    + cells->speeds[7][idx]
+                    + cells->speeds[8][idx]))
+                / local_density;
+      /* compute norm of velocity */
+      u[ii] = sqrtf((u_x[ii] * u_x[ii]) + (u_y[ii] * u_y[ii]));
+      /* compute pressure */
+      pressure[ii] = local_density * c_sq;
+    }
+  }
+}
+
+void write_state_ascii(const t_param params, const t_speed* cells, const uint8_t* obstacles, FILE* fp)
+{
+  /* blocks of rows are formatted by the threads in turn and written
+  ** out in order, so one thread's text goes to the file while the
+  ** others format the blocks after it */
+  const int rows = (OUTPUT_BLOCK / (OUTPUT_LINE * params.nx) > 1) ? OUTPUT_BLOCK / (OUTPUT_LINE * params.nx) : 1;
+  const int nblocks = (params.ny + rows - 1) / rows;
+
+  #pragma omp parallel
+  {
+    char*  text = (char*) malloc((size_t)OUTPUT_LINE * params.nx * rows);
+    float* state = (float*) malloc(sizeof(float) * 4 * params.nx);
+
+    if (text == NULL || state == NULL) die("cannot allocate memory for output", __LINE__, __FILE__);
+
+    #pragma omp for ordered schedule(static, 1)
+    for (int block = 0; block < nblocks; block++)
+    {
+      const int end = (block * rows + rows < params.ny) ? block * rows + rows : params.ny;
+      size_t    len = 0;
+
+      for (int jj = block * rows; jj < end; jj++)
+      {
+        cell_state_row(params, cells, obstacles, jj, state, state + params.nx, state + 2*params.nx, state + 3*params.nx);
+
+        for (int ii = 0; ii < params.nx; ii++)
+        {
+          len += snprintf(text + len, OUTPUT_LINE, "%d %d %.12E %.12E %.12E %.12E %d\n", ii, jj + params.row0,
+                          state[ii], state[params.nx + ii], state[2*params.nx + ii], state[3*params.nx + ii],
+                          obstacles[ii + jj*params.nx]);
+        }
+      }
+
+      #pragma omp ordered
+      if (fwrite(text, 1, len, fp) != len) die("could not write output file", __LINE__, __FILE__);
+    }
+
+    free(text);
+    free(state);
+  }
+}
+
+void write_state_binary(const t_param params, const t_speed* cells, const uint8_t* obstacles, FILE* fp)
+{
+  /* one packed record per cell: u_x, u_y, u, pressure and the obstacle flag */
+  const size_t record = 4 * sizeof(float) + 1;
+  char*        data = (char*) malloc(record * params.nx * params.ny);
+
+  if (data == NULL) die("cannot allocate memory for output", __LINE__, __FILE__);
+
+  #pragma omp parallel
+  {
+    float* state = (float*) malloc(sizeof(float) * 4 * params.nx);
+
+    if (state == NULL) die("cannot allocate memory for output", __LINE__, __FILE__);
+
+    #pragma omp for schedule(static)
+    for (int jj = 0; jj < params.ny; jj++)
+    {
+      char* out = data + record * params.nx * jj;
+
+      cell_state_row(params, cells, obstacles, jj, state, state + params.nx, state + 2*params.nx, state + 3*params.nx);
+
+      for (int ii = 0; ii < params.nx; ii++, out += record)
+      {
+        for (int field = 0; field < 4; field++) memcpy(out + field * sizeof(float), state + field*params.nx + ii, sizeof(float));
+
+        out[4 * sizeof(float)] = (char)obstacles[ii + jj*params.nx];
+      }
+    }
+
+    free(state);
+  }
+
+  if (fwrite(data, record, (size_t)params.nx * params.ny, fp) != (size_t)params.nx * params.ny)
+  {
+    die("could not write output file", __LINE__, __FILE__);
+  }
+
+  free(data);
+}
+
+void write_npy_header(FILE* fp, const char* descr, const char* shape)
+{
+  char header[512];
+  int  len = snprintf(header + 10, sizeof(header) - 10, "{'descr': %s, 'fortran_order': False, 'shape': %s, }", descr, shape);
+
+  /* .npy version 1.0: magic string, version, little-endian length of
+  ** the header, which is padded with spaces to a multiple of 64 bytes
+  ** in all and ends in a newline */
+  const int total = (10 + len + 1 + 63) / 64 * 64;
+
+  memcpy(header, "\x93NUMPY\x01\x00", 8);
+  header[8] = (char)((total - 10) & 0xff);
+  header[9] = (char)((total - 10) >> 8);
+  memset(header + 10 + len, ' ', total - 10 - len - 1);
+  header[total - 1] = '\n';
+
+  if (fwrite(header, 1, total, fp) != (size_t)total) die("could not write output file", __LINE__, __FILE__);
+}
+
+float* alloc_plane(const t_param params)
+{
+  size_t bytes = sizeof(float) * params.plane;
+
+#ifdef MADV_HUGEPAGE
+  if (params.hugepages)
+  {
+    void* plane = NULL;
+
+    /* whole, aligned huge pages, so that none of them is shared */
+    bytes = (bytes + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+
+    if (posix_memalign(&plane, HUGE_PAGE, bytes) != 0) return NULL;
+
+    /* only a hint: without THP support the plane gets normal pages */
+    madvise(plane, bytes, MADV_HUGEPAGE);
+
+    return (float*) plane;
+  }
+#endif
+
+  /* cache line aligned, as a block of the AoSoA layout is a line per speed */
+  return (float*) _mm_malloc(bytes, 64);
+}
+
+void free_plane(const t_param params, float* plane)
+{
+#ifdef MADV_HUGEPAGE
+  if (params.hugepages)
+  {
+    free(plane);
+    return;
+  }
+#endif
+
+  _mm_free(plane);
+}
+
+void report_threads(const t_param params)
+{
+  const int nthreads = omp_get_max_threads();
+  int*      cpu  = (int*) malloc(sizeof(int) * 2 * nthreads);
+  int*      node = cpu + nthreads;
+
+  if (cpu == NULL) die("cannot allocate memory for the thread map", __LINE__, __FILE__);
+
+  for (int t = 0; t < nthreads; t++) cpu[t] = node[t] = -1;
+
+  #pragma omp parallel
+  {
+    const int t = omp_get_thread_num();
+    unsigned  c = 0, n = 0;
+
+#ifdef SYS_getcpu
+    if (syscall(SYS_getcpu, &c, &n, NULL) == 0)
+    {
+      cpu[t]  = (int) c;
+      node[t] = (int) n;
+    }
+#endif
+  }
+
+  /* one rank at a time, so that the lines do not interleave */
+  for (int rank = 0; rank < params.nranks; rank++)
+  {
+    if (rank == params.rank)
+    {
+      for (int t = 0; t < nthreads; t++)
+      {
+        printf("rank %d thread %d: cpu %d, node %d\n", params.rank, t, cpu[t], node[t]);
+      }
+
+      fflush(stdout);
+    }
+
+    ranks_barrier();
+  }
+
+  free(cpu);
+}
+
+/*
+** Checkpoint/restart.
+**
+** At a checkpoint the team copies this rank's slab of the lattice
+** into a snapshot buffer and goes straight on with the next
+** timestep, while a background thread writes the buffer to a
+** temporary file and renames it over the previous checkpoint, so a
+** crash mid-write leaves the last complete one in place.  There are
+** two buffers: one can be filled while the other is being written,
+** and the team only waits if a checkpoint is still queued when the
+** next one is due.
+*/
+static struct
+{
+  pthread_t       thread;
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  char            path[4096];  /* this rank's checkpoint file */
+  char*           buf[2];      /* snapshot buffers */
+  size_t          bytes[2];    /* bytes of each to write */
+  int             fill;        /* buffer being filled by the team */
+  int             pending;     /* buffer waiting for the writer, or -1 */
+  int             writing;     /* buffer being written, or -1 */
+  int             stop;        /* no more checkpoints are coming */
+  const uint8_t*  obstacles;   /* this rank's slab of the obstacle map */
+} ckpt;
+
+static void checkpoint_path(const t_param params, const char* file, char* path, const size_t len)
+{
+  /* every rank writes its own slab to its own file */
+  if (params.nranks == 1) snprintf(path, len, "%s", file);
+  else snprintf(path, len, "%s.%d", file, params.rank);
+}
+
+static size_t checkpoint_bytes(const t_param params, const int history)
+{
+  const size_t cells = (size_t)params.nx * params.ny;
+
+  return CHECKPOINT_HEADER + sizeof(float) * (NSPEEDS * cells + history) + cells;
+}
+
+static void* checkpoint_writer(void* arg)
+{
+  char tmp[4096 + 8];
+
+  (void)arg;
+  snprintf(tmp, sizeof(tmp), "%s.tmp", ckpt.path);
+  pthread_mutex_lock(&ckpt.lock);
+
+  for (;;)
+  {
+    while (ckpt.pending < 0 && !ckpt.stop) pthread_cond_wait(&ckpt.cond, &ckpt.lock);
+
+    if (ckpt.pending < 0) break;
+
+    const int b = ckpt.pending;
+
+    ckpt.writing = b;
+    ckpt.pending = -1;
+    pthread_cond_broadcast(&ckpt.cond);
+    pthread_mutex_unlock(&ckpt.lock);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0) die("could not open checkpoint file", __LINE__, __FILE__);
+
+    for (size_t done = 0; done < ckpt.bytes[b];)
+    {
+      const ssize_t n = write(fd, ckpt.buf[b] + done, ckpt.bytes[b] - done);
+
+      if (n < 0) die("could not write checkpoint file", __LINE__, __FILE__);
+
+      done += n;
+    }
+
+    if (fsync(fd) != 0 || close(fd) != 0 || rename(tmp, ckpt.path) != 0)
+    {
+      die("could not write checkpoint file", __LINE__, __FILE__);
+    }
+
+    pthread_mutex_lock(&ckpt.lock);
+    ckpt.writing = -1;
+    pthread_cond_broadcast(&ckpt.cond);
+  }
+
+  pthread_mutex_unlock(&ckpt.lock);
+
+  return NULL;
+}
+
+int checkpoint_due(const t_param params, const int iteration)
+{
+  return params.checkpoint_every > 0 && iteration % params.checkpoint_every == 0;
+}
+
+void checkpoint_open(const t_param params, const uint8_t* obstacles)
+{
+  const size_t bytes = checkpoint_bytes(params, params.diag_stream ? 0 : params.maxIters);
+  checkpoint_path(params, params.checkpoint_file, ckpt.path, sizeof(ckpt.path));
+
+  for (int b = 0; b < 2; b++)
+  {
+    ckpt.buf[b] = (char*) _mm_malloc(bytes, CHECKPOINT_HEADER);
+
+    if (ckpt.buf[b] == NULL) die("cannot allocate memory for checkpoints", __LINE__, __FILE__);
+
+    memset(ckpt.buf[b], 0, CHECKPOINT_HEADER);
+    ckpt.bytes[b] = 0;
+  }
+
+  ckpt.obstacles = obstacles;
+  ckpt.fill = 0;
+  ckpt.pending = -1;
+  ckpt.writing = -1;
+  ckpt.stop = 0;
+  pthread_mutex_init(&ckpt.lock, NULL);
+  pthread_cond_init(&ckpt.cond, NULL);
+
+  if (pthread_create(&ckpt.thread, NULL, checkpoint_writer, NULL) != 0)
+  {
+    die("could not start the checkpoint writer", __LINE__, __FILE__);
+  }
+}
+
+void checkpoint_begin(const t_param params, const int iteration, const int accelerated, const float* av_vels)
+{
+  const size_t  cells = (size_t)params.nx * params.ny;
+  const int     history = params.diag_stream ? 0 : iteration;  /* streamed av_vels are in their file */
+  t_checkpoint* header;
+  char*         buf;
+
+  /* the buffer the writer is not busy with is free once nothing is queued */
+  pthread_mutex_lock(&ckpt.lock);
+
+  while (ckpt.pending >= 0) pthread_cond_wait(&ckpt.cond, &ckpt.lock);
+
+  ckpt.fill = (ckpt.writing == 0) ? 1 : 0;
+  pthread_mutex_unlock(&ckpt.lock);
+
+  buf = ckpt.buf[ckpt.fill];
+  header = (t_checkpoint*)buf;
+  memcpy(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic));
+  header->iteration = iteration;
+  header->accelerated = accelerated;
+  header->history = history;
+  header->params = params;
+  header->params.checkpoint_file = NULL;
+  header->params.restart_file = NULL;
+  header->params.obstacle_save = NULL;
+
+  buf += CHECKPOINT_HEADER + sizeof(float) * NSPEEDS * cells;
+  memcpy(buf, av_vels, sizeof(float) * history);
+  buf += sizeof(float) * history;
+  memcpy(buf, ckpt.obstacles, cells);
+  ckpt.bytes[ckpt.fill] = checkpoint_bytes(params, history);
+}
+
+void checkpoint_copy_team(const t_param params, const t_speed* cells)
+{
+  float* planes = (float*)(ckpt.buf[ckpt.fill] + CHECKPOINT_HEADER);
+
+  /* rows are copied by the threads that computed them */
+  #pragma omp for schedule(static)
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      memcpy(planes + ((size_t)kk*params.ny + jj) * params.nx,
+             cells->speeds[kk] + params.origin + jj*params.stride, sizeof(float) * params.nx);
+    }
+  }
+}
+
+void checkpoint_commit(void)
+{
+  pthread_mutex_lock(&ckpt.lock);
+  ckpt.pending = ckpt.fill;
+  pthread_cond_broadcast(&ckpt.cond);
+  pthread_mutex_unlock(&ckpt.lock);
+}
+
+void checkpoint(const t_param params, const int iteration, const int accelerated, const t_speed* cells,
+                const float* av_vels)
+{
+  checkpoint_begin(params, iteration, accelerated, av_vels);
+
+  #pragma omp parallel
+  checkpoint_copy_team(params, cells);
+
+  checkpoint_commit();
+}
+
+void checkpoint_close(void)
+{
+  pthread_mutex_lock(&ckpt.lock);
+  ckpt.stop = 1;
+  pthread_cond_broadcast(&ckpt.cond);
+  pthread_mutex_unlock(&ckpt.lock);
+  pthread_join(ckpt.thread, NULL);
+  pthread_mutex_destroy(&ckpt.lock);
+  pthread_cond_destroy(&ckpt.cond);
+  _mm_free(ckpt.buf[0]);
+  _mm_free(ckpt.buf[1]);
+}
+
+int restart(const t_param params, t_speed* cells, const uint8_t* obstacles, float* av_vels, int* accelerated)
+{
+  const size_t        cells_n = (size_t)params.nx * params.ny;
+  char                path[4096];
+  struct stat         st;
+  const t_checkpoint* header;
+  const char*         base;
+  int                 fd;
+
+  checkpoint_path(params, params.restart_file, path, sizeof(path));
+  fd = open(path, O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &st) != 0) die("could not open restart file", __LINE__, __FILE__);
+
+  if ((size_t)st.st_size < CHECKPOINT_HEADER) die("restart file is too short", __LINE__, __FILE__);
+
+  base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  if (base == MAP_FAILED) die("could not map restart file", __LINE__, __FILE__);
+
+  close(fd);
+  header = (const t_checkpoint*)base;
+
+  if (memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)))
+  {
+    die("restart file is not a checkpoint", __LINE__, __FILE__);
+  }
+
+  /* the run may be extended, but must otherwise be the same one */
+  if (header->params.nx != params.nx || header->params.ny != params.ny
+      || header->params.global_ny != params.global_ny || header->params.row0 != params.row0
+      || header->params.density != params.density || header->params.accel != params.accel
+      || header->params.omega != params.omega)
+  {
+    die("restart file is from a different problem", __LINE__, __FILE__);
+  }
+
+  if (header->iteration > params.maxIters) die("restart file is past maxIters", __LINE__, __FILE__);
+
+  if (header->history != (params.diag_stream ? 0 : header->iteration))
+  {
+    die("restart file and run disagree on streaming av_vels", __LINE__, __FILE__);
+  }
+
+  if ((size_t)st.st_size != checkpoint_bytes(params, header->history))
+  {
+    die("restart file is truncated", __LINE__, __FILE__);
+  }
+
+  const float*   planes = (const float*)(base + CHECKPOINT_HEADER);
+  const float*   vels   = planes + NSPEEDS * cells_n;
+  const uint8_t* mask   = (const uint8_t*)(vels + header->history);
+
+  if (memcmp(mask, obstacles, cells_n)) die("restart file has different obstacles", __LINE__, __FILE__);
+
+  /* the pages of the mapping are read in by the threads that own the rows */
+  #pragma omp parallel for schedule(static)
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      memcpy(cells->speeds[kk] + params.origin + jj*params.stride,
+             planes + ((size_t)kk*params.ny + jj) * params.nx, sizeof(float) * params.nx);
+    }
+  }
+
+  memcpy(av_vels, vels, sizeof(float) * header->history);
+
+  const int iteration = header->iteration;
+
+  *accelerated = header->accelerated;
+  munmap((void*)base, st.st_size);
+
+  return iteration;
+}
+
+/*
+** Streamed diagnostics.
+**
+** Rather than keeping the average velocity of every timestep until
+** the end of the run, every diag_stride'th sample, and the last one,
+** is gathered into a batch in a ring of DIAG_SLOTS batches.  A full
+** batch is summed over the ranks and handed to a background thread
+** on rank 0, which formats it and appends it to av_vels.dat while the
+** timesteps go on; the team only waits if the writer falls a whole
+** ring behind.  Memory stays the same however long the run is.
+*/
+static struct
+{
+  pthread_t       thread;
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  FILE*           fp;
+  t_diag_batch    ring[DIAG_SLOTS];
+  long            head;   /* batches handed to the writer; ring[head % DIAG_SLOTS] is filling */
+  long            tail;   /* batches written out */
+  int             extra;  /* samples carry the extra diagnostics */
+  int             stop;   /* no more batches are coming */
+  float           last;   /* average velocity of the last sample, once summed over the ranks */
+} diag;
+
+static void* diag_writer(void* arg)
+{
+  char* text = (char*) malloc((size_t)OUTPUT_LINE * DIAG_BATCH);
+
+  (void)arg;
+
+  if (text == NULL) die("cannot allocate memory for diagnostics", __LINE__, __FILE__);
+
+  pthread_mutex_lock(&diag.lock);
+
+  for (;;)
+  {
+    while (diag.tail == diag.head && !diag.stop) pthread_cond_wait(&diag.cond, &diag.lock);
+
+    if (diag.tail == diag.head) break;
+
+    /* the batch stays put until tail moves past it */
+    const t_diag_batch* batch = &diag.ring[diag.tail % DIAG_SLOTS];
+    size_t              len = 0;
+
+    pthread_mutex_unlock(&diag.lock);
+
+    for (int ss = 0; ss < batch->n; ss++)
+    {
+      if (diag.extra)
+      {
+        len += snprintf(text + len, OUTPUT_LINE, "%d:\t%.12E\t%.12E\t%.12E\t%.12E\n", batch->tt[ss], batch->av_vel[ss],
+                        batch->extra[ss][0], batch->extra[ss][1], batch->extra[ss][2]);
+      }
+      else
+      {
+        len += snprintf(text + len, OUTPUT_LINE, "%d:\t%.12E\n", batch->tt[ss], batch->av_vel[ss]);
+      }
+    }
+
+    if (fwrite(text, 1, len, diag.fp) != len) die("could not write output file", __LINE__, __FILE__);
+
+    pthread_mutex_lock(&diag.lock);
+    diag.tail++;
+    pthread_cond_broadcast(&diag.cond);
+  }
+
+  pthread_mutex_unlock(&diag.lock);
+  free(text);
+
+  return NULL;
+}
+
+void record_av_vel(const t_param params, float* av_vels, const int tt, const float av_vel)
+{
+  if (params.diag_stream) diag_record(params, tt, av_vel, NULL);
+  else av_vels[tt] = av_vel;
+}
+
+int diag_sampled(const t_param params, const int tt)
+{
+  return tt % params.diag_stride == 0 || tt == params.maxIters - 1;
+}
+
+int converge_due(const t_param params, const int tt)
+{
+  return params.converge_tol > 0.f && conv.at < 0 && (tt + 1) % params.converge_window == 0;
+}
+
+int converge_check(const t_param params, const int tt, const float av_vel)
+{
+  /* every rank only holds its share of the average */
+  const float v = ranks_sum(av_vel);
+  const float last = conv.last;
+
+  conv.last = v;
+
+  /* a NaN is not steady either */
+  if (last < 0.f || !(fabsf(v - last) <= params.converge_tol * v)) return params.maxIters;
+
+  /* one more timestep, whose sweep leaves the lattice unaccelerated
+  ** as the last timestep of a run always does */
+  conv.at = tt;
+
+  return (tt + 2 < params.maxIters) ? tt + 2 : params.maxIters;
+}
+
+void diag_open(const t_param params, const int start)
+{
+  diag.head = 0;
+  diag.tail = 0;
+  diag.extra = params.diag_extra;
+  diag.stop = 0;
+  diag.last = 0.f;
+  diag.ring[0].n = 0;
+
+  if (params.rank != 0) return;
+
+  if (start == 0)
+  {
+    diag.fp = fopen(AVVELSFILE, "w");
+  }
+  else
+  {
+    char line[OUTPUT_LINE];
+    long keep = 0;  /* bytes of the samples from before the restart */
+
+    /* drop the samples written after the checkpoint being restarted from */
+    diag.fp = fopen(AVVELSFILE, "r+");
+
+    if (diag.fp == NULL) die("could not open streamed av_vels to carry on", __LINE__, __FILE__);
+
+    while (fgets(line, sizeof(line), diag.fp) != NULL && atoi(line) < start) keep = ftell(diag.fp);
+
+    if (ftruncate(fileno(diag.fp), keep) != 0 || fseek(diag.fp, keep, SEEK_SET) != 0)
+    {
+      die("could not truncate streamed av_vels", __LINE__, __FILE__);
+    }
+  }
+
+  if (diag.fp == NULL) die("could not open file output file", __LINE__, __FILE__);
+
+  pthread_mutex_init(&diag.lock, NULL);
+  pthread_cond_init(&diag.cond, NULL);
+
+  if (pthread_create(&diag.thread, NULL, diag_writer, NULL) != 0)
+  {
+    die("could not start the diagnostics writer", __LINE__, __FILE__);
+  }
+}
+
+void diag_record(const t_param params, const int tt, const float av_vel, const float* extra)
+{
+  if (!diag_sampled(params, tt)) return;
+
+  t_diag_batch* batch = &diag.ring[diag.head % DIAG_SLOTS];
+
+  batch->tt[batch->n] = tt;
+  batch->av_vel[batch->n] = av_vel;
+
+  if (extra != NULL) memcpy(batch->extra[batch->n], extra, sizeof(float) * DIAG_EXTRA);
+
+  if (++batch->n == DIAG_BATCH) diag_flush(params);
+}
+
+void diag_flush(const t_param params)
+{
+  t_diag_batch* batch = &diag.ring[diag.head % DIAG_SLOTS];
+
+  if (batch->n == 0) return;
+
+  /* every rank samples the same timesteps, so they all get here together */
+  ranks_reduce(batch->av_vel, batch->n);
+  diag.last = batch->av_vel[batch->n - 1];
+
+  if (params.rank == 0)
+  {
+    pthread_mutex_lock(&diag.lock);
+    diag.head++;
+    pthread_cond_broadcast(&diag.cond);
+
+    /* the next slot's last batch must be written out before it is refilled */
+    while (diag.head - diag.tail >= DIAG_SLOTS) pthread_cond_wait(&diag.cond, &diag.lock);
+
+    pthread_mutex_unlock(&diag.lock);
+  }
+
+  diag.ring[diag.head % DIAG_SLOTS].n = 0;
+}
+
+void diag_sync(const t_param params)
+{
+  /* everything up to here reaches the disk before a checkpoint does */
+  diag_flush(params);
+
+  if (params.rank != 0) return;
+
+  pthread_mutex_lock(&diag.lock);
+
+  while (diag.tail < diag.head) pthread_cond_wait(&diag.cond, &diag.lock);
+
+  pthread_mutex_unlock(&diag.lock);
+
+  if (fflush(diag.fp) != 0 || fsync(fileno(diag.fp)) != 0) die("could not write output file", __LINE__, __FILE__);
+}
+
+float diag_close(const t_param params)
+{
+  diag_flush(params);
+
+  if (params.rank == 0)
+  {
+    pthread_mutex_lock(&diag.lock);
+    diag.stop = 1;
+    pthread_cond_broadcast(&diag.cond);
+    pthread_mutex_unlock(&diag.lock);
+    pthread_join(diag.thread, NULL);
+    pthread_mutex_destroy(&diag.lock);
+    pthread_cond_destroy(&diag.cond);
+    fclose(diag.fp);
+  }
+
+  return diag.last;
+}
+
+/* velocity of cell (ii,jj), zero in an obstacle */
+static inline void cell_velocity(const t_param params, const t_speed* cells, const uint8_t* obstacles,
+                                 const int ii, const int jj, float* u_x, float* u_y)
+{
+  const int idx = cell_index(params, ii, jj);
+  float     local_density = 0.f;
+
+  if (obstacles[ii + jj*params.nx])
+  {
+    *u_x = *u_y = 0.f;
+    return;
+  }
+
+  for (int kk = 0; kk < NSPEEDS; kk++)
+  {
+    local_density += cells->speeds[kk][idx];
+  }
+
+  *u_x = (cells->speeds[1][idx] + cells->speeds[5][idx] + cells->speeds[8][idx]
+          - (cells->speeds[3][idx] + cells->speeds[6][idx] + cells->speeds[7][idx])) / local_density;
+  *u_y = (cells->speeds[2][idx] + cells->speeds[5][idx] + cells->speeds[6][idx]
+          - (cells->speeds[4][idx] + cells->speeds[7][idx] + cells->speeds[8][idx])) / local_density;
+}
+
+void diag_extras_team(const t_param params, const t_speed* cells, const uint8_t* obstacles, float* extra)
+{
+  float  u_max = 0.f;      /* largest speed of a fluid cell */
+  double density = 0.;    /* total density, as total_density() but without its rounding */
+  double vorticity = 0.;  /* sum of the squared vorticity of the fluid cells */
+
+  #pragma omp single
+  extra[0] = extra[1] = extra[2] = 0.f;
+
+  /* the cells have already been accelerated for the next timestep */
+  #pragma omp for schedule(static) nowait
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    const int y_n = (jj + 1) % params.ny;
+    const int y_s = (jj == 0) ? params.ny - 1 : jj - 1;
+
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      const int x_e = (ii + 1) % params.nx;
+      const int x_w = (ii == 0) ? params.nx - 1 : ii - 1;
+      float     u_x, u_y, ux_n, ux_s, uy_e, uy_w, unused;
+
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        density += cells->speeds[kk][cell_index(params, ii, jj)];
+      }
+
+      if (obstacles[ii + jj*params.nx]) continue;
+
+      cell_velocity(params, cells, obstacles, ii, jj, &u_x, &u_y);
+      u_max = fmaxf(u_max, sqrtf(u_x * u_x + u_y * u_y));
+
+      /* central differences of the periodic velocity field */
+      cell_velocity(params, cells, obstacles, x_e, jj, &unused, &uy_e);
+      cell_velocity(params, cells, obstacles, x_w, jj, &unused, &uy_w);
+      cell_velocity(params, cells, obstacles, ii, y_n, &ux_n, &unused);
+      cell_velocity(params, cells, obstacles, ii, y_s, &ux_s, &unused);
+
+      const float w = 0.5f * ((uy_e - uy_w) - (ux_n - ux_s));
+
+      vorticity += w * w;
+    }
+  }
+
+  #pragma omp critical
+  {
+    extra[0] = fmaxf(extra[0], u_max);
+    extra[1] += density;
+    extra[2] += vorticity;
+  }
+
+  #pragma omp barrier
+
+  /* the root mean square over the fluid cells */
+  #pragma omp single
+  extra[2] = sqrtf(extra[2] / (float)params.nfluid);
+}
+
+/*
+** Snapshot frames.
+**
+** As for checkpoints, the team fills one of two buffers and goes on
+** with the next timestep while a background thread writes the other
+** out, so a frame only holds the run up if the one before it is still
+** queued.  The team works out the density and the velocity of each
+** cell itself, spread over the threads, which leaves the writer only
+** the formatting: it turns the planes of a buffer into a legacy VTK
+** file of structured points, with big-endian floats, or a .npy array
+** of records like final_state.npy, and writes it out in one go.
+*/
+static struct
+{
+  pthread_t       thread;
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  t_param         params;       /* the grid and the names of the frames */
+  float*          buf[2];       /* density, u_x and u_y planes of a frame */
+  int             iteration[2]; /* timestep each buffer is a frame of */
+  char*           out;          /* the writer's formatted frame */
+  size_t          out_bytes;
+  int             digits;       /* timesteps in the file names are padded to this */
+  int             fill;         /* buffer being filled by the team */
+  int             pending;      /* buffer waiting for the writer, or -1 */
+  int             writing;      /* buffer being written, or -1 */
+  int             stop;         /* no more frames are coming */
+  int             count;        /* frames handed to the writer */
+  double          copy;         /* time the team spent filling the buffers */
+  double          wait;         /* and waiting for one to be free */
+  const uint8_t*  obstacles;
+} frame;
+
+/* v in big-endian byte order, as legacy VTK files store it */
+static void put_be32(char* out, const float v)
+{
+  uint32_t bits;
+
+  memcpy(&bits, &v, sizeof(bits));
+  out[0] = (char)(bits >> 24);
+  out[1] = (char)(bits >> 16);
+  out[2] = (char)(bits >> 8);
+  out[3] = (char)bits;
+}
+
+/* format a frame into frame.out, returning its length */
+static size_t frame_format(const float* planes, const int iteration)
+{
+  const t_param params = frame.params;
+  const size_t  ncells = (size_t)params.nx * params.ny;
+  const float*  density = planes;
+  const float*  u_x = planes + ncells;
+  const float*  u_y = planes + 2 * ncells;
+  char*         out = frame.out;
+  size_t        len = 0;
+
+  if (params.frame_format == FRAME_VTK)
+  {
+    len += sprintf(out, "# vtk DataFile Version 3.0\nd2q9-bgk timestep %d\nBINARY\nDATASET STRUCTURED_POINTS\n"
+                   "DIMENSIONS %d %d 1\nORIGIN 0 0 0\nSPACING 1 1 1\nPOINT_DATA %zu\n"
+                   "SCALARS density float 1\nLOOKUP_TABLE default\n", iteration, params.nx, params.ny, ncells);
+
+    for (size_t cc = 0; cc < ncells; cc++, len += 4) put_be32(out + len, density[cc]);
+
+    len += sprintf(out + len, "\nVECTORS velocity float\n");
+
+    for (size_t cc = 0; cc < ncells; cc++, len += 12)
+    {
+      put_be32(out + len, u_x[cc]);
+      put_be32(out + len + 4, u_y[cc]);
+      put_be32(out + len + 8, 0.f);
+    }
+
+    len += sprintf(out + len, "\nSCALARS obstacle unsigned_char 1\nLOOKUP_TABLE default\n");
+    memcpy(out + len, frame.obstacles, ncells);
+    len += ncells;
+    out[len++] = '\n';
+  }
+  else
+  {
+    /* write_npy_header() wants a file, so the header is written
+    ** through a memory stream */
+    const uint16_t one = 1;
+    const char     order = *(const uint8_t*)&one ? '<' : '>';
+    char           descr[128], shape[64];
+    FILE*          fp = fmemopen(out, 512, "w");
+
+    if (fp == NULL) die("could not format a frame", __LINE__, __FILE__);
+
+    snprintf(descr, sizeof(descr), "[('density', '%cf4'), ('u_x', '%cf4'), ('u_y', '%cf4'), ('obstacle', 'u1')]",
+             order, order, order);
+    snprintf(shape, sizeof(shape), "(%d, %d)", params.ny, params.nx);
+    write_npy_header(fp, descr, shape);
+    len = (size_t)ftell(fp);
+    fclose(fp);
+
+    for (size_t cc = 0; cc < ncells; cc++, len += 13)
+    {
+      memcpy(out + len, density + cc, 4);
+      memcpy(out + len + 4, u_x + cc, 4);
+      memcpy(out + len + 8, u_y + cc, 4);
+      out[len + 12] = (char)frame.obstacles[cc];
+    }
+  }
+
+  return len;
+}
+
+static void* frame_writer(void* arg)
+{
+  char name[4096 + 32];
+
+  (void)arg;
+  pthread_mutex_lock(&frame.lock);
+
+  for (;;)
+  {
+    while (frame.pending < 0 && !frame.stop) pthread_cond_wait(&frame.cond, &frame.lock);
+
+    if (frame.pending < 0) break;
+
+    const int b = frame.pending;
+
+    frame.writing = b;
+    frame.pending = -1;
+    pthread_cond_broadcast(&frame.cond);
+    pthread_mutex_unlock(&frame.lock);
+
+    const size_t len = frame_format(frame.buf[b], frame.iteration[b]);
+
+    snprintf(name, sizeof(name), "%s_%0*d.%s", frame.params.frame_file, frame.digits, frame.iteration[b],
+             (frame.params.frame_format == FRAME_VTK) ? "vtk" : "npy");
+
+    FILE* fp = fopen(name, "wb");
+
+    if (fp == NULL) die("could not open frame file", __LINE__, __FILE__);
+
+    if (fwrite(frame.out, 1, len, fp) != len || fclose(fp) != 0) die("could not write frame file", __LINE__, __FILE__);
+
+    pthread_mutex_lock(&frame.lock);
+    frame.writing = -1;
+    pthread_cond_broadcast(&frame.cond);
+  }
+
+  pthread_mutex_unlock(&frame.lock);
+
+  return NULL;
+}
+
+int frame_due(const t_param params, const int iteration)
+{
+  return params.frame_every > 0 && iteration % params.frame_every == 0;
+}
+
+void frame_open(const t_param params, const uint8_t* obstacles)
+{
+  const size_t ncells = (size_t)params.nx * params.ny;
+
+  for (int b = 0; b < 2; b++)
+  {
+    frame.buf[b] = (float*) _mm_malloc(sizeof(float) * 3 * ncells, 64);
+
+    if (frame.buf[b] == NULL) die("cannot allocate memory for frames", __LINE__, __FILE__);
+  }
+
+  /* the VTK file is the larger: 17 bytes a cell and its text */
+  frame.out_bytes = 17 * ncells + 1024;
+  frame.out = (char*) malloc(frame.out_bytes);
+
+  if (frame.out == NULL) die("cannot allocate memory for frames", __LINE__, __FILE__);
+
+  frame.params = params;
+  frame.obstacles = obstacles;
+  frame.digits = snprintf(NULL, 0, "%d", params.maxIters);
+  frame.fill = 0;
+  frame.pending = -1;
+  frame.writing = -1;
+  frame.stop = 0;
+  frame.count = 0;
+  frame.copy = frame.wait = 0.;
+  pthread_mutex_init(&frame.lock, NULL);
+  pthread_cond_init(&frame.cond, NULL);
+
+  if (pthread_create(&frame.thread, NULL, frame_writer, NULL) != 0)
+  {
+    die("could not start the frame writer", __LINE__, __FILE__);
+  }
+}
+
+void frame_begin(const int iteration)
+{
+  const double t0 = omp_get_wtime();
+
+  /* the buffer the writer is not busy with is free once nothing is queued */
+  pthread_mutex_lock(&frame.lock);
+
+  while (frame.pending >= 0) pthread_cond_wait(&frame.cond, &frame.lock);
+
+  frame.fill = (frame.writing == 0) ? 1 : 0;
+  pthread_mutex_unlock(&frame.lock);
+
+  frame.iteration[frame.fill] = iteration;
+  frame.wait += omp_get_wtime() - t0;
+}
+
+void frame_copy_team(const t_param params, const t_speed* cells)
+{
+  const size_t ncells = (size_t)params.nx * params.ny;
+  float*       density = frame.buf[frame.fill];
+  float*       u_x = density + ncells;
+  float*       u_y = density + 2 * ncells;
+  const double t0 = omp_get_wtime();
+
+  /* rows are worked on by the threads that computed them; one row
+  ** has already been accelerated for the next timestep */
+  #pragma omp for schedule(static)
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      const int    idx = cell_index(params, ii, jj);
+      const size_t cc = (size_t)jj * params.nx + ii;
+      float        f[NSPEEDS];
+      float        local_density = 0.f;
+
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        f[kk] = cells->speeds[kk][idx];
+        local_density += f[kk];
+      }
+
+      density[cc] = local_density;
+
+      if (frame.obstacles[cc])
+      {
+        u_x[cc] = u_y[cc] = 0.f;
+      }
+      else
+      {
+        u_x[cc] = (f[1] + f[5] + f[8] - (f[3] + f[6] + f[7])) / local_density;
+        u_y[cc] = (f[2] + f[5] + f[6] - (f[4] + f[7] + f[8])) / local_density;
+      }
+    }
+  }
+
+  #pragma omp master
+  frame.copy += omp_get_wtime() - t0;
+}
+
+void frame_commit(void)
+{
+  pthread_mutex_lock(&frame.lock);
+  frame.pending = frame.fill;
+  frame.count++;
+  pthread_cond_broadcast(&frame.cond);
+  pthread_mutex_unlock(&frame.lock);
+}
+
+void frame_close(void)
+{
+  pthread_mutex_lock(&frame.lock);
+  frame.stop = 1;
+  pthread_cond_broadcast(&frame.cond);
+  pthread_mutex_unlock(&frame.lock);
+  pthread_join(frame.thread, NULL);
+  pthread_mutex_destroy(&frame.lock);
+  pthread_cond_destroy(&frame.cond);
+  _mm_free(frame.buf[0]);
+  _mm_free(frame.buf[1]);
+  free(frame.out);
+}
+
+/*
+** Profiling.
+**
+** Time spent in each phase comes from omp_get_wtime().  Bandwidth is
+** modelled, not measured: every cell update reads and writes each of
+** its distributions once and reads its obstacle flag, which is what
+** a sweep that streams the lattice through the caches must move.
+*/
+#ifdef USE_PAPI
+static const int prof_events[PROF_EVENTS] = { PAPI_L3_TCM, PAPI_VEC_SP, PAPI_TOT_INS, PAPI_TOT_CYC };
+static const char* prof_event_names[PROF_EVENTS] = { "LLC misses", "SP vector ops", "instructions", "cycles" };
+#endif
+
+void profile_open(const t_param params)
+{
+  prof.nthreads = omp_get_max_threads();
+  prof.thread = (t_prof_thread*) _mm_malloc(sizeof(t_prof_thread) * prof.nthreads, 64);
+
+  if (prof.thread == NULL) die("cannot allocate memory for the profile", __LINE__, __FILE__);
+
+  memset(prof.thread, 0, sizeof(t_prof_thread) * prof.nthreads);
+  prof.halo_wait = 0.;
+  prof.calibrate = 0.;
+
+  for (int ee = 0; ee < PROF_EVENTS; ee++) prof.counts[ee] = -1;
+
+#ifdef USE_PAPI
+  if (prof.nthreads > PROF_MAX_THREADS) die("too many threads for the PAPI counters", __LINE__, __FILE__);
+
+  if (PAPI_library_init(PAPI_VER_CURRENT) != PAPI_VER_CURRENT
+      || PAPI_thread_init((unsigned long (*)(void))pthread_self) != PAPI_OK)
+  {
+    die("could not initialise PAPI", __LINE__, __FILE__);
+  }
+#endif
+  (void)params;
+}
+
+#ifdef USE_PAPI
+static int prof_eventset[PROF_MAX_THREADS];            /* each thread's PAPI event set */
+static int prof_added[PROF_MAX_THREADS][PROF_EVENTS];  /* the events each of them could count */
+#endif
+
+void profile_counters_start(void)
+{
+#ifdef USE_PAPI
+  /* counters belong to the thread that starts them, so every thread
+  ** of the team starts its own; the same threads run the loop */
+  #pragma omp parallel
+  {
+    const int t = omp_get_thread_num();
+
+    prof_eventset[t] = PAPI_NULL;
+    PAPI_create_eventset(&prof_eventset[t]);
+
+    for (int ee = 0; ee < PROF_EVENTS; ee++)
+    {
+      prof_added[t][ee] = (PAPI_add_event(prof_eventset[t], prof_events[ee]) == PAPI_OK);
+    }
+
+    PAPI_start(prof_eventset[t]);
+  }
+#endif
+}
+
+void profile_counters_stop(void)
+{
+#ifdef USE_PAPI
+  #pragma omp parallel
+  {
+    const int t = omp_get_thread_num();
+    long long values[PROF_EVENTS];
+    int       nn = 0;
+
+    PAPI_stop(prof_eventset[t], values);
+
+    #pragma omp critical
+    for (int ee = 0; ee < PROF_EVENTS; ee++)
+    {
+      if (!prof_added[t][ee]) continue;
+
+      prof.counts[ee] = (prof.counts[ee] < 0) ? values[nn] : prof.counts[ee] + values[nn];
+      nn++;
+    }
+
+    PAPI_cleanup_eventset(prof_eventset[t]);
+    PAPI_destroy_eventset(&prof_eventset[t]);
+  }
+#endif
+}
+
+double profile_bytes_per_update(const t_param params)
+{
+  const double speed = (params.storage == STORAGE_FP32) ? sizeof(float) : sizeof(uint16_t);
+
+  /* the sparse engine also reads a neighbour position per speed */
+  if (params.engine == ENGINE_SPARSE) return 2. * NSPEEDS * speed + NSPEEDS * sizeof(int);
+
+  return 2. * NSPEEDS * speed + sizeof(uint8_t);
+}
+
+float profile_calibrate(const t_param params)
+{
+  const double t0 = omp_get_wtime();
+  const double bytes = 3. * sizeof(float) * NSPEEDS * params.nx * params.ny;  /* read b and c, write a */
+  double       best = 0.;  /* fastest sweep */
+  t_speed      a, b, c;
+
+  for (int kk = 0; kk < NSPEEDS; kk++)
+  {
+    a.speeds[kk] = alloc_plane(params);
+    b.speeds[kk] = alloc_plane(params);
+    c.speeds[kk] = alloc_plane(params);
+
+    if (a.speeds[kk] == NULL || b.speeds[kk] == NULL || c.speeds[kk] == NULL)
+    {
+      die("cannot allocate memory for the bandwidth calibration", __LINE__, __FILE__);
+    }
+  }
+
+  /* placed on the NUMA nodes of the threads that sweep them, like the lattice */
+  #pragma omp parallel for schedule(static)
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      IVDEP_VECTOR_ALIGNED
+      for (int ii = 0; ii < params.nx; ii++)
+      {
+        const int idx = params.origin + ii + jj*params.stride;
+        a.speeds[kk][idx] = 0.f;
+        b.speeds[kk][idx] = 1.f;
+        c.speeds[kk][idx] = 2.f;
+      }
+    }
+  }
+
+  for (int rr = 0; rr < CALIBRATE_REPEATS; rr++)
+  {
+    /* the ranks share the nodes' memory, so they sweep together */
+    ranks_barrier();
+
+    const double t1 = omp_get_wtime();
+
+    #pragma omp parallel for schedule(static)
+    for (int jj = 0; jj < params.ny; jj++)
+    {
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        IVDEP_VECTOR_ALIGNED
+        for (int ii = 0; ii < params.nx; ii++)
+        {
+          const int idx = params.origin + ii + jj*params.stride;
+          a.speeds[kk][idx] = b.speeds[kk][idx] + CALIBRATE_SCALAR * c.speeds[kk][idx];
+        }
+      }
+    }
+
+    const double t = omp_get_wtime() - t1;
+
+    if (best == 0. || t < best) best = t;
+  }
+
+  for (int kk = 0; kk < NSPEEDS; kk++)
+  {
+    free_plane(params, a.speeds[kk]);
+    free_plane(params, b.speeds[kk]);
+    free_plane(params, c.speeds[kk]);
+  }
+
+  prof.calibrate = omp_get_wtime() - t0;
+
+  return ranks_sum((float)(bytes / best * 1e-9));
+}
+
+void profile_report(const t_param params, const double init, const double loop, const double reduce,
+                    const double output, const int steps)
+{
+  const double updates = (double)params.nx * params.global_ny * steps;
+  const double mlups = updates / loop * 1e-6;
+  const double bytes = profile_bytes_per_update(params);
+  const double gbs = mlups * bytes * 1e-3;
+  double       sweep = 0., wait = 0., accel = 0., sweep_max = 0., work = 0.;
+  /* whether the sweeps are shared out by rows, see schedule_rows() */
+  const int    by_rows = (params.engine == ENGINE_FUSED && params.storage == STORAGE_FP32
+                          && params.nranks == 1 && params.tile_w == TILE_OFF);
+
+  for (int t = 0; t < sched.nthreads; t++) work += sched.work[t];
+
+  for (int t = 0; t < prof.nthreads; t++)
+  {
+    sweep += prof.thread[t].sweep;
+    wait += prof.thread[t].wait;
+    accel += prof.thread[t].accel;
+
+    if (prof.thread[t].sweep > sweep_max) sweep_max = prof.thread[t].sweep;
+  }
+
+  if (params.rank == 0)
+  {
+    printf("==profile==\n");
+
+    if (params.nranks > 1) printf("(rank 0 of %d)\n", params.nranks);
+
+    printf("kernels:\t\t\t%s\n", (params.fixed_grid >= 0) ? "specialised for the grid size" : "generic");
+
+    if (params.engine == ENGINE_OFFLOAD)
+    {
+      if (prof.device < 0) printf("offload device:\t\t\tnone, the kernels ran on the host\n");
+      else printf("offload device:\t\t\t%d of %d\n", prof.device, omp_get_num_devices());
+    }
+
+    if (params.tile_w != TILE_OFF) printf("tiles:\t\t\t\t%d x %d cells\n", params.tile_w, params.tile_h);
+
+    if (by_rows) printf("schedule:\t\t\t%s rows\n", (params.schedule == SCHED_WEIGHTED) ? "weighted" : "static");
+
+    printf("init:\t\t\t\t%.6lf (s)\n", init);
+
+    if (params.calibrate) printf("  bandwidth calibration:\t%.6lf (s)\n", prof.calibrate);
+
+    printf("timestep loop:\t\t\t%.6lf (s)\n", loop);
+
+    if (sweep > 0.)
+    {
+      printf("  propagate/collide sweeps:\t%.6lf (s, mean over threads)\n", sweep / prof.nthreads);
+      printf("  waiting at barriers:\t\t%.6lf (s, mean over threads)\n", wait / prof.nthreads);
+    }
+
+    if (params.nranks > 1) printf("  waiting for ghost rows:\t%.6lf (s, rank 0)\n", prof.halo_wait);
+
+    if (params.frame_every > 0)
+    {
+      printf("  snapshot frames:\t\t%d, %.6lf (s) working them out, %.6lf (s) waiting for the writer\n",
+             frame.count, frame.copy, frame.wait);
+    }
+
+    printf("  accelerate_flow:\t\t%.6lf (s, summed over threads)\n", accel);
+    printf("reductions:\t\t\t%.6lf (s)\n", reduce);
+    printf("output:\t\t\t\t%.6lf (s)\n", output);
+    printf("MLUPS:\t\t\t\t%.2lf (%d fluid cells: %.2lf)\n", mlups, params.nfluid, (double)params.nfluid * steps / loop * 1e-6);
+    printf("bandwidth:\t\t\t%.2lf GB/s at %.0lf bytes per cell update", gbs, bytes);
+
+    if (params.peak_bw > 0.f)
+    {
+      printf(", %.1lf%% of %.2f GB/s%s", 100. * gbs / params.peak_bw, params.peak_bw,
+             params.calibrate ? " (triad)" : "");
+    }
+
+    printf("\n");
+
+    /* the fastest the loop could go if it were bound by that bandwidth */
+    if (params.peak_bw > 0.f) printf("memory roofline:\t\t%.2lf MLUPS\n", params.peak_bw * 1e3 / bytes);
+
+#ifdef USE_PAPI
+    for (int ee = 0; ee < PROF_EVENTS; ee++)
+    {
+      if (prof.counts[ee] < 0) printf("%s:\t\tnot available\n", prof_event_names[ee]);
+      else printf("%s:\t\t%lld (%.3lf per cell update)\n", prof_event_names[ee], prof.counts[ee], prof.counts[ee] / updates);
+    }
+#endif
+
+    /* how evenly the sweeps were shared out between the threads */
+    if (sweep > 0.)
+    {
+      printf("imbalance:\t\t\t%.3lf (slowest thread over mean)\n", sweep_max / (sweep / prof.nthreads));
+
+      /* and how evenly the schedules share out the estimated work */
+      if (by_rows)
+      {
+        printf("  modelled:\t\t\t%.3lf static, %.3lf weighted (largest share of the work over mean)\n",
+               sched.imbalance[SCHED_STATIC], sched.imbalance[SCHED_WEIGHTED]);
+      }
+
+      printf("thread\trows\twork\tsweep (s)\twait (s)\n");
+
+      for (int t = 0; t < prof.nthreads; t++)
+      {
+        const int bar = (int)(PROF_BAR * prof.thread[t].sweep / sweep_max + 0.5);
+
+        if (by_rows && t < sched.nthreads)
+        {
+          printf("%d\t%d\t%.1lf%%\t", t, sched.first[t + 1] - sched.first[t], 100. * sched.work[t] / work);
+        }
+        else
+        {
+          printf("%d\t-\t-\t", t);
+        }
+
+        printf("%.6lf\t%.6lf\t", prof.thread[t].sweep, prof.thread[t].wait);
+
+        for (int cc = 0; cc < bar; cc++) putchar('#');
+
+        putchar('\n');
+      }
+    }
+  }
+
+  _mm_free(prof.thread);
+}
+
+/* append a member to the list */
+static void ensemble_add(t_param** members, int* count, const t_param member)
+{
+  *members = (t_param*) realloc(*members, sizeof(t_param) * (*count + 1));
+
+  if (*members == NULL) die("cannot allocate memory for the ensemble", __LINE__, __FILE__);
+
+  if (member.maxIters < 1) die("ensemble member has no timesteps", __LINE__, __FILE__);
+
+  (*members)[*count] = member;
+  (*members)[*count].member = *count;
+  (*members)[*count].fixed_grid = select_fixed(member);
+  (*count)++;
+}
+
+t_param* ensemble_members(const t_param base, const char* listfile, int* count)
+{
+  static const char* keys[4] = { "density", "accel", "omega", "maxIters" };
+  char     message[1024];  /* message buffer */
+  char     line[4096];
+  t_param* members = NULL;
+  FILE*    fp = fopen(listfile, "r");
+
+  if (fp == NULL)
+  {
+    sprintf(message, "could not open ensemble file: %s", listfile);
+    die(message, __LINE__, __FILE__);
+  }
+
+  *count = 0;
+
+  while (fgets(line, sizeof(line), fp) != NULL)
+  {
+    char*   save;
+    char*   word = strtok_r(line, " \t\r\n", &save);
+    t_param member = base;
+
+    /* skip blank lines and comments */
+    if (word == NULL || word[0] == '#') continue;
+
+    if (strchr(word, '=') == NULL)
+    {
+      /* a parameter file of its own, whose obstacles are the ones given */
+      read_params(word, &member);
+
+      if (member.nx != base.nx || member.ny != base.global_ny)
+      {
+        sprintf(message, "ensemble member %s does not match the grid size", word);
+        die(message, __LINE__, __FILE__);
+      }
+
+      ensemble_add(&members, count, member);
+      continue;
+    }
+
+    /* a sweep over every combination of the values of each key */
+    float values[4][ENSEMBLE_VALUES];
+    int   nvalues[4] = { 0, 0, 0, 0 };
+    int   order[4];  /* the keys in the order they are listed */
+    int   nkeys = 0;
+    int   total = 1;
+
+    for (; word != NULL; word = strtok_r(NULL, " \t\r\n", &save))
+    {
+      char* value = strchr(word, '=');
+      char* vsave;
+      int   key = 0;
+
+      if (value == NULL) die("expected key=values in ensemble sweep", __LINE__, __FILE__);
+
+      *value++ = '\0';
+
+      while (key < 4 && strcmp(word, keys[key])) key++;
+
+      if (key == 4)
+      {
+        sprintf(message, "unknown parameter in ensemble sweep: %s", word);
+        die(message, __LINE__, __FILE__);
+      }
+
+      if (nvalues[key] == 0) order[nkeys++] = key;
+
+      for (char* v = strtok_r(value, ",", &vsave); v != NULL; v = strtok_r(NULL, ",", &vsave))
+      {
+        if (nvalues[key] == ENSEMBLE_VALUES) die("too many values in ensemble sweep", __LINE__, __FILE__);
+
+        values[key][nvalues[key]++] = atof(v);
+      }
+
+      if (nvalues[key] == 0) die("expected key=values in ensemble sweep", __LINE__, __FILE__);
+    }
+
+    for (int kk = 0; kk < nkeys; kk++) total *= nvalues[order[kk]];
+
+    /* the last key on the line varies fastest */
+    for (int mm = 0; mm < total; mm++)
+    {
+      int rest = mm;
+
+      member = base;
+
+      for (int kk = nkeys - 1; kk >= 0; kk--)
+      {
+        const int   key = order[kk];
+        const float value = values[key][rest % nvalues[key]];
+
+        rest /= nvalues[key];
+
+        if (key == 0) member.density = value;
+        else if (key == 1) member.accel = value;
+        else if (key == 2) member.omega = value;
+        else member.maxIters = (int)value;
+      }
+
+      ensemble_add(&members, count, member);
+    }
+  }
+
+  fclose(fp);
+
+  if (*count == 0) die("no parameter sets in ensemble file", __LINE__, __FILE__);
+
+  return members;
+}
+
+double ensemble(const t_param base, const t_param* members, const int count, uint8_t* obstacles)
+{
+  const int nthreads = omp_get_max_threads();
+  double    updates = 0.;  /* cell updates of all the members */
+
+  /* by default the threads are shared out evenly, fewer members than
+  ** threads each getting a larger group; a small grid runs faster on
+  ** one thread of its own than spread over many */
+  int group = (base.ensemble_threads > 0) ? base.ensemble_threads : nthreads / count;
+
+  if (group < 1) group = 1;
+
+  if (group > nthreads) group = nthreads;
+
+  const int ngroups = (nthreads / group < count) ? nthreads / group : count;
+
+  printf("ensemble of %d members on %d groups of %d threads\n", count, ngroups, group);
+
+  omp_set_max_active_levels(2);
+
+  #pragma omp parallel num_threads(ngroups) reduction(+:updates)
+  {
+    /* the nested teams of this thread's members */
+    omp_set_num_threads(group);
+
+    #pragma omp for schedule(dynamic, 1)
+    for (int mm = 0; mm < count; mm++)
+    {
+      const t_param params = members[mm];
+      t_speed       cells, tmp_cells;
+      float*        av_vels = (float*) _mm_malloc(sizeof(float) * params.maxIters, 32);
+
+      if (av_vels == NULL) die("cannot allocate memory for av_vels", __LINE__, __FILE__);
+
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        cells.speeds[kk] = alloc_plane(params);
+        tmp_cells.speeds[kk] = alloc_plane(params);
+
+        if (cells.speeds[kk] == NULL || tmp_cells.speeds[kk] == NULL)
+        {
+          die("cannot allocate memory for speed planes", __LINE__, __FILE__);
+        }
+      }
+
+      const double t0 = omp_get_wtime();
+      const float  final_av_vel = ensemble_run(params, &cells, &tmp_cells, obstacles, av_vels);
+      const double t1 = omp_get_wtime();
+
+      write_values(params, &cells, obstacles, av_vels);
+
+      #pragma omp critical
+      {
+        printf("member %d:\tdensity %g, accel %g, omega %g, %d timesteps: Reynolds number %.12E, %.6lf (s)\n",
+               params.member, params.density, params.accel, params.omega, params.maxIters,
+               calc_reynolds(params, final_av_vel), t1 - t0);
+        fflush(stdout);
+      }
+
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        free_plane(params, cells.speeds[kk]);
+        free_plane(params, tmp_cells.speeds[kk]);
+      }
+
+      _mm_free(av_vels);
+      updates += (double)params.nx * params.ny * params.maxIters;
+    }
+  }
+
+  return updates;
+}
+
+float ensemble_run(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles, float* av_vels)
+{
+  /* as the fused engine of main(): one parallel region for the whole
+  ** run, each thread keeping its shares of the average velocities */
+  const int   nthreads = omp_get_max_threads();
+  const int   ld = (params.maxIters + 15) / 16 * 16;
+  const float r_nfluid = 1.f / (float)params.nfluid;
+  float*      thread_vels = (float*) _mm_malloc(sizeof(float) * ld * nthreads, 64);
+
+  if (thread_vels == NULL) die("cannot allocate memory for thread_vels", __LINE__, __FILE__);
+
+  memset(thread_vels, 0, sizeof(float) * ld * nthreads);
+
+  initialise_speeds(params, cells, tmp_cells);
+
+  #pragma omp parallel
+  {
+    float*   vels = thread_vels + omp_get_thread_num() * ld;
+    t_speed* src  = cells;
+    t_speed* dst  = tmp_cells;
+
+    /* every later timestep is accelerated by the sweep before it */
+    #pragma omp single
+    accelerate_flow(params, cells, obstacles);
+
+    for (int tt = 0; tt < params.maxIters; tt++)
+    {
+      t_speed* swap;
+
+      vels[tt] = timestep_team(params, src, dst, obstacles, tt + 1 < params.maxIters);
+      swap = src;
+      src = dst;
+      dst = swap;
+    }
+  }
+
+  /* the final state is in tmp_cells after an odd number of timesteps */
+  if (params.maxIters % 2 == 1)
+  {
+    t_speed swap = *cells;
+    *cells = *tmp_cells;
+    *tmp_cells = swap;
+  }
+
+  for (int tt = 0; tt < params.maxIters; tt++)
+  {
+    float tot_u = 0.f;
+
+    for (int t = 0; t < nthreads; t++) tot_u += thread_vels[t*ld + tt];
+
+    av_vels[tt] = tot_u * r_nfluid;
+  }
+
+  _mm_free(thread_vels);
+
+  return av_vels[params.maxIters - 1];
+}
+
+void die(const char* message, const int line, const char* file)
+{
+  fprintf(stderr, "Error at line %d of file %s:\n", line, file);
+  fprintf(stderr, "%s\n", message);
+  fflush(stderr);
+#ifdef USE_MPI
+  MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+#endif
+  exit(EXIT_FAILURE);
+}
+
+void ranks_init(int* argc, char*** argv, t_param* params)
+{
+  params->rank = 0;
+  params->nranks = 1;
+#ifdef USE_MPI
+  int provided;  /* level of thread support the library has */
+
+  /* only the master thread makes MPI calls */
+  MPI_Init_thread(argc, argv, MPI_THREAD_FUNNELED, &provided);
+
+  if (provided < MPI_THREAD_FUNNELED) die("MPI library does not support threads", __LINE__, __FILE__);
+
+  MPI_Comm_rank(MPI_COMM_WORLD, &params->rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &params->nranks);
+#else
+  (void) argc;
+  (void) argv;
+#endif
+}
+
+void ranks_finalise(void)
+{
+#ifdef USE_MPI
+  MPI_Finalize();
+#endif
+}
+
+void ranks_barrier(void)
+{
+#ifdef USE_MPI
+  MPI_Barrier(MPI_COMM_WORLD);
+#endif
+}
+
+int ranks_sum_int(const int value)
+{
+  int sum = value;
+#ifdef USE_MPI
+  MPI_Allreduce(&value, &sum, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+#endif
+  return sum;
+}
+
+float ranks_sum(const float value)
+{
+  float sum = value;
+#ifdef USE_MPI
+  MPI_Allreduce(&value, &sum, 1, MPI_FLOAT, MPI_SUM, MPI_COMM_WORLD);
+#endif
+  return sum;
+}
+
+/* sum values element-wise over the ranks, leaving the result on rank 0 */
+void ranks_reduce(float* values, const int n)
+{
+#ifdef USE_MPI
+  int rank;
+
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Reduce((rank == 0) ? MPI_IN_PLACE : values, values, n, MPI_FLOAT, MPI_SUM, 0, MPI_COMM_WORLD);
+#else
+  (void) values;
+  (void) n;
+#endif
+}
+
+void parse_option(const char* exe, const char* arg, t_param* params)
+{
+  if (!strcmp(arg, "--layout=plain"))
+  {
+    params->layout = LAYOUT_PLAIN;
+  }
+  else if (!strcmp(arg, "--layout=halo"))
+  {
+    params->layout = LAYOUT_HALO;
+  }
+  else if (!strcmp(arg, "--layout=aosoa"))
+  {
+    params->layout = LAYOUT_AOSOA;
+  }
+  else if (!strcmp(arg, "--engine=fused"))
+  {
+    params->engine = ENGINE_FUSED;
+  }
+  else if (!strcmp(arg, "--engine=tblock"))
+  {
+    params->engine = ENGINE_TBLOCK;
+  }
+  else if (!strcmp(arg, "--engine=aa"))
+  {
+    params->engine = ENGINE_AA;
+  }
+  else if (!strcmp(arg, "--engine=sparse"))
+  {
+    params->engine = ENGINE_SPARSE;
+  }
+  else if (!strcmp(arg, "--engine=offload"))
+  {
+    params->engine = ENGINE_OFFLOAD;
+  }
+  else if (!strncmp(arg, "--simd=", 7))
+  {
+    if (!strcmp(arg + 7, "auto")) params->simd = SIMD_AUTO;
+    else if (!strcmp(arg + 7, "off")) params->simd = SIMD_OFF;
+    else if (!strcmp(arg + 7, "avx2")) params->simd = SIMD_AVX2;
+    else if (!strcmp(arg + 7, "avx512")) params->simd = SIMD_AVX512;
+    else usage(exe);
+  }
+  else if (!strncmp(arg, "--tblock-depth=", 15))
+  {
+    params->tblock_depth = atoi(arg + 15);
+
+    if (params->tblock_depth < 1 || params->tblock_depth > TBLOCK_MAX_DEPTH)
+      die("temporal block depth out of range", __LINE__, __FILE__);
+  }
+  else if (!strncmp(arg, "--storage=", 10))
+  {
+    if (!strcmp(arg + 10, "fp32")) params->storage = STORAGE_FP32;
+    else if (!strcmp(arg + 10, "fp16")) params->storage = STORAGE_FP16;
+    else if (!strcmp(arg + 10, "bf16")) params->storage = STORAGE_BF16;
+    else if (!strcmp(arg + 10, "delta16")) params->storage = STORAGE_DELTA16;
+    else usage(exe);
+  }
+  else if (!strncmp(arg, "--checkpoint=", 13))
+  {
+    params->checkpoint_every = atoi(arg + 13);
+
+    if (params->checkpoint_every < 1) die("checkpoint interval out of range", __LINE__, __FILE__);
+  }
+  else if (!strncmp(arg, "--converge=", 11))
+  {
+    params->converge_tol = atof(arg + 11);
+
+    if (!(params->converge_tol > 0.f)) die("convergence tolerance out of range", __LINE__, __FILE__);
+  }
+  else if (!strncmp(arg, "--converge-window=", 18))
+  {
+    params->converge_window = atoi(arg + 18);
+
+    if (params->converge_window < 1) die("convergence window out of range", __LINE__, __FILE__);
+  }
+  else if (!strncmp(arg, "--warm-start=", 13))
+  {
+    params->warm_factor = atoi(arg + 13);
+
+    if (params->warm_factor < 2) die("warm start coarsening out of range", __LINE__, __FILE__);
+  }
+  else if (!strncmp(arg, "--warm-iters=", 13))
+  {
+    params->warm_iters = atoi(arg + 13);
+
+    if (params->warm_iters < 1) die("warm start timesteps out of range", __LINE__, __FILE__);
+  }
+  else if (!strncmp(arg, "--warmup=", 9))
+  {
+    params->warmup_iters = atoi(arg + 9);
+
+    if (params->warmup_iters < 1) die("warm-up timesteps out of range", __LINE__, __FILE__);
+  }
+  else if (!strncmp(arg, "--checkpoint-file=", 18))
+  {
+    params->checkpoint_file = arg + 18;
+  }
+  else if (!strncmp(arg, "--restart=", 10))
+  {
+    params->restart_file = arg + 10;
+  }
+  else if (!strncmp(arg, "--output=", 9))
+  {
+    if (!strcmp(arg + 9, "ascii")) params->output = OUTPUT_ASCII;
+    else if (!strcmp(arg + 9, "binary")) params->output = OUTPUT_BINARY;
+    else usage(exe);
+  }
+  else if (!strncmp(arg, "--frames=", 9))
+  {
+    params->frame_every = atoi(arg + 9);
+
+    if (params->frame_every < 1) die("frame interval out of range", __LINE__, __FILE__);
+  }
+  else if (!strncmp(arg, "--frame-file=", 13))
+  {
+    params->frame_file = arg + 13;
+  }
+  else if (!strncmp(arg, "--frame-format=", 15))
+  {
+    if (!strcmp(arg + 15, "vtk")) params->frame_format = FRAME_VTK;
+    else if (!strcmp(arg + 15, "npy")) params->frame_format = FRAME_NPY;
+    else usage(exe);
+  }
+  else if (!strncmp(arg, "--save-obstacles=", 17))
+  {
+    params->obstacle_save = arg + 17;
+  }
+  else if (!strcmp(arg, "--diag-stream"))
+  {
+    params->diag_stream = 1;
+  }
+  else if (!strncmp(arg, "--diag-stride=", 14))
+  {
+    params->diag_stream = 1;
+    params->diag_stride = atoi(arg + 14);
+
+    if (params->diag_stride < 1) die("diagnostics stride out of range", __LINE__, __FILE__);
+  }
+  else if (!strcmp(arg, "--diag-extra"))
+  {
+    params->diag_stream = 1;
+    params->diag_extra = 1;
+  }
+  else if (!strcmp(arg, "--profile"))
+  {
+    params->profile = 1;
+  }
+  else if (!strncmp(arg, "--peak-bw=", 10))
+  {
+    params->peak_bw = atof(arg + 10);
+
+    if (!(params->peak_bw > 0.f)) die("peak bandwidth out of range", __LINE__, __FILE__);
+  }
+  else if (!strcmp(arg, "--calibrate"))
+  {
+    params->profile = 1;
+    params->calibrate = 1;
+  }
+  else if (!strcmp(arg, "--hugepages"))
+  {
+    params->hugepages = 1;
+  }
+  else if (!strcmp(arg, "--thread-map"))
+  {
+    params->thread_map = 1;
+  }
+  else if (!strcmp(arg, "--fixed=auto"))
+  {
+    params->fixed = 1;
+  }
+  else if (!strcmp(arg, "--fixed=off"))
+  {
+    params->fixed = 0;
+  }
+  else if (!strncmp(arg, "--ensemble=", 11))
+  {
+    params->ensemble_file = arg + 11;
+  }
+  else if (!strncmp(arg, "--ensemble-threads=", 19))
+  {
+    params->ensemble_threads = atoi(arg + 19);
+
+    if (params->ensemble_threads < 1) die("threads per ensemble member out of range", __LINE__, __FILE__);
+  }
+  else if (!strcmp(arg, "--tile=off"))
+  {
+    params->tile_w = params->tile_h = TILE_OFF;
+  }
+  else if (!strcmp(arg, "--tile=auto"))
+  {
+    params->tile_w = params->tile_h = TILE_AUTO;
+  }
+  else if (!strncmp(arg, "--tile=", 7))
+  {
+    if (sscanf(arg + 7, "%dx%d", &params->tile_w, &params->tile_h) != 2 || params->tile_w < 1 || params->tile_h < 1)
+      die("tile size out of range", __LINE__, __FILE__);
+  }
+  else if (!strcmp(arg, "--schedule=static"))
+  {
+    params->schedule = SCHED_STATIC;
+  }
+  else if (!strcmp(arg, "--schedule=weighted"))
+  {
+    params->schedule = SCHED_WEIGHTED;
+  }
+  else if (!strncmp(arg, "--tblock-rows=", 14))
+  {
+    params->tblock_rows = atoi(arg + 14);
+
+    if (params->tblock_rows < 0) die("temporal block rows out of range", __LINE__, __FILE__);
+  }
+  else
+  {
+    fprintf(stderr, "Unknown option: %s\n", arg);
+    usage(exe);
+  }
+}
+
+int select_simd(const int requested)
+{
+  int best = SIMD_OFF;  /* widest instruction set this CPU and build support */
+
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) best = SIMD_AVX2;
+
+  if (__builtin_cpu_supports("avx512f")) best = SIMD_AVX512;
+#endif
+
+  if (requested == SIMD_AUTO) return best;
+
+  if (requested > best) die("requested instruction set is not supported here", __LINE__, __FILE__);
+
+  return requested;
 }
 
 void usage(const char* exe)
 {
-  fprintf(stderr, "Usage: %s <paramfile> <obstaclefile>\n", exe);
+  fprintf(stderr, "Usage: %s <paramfile> <obstaclefile> [options]\n", exe);
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  --layout=plain|halo|aosoa\n");
+  fprintf(stderr, "                        lattice layout (default: plain)\n");
+  fprintf(stderr, "  --engine=fused|tblock|aa|sparse|offload\n");
+  fprintf(stderr, "                        time-stepping engine (default: fused)\n");
+  fprintf(stderr, "  --simd=auto|off|avx2|avx512\n");
+  fprintf(stderr, "                        hand-vectorised row kernel (default: auto)\n");
+  fprintf(stderr, "  --fixed=auto|off      kernels compiled for the grid size, if it has them (default: auto)\n");
+  fprintf(stderr, "  --tblock-depth=K      timesteps per temporal block (default: 4)\n");
+  fprintf(stderr, "  --tblock-rows=H       rows per temporal block band (default: ny / threads)\n");
+  fprintf(stderr, "  --tile=WxH|auto|off\n");
+  fprintf(stderr, "                        sweep the fused engine in tiles of W by H cells (default: off)\n");
+  fprintf(stderr, "  --schedule=static|weighted\n");
+  fprintf(stderr, "                        share rows between threads equally or by estimated work (default: static)\n");
+  fprintf(stderr, "  --storage=fp32|fp16|bf16|delta16\n");
+  fprintf(stderr, "                        distribution storage between timesteps (default: fp32)\n");
+  fprintf(stderr, "  --checkpoint=N        write a checkpoint every N timesteps\n");
+  fprintf(stderr, "  --checkpoint-file=F   checkpoint file name (default: %s)\n", CHECKPOINTFILE);
+  fprintf(stderr, "  --restart=F           carry on from checkpoint file F\n");
+  fprintf(stderr, "  --converge=TOL        stop once av_vels changes by less than TOL of itself over a window\n");
+  fprintf(stderr, "  --converge-window=W   timesteps in that window (default: 1000)\n");
+  fprintf(stderr, "  --warm-start=N        start from the flow of a grid N times coarser\n");
+  fprintf(stderr, "  --warm-iters=M        timesteps of that coarse run (default: maxIters)\n");
+  fprintf(stderr, "  --output=ascii|binary\n");
+  fprintf(stderr, "                        final state as text or as NumPy .npy files (default: ascii)\n");
+  fprintf(stderr, "  --frames=N            write the density and velocity every N timesteps, as frames\n");
+  fprintf(stderr, "  --frame-file=F        frames are named F_<timestep> (default: %s)\n", FRAMEFILE);
+  fprintf(stderr, "  --frame-format=vtk|npy\n");
+  fprintf(stderr, "                        frames as legacy VTK or NumPy .npy files (default: vtk)\n");
+  fprintf(stderr, "  --save-obstacles=F    also write the obstacles to F as a binary bitmap\n");
+  fprintf(stderr, "  --diag-stream         write av_vels.dat during the run instead of at the end\n");
+  fprintf(stderr, "  --diag-stride=S       stream every S'th timestep's av_vels (default: 1)\n");
+  fprintf(stderr, "  --diag-extra          stream max |u|, total density and vorticity norm too\n");
+  fprintf(stderr, "  --profile             report the time of each phase, MLUPS and bandwidth\n");
+  fprintf(stderr, "  --peak-bw=GBS         memory bandwidth for the profile to compare against\n");
+  fprintf(stderr, "  --calibrate           measure that bandwidth with a STREAM triad first\n");
+  fprintf(stderr, "  --warmup=N            run N timesteps and start again from rest before the timed run\n");
+  fprintf(stderr, "  --hugepages           back the lattice with transparent huge pages\n");
+  fprintf(stderr, "  --thread-map          print the core and NUMA node of every thread\n");
+  fprintf(stderr, "  --ensemble=F          run every parameter set listed in F side by side\n");
+  fprintf(stderr, "  --ensemble-threads=T  threads per ensemble member (default: shared out evenly)\n");
   exit(EXIT_FAILURE);
 }
@@ -1,6 +1,7 @@
 # Add any `module load` or `export` commands that your code needs to
 # compile and run to this file.
 export OMP_PROC_BIND=true
+export OMP_PLACES=cores
 export OMP_NUM_THREADS=28
 module load languages/intel/2018-u3
 module load GCC/7.2.0-2.29
\ No newline at end of file